@@ -0,0 +1,136 @@
+// PLM002 controller simulator, serves a pseudo terminal until interrupted
+//   plm002_sim [-d ack_delay_us] [-j ack_jitter_us] [-c done_delay_us]
+//              [-e corrupt_rate] [-x drop_rate] [-s seed] [-i] [-b moves]
+// -i makes moves complete instantly instead of lasting steps / step rate
+// -b sends given number of zero length moves in each transmit mode to the
+//    simulator itself and prints command latency per mode, then exits
+
+#define STEPPER_NO_MAIN
+#include "try.c"
+
+#include <signal.h>
+
+volatile sig_atomic_t plm002_sim_interrupted = 0;
+
+// ---------------------------------------------------------------------------
+void plm002_sim_signal_handler(int signal_number)
+{
+  plm002_sim_interrupted = signal_number;
+}
+
+// ---------------------------------------------------------------------------
+// command latency of both transmit modes, from first byte to completion byte
+int plm002_sim_benchmark(struct plm002_sim_struc *sim, int moves)
+{
+  const char *names[2] = {"per-byte", "frame"};
+  int modes[2] = {STEPPER_TX_PER_BYTE, STEPPER_TX_FRAME};
+  struct rs232_port_struc port;
+  struct stepper_protocol_struc proto;
+  long long t0_us;
+  long long latency_us;
+  long long min_us;
+  long long max_us;
+  double sum_us;
+  int failed;
+  int mode;
+  int i;
+
+  if (rs232_open(&port, sim->s_slave_name) < 0) return -1;
+
+  for (mode = 0; mode < 2; mode++)
+  {
+    stepper_set_tx_mode(modes[mode]);
+    min_us = 0;
+    max_us = 0;
+    sum_us = 0;
+    failed = 0;
+
+    for (i = 0; i < moves; i++)
+    {
+      t0_us = rs232_now_us();
+      stepper_protocol_init(&proto, 0, 0, 3200, t0_us + stepper_move_budget_us(0, 0, 3200));
+      if (stepper_protocol_run(&proto, port.pt_fd) != STEPPER_MOVE_OK)
+      {
+        failed ++;
+        continue;
+      }
+
+      latency_us = rs232_now_us() - t0_us;
+      if ((min_us == 0) || (latency_us < min_us)) min_us = latency_us;
+      if (latency_us > max_us) max_us = latency_us;
+      sum_us += latency_us;
+    }
+
+    printf("%-8s moves %d failed %d latency us: mean %.1f min %lld max %lld\n", names[mode], moves, failed,
+      (moves > failed) ? sum_us / (moves - failed) : 0.0, min_us, max_us);
+  }
+
+  rs232_close(&port);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  int i;
+  int benchmark_moves = 0;
+  struct plm002_sim_config_struc config;
+  struct plm002_sim_struc sim;
+
+  memset(&config, 0, sizeof(config));
+  config.ack_delay_us = 500;
+  config.model_motion = 1;
+
+  for (i = 1; i < argc; i++)
+  {
+    if ((strcmp(argv[i], "-i") == 0))
+    {
+      config.model_motion = 0;
+    } else
+    if ((i + 1 < argc) && (argv[i][0] == '-') && (strlen(argv[i]) == 2) && strchr("djcexsb", argv[i][1]))
+    {
+      switch (argv[i][1])
+      {
+        case 'd': config.ack_delay_us = atoi(argv[i+1]); break;
+        case 'j': config.ack_jitter_us = atoi(argv[i+1]); break;
+        case 'c': config.done_delay_us = atoi(argv[i+1]); break;
+        case 'e': config.corrupt_rate = atof(argv[i+1]); break;
+        case 'x': config.drop_rate = atof(argv[i+1]); break;
+        case 's': config.seed = (unsigned int)strtoul(argv[i+1], NULL, 0); break;
+        case 'b': benchmark_moves = atoi(argv[i+1]); break;
+      }
+      i++;
+    } else
+    {
+      fprintf(stderr, "Usage: %s [-d ack_delay_us] [-j ack_jitter_us] [-c done_delay_us] [-e corrupt_rate] [-x drop_rate] [-s seed] [-i] [-b moves]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (plm002_sim_start(&sim, &config) < 0) return 2;
+
+  if (benchmark_moves > 0)
+  {
+    i = plm002_sim_benchmark(&sim, benchmark_moves);
+    plm002_sim_stop(&sim);
+    return (i < 0) ? 3 : 0;
+  }
+
+  signal(SIGINT, plm002_sim_signal_handler);
+  signal(SIGTERM, plm002_sim_signal_handler);
+
+  printf("%s\n", sim.s_slave_name);
+  fflush(stdout);
+
+  while (! plm002_sim_interrupted)
+  {
+    pause();
+  }
+
+  plm002_sim_stop(&sim);
+
+  fprintf(stderr, "frames %ld, bytes %ld, position %ld, corrupted %ld, dropped %ld, resyncs %ld, overflows %ld\n",
+    sim.s_frames, sim.s_bytes, sim.s_position, sim.s_corrupted, sim.s_dropped, sim.s_resyncs, sim.s_overflows);
+
+  return 0;
+}
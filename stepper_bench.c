@@ -0,0 +1,275 @@
+// Benchmarks of calibration tables and serial round trips, one JSON object per
+// line on stdout so results of releases can be compared by scripts
+//   stepper_bench [-m max_rows] [-l lookups] [-r moves] [-t tmp_dir]
+// Tables of 1e3 .. max_rows (default 1e7) rows are generated from a fixed seed,
+// loaded as text and as binary and looked up at pseudo random wavelengths.
+// Round trips are zero length moves sent by stepper_rotate to the simulator on
+// a pseudo terminal, in both transmit modes. Progress goes to stderr.
+
+#define STEPPER_NO_MAIN
+#include "try.c"
+
+#define STEPPER_BENCH_VERSION (1)
+
+// ---------------------------------------------------------------------------
+// fixed sequence, same tables and lookups on every run
+unsigned int stepper_bench_random(unsigned int *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+// ---------------------------------------------------------------------------
+long long stepper_bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------------
+int stepper_bench_compare(const void *a, const void *b)
+{
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+
+  return (x > y) - (x < y);
+}
+
+// ---------------------------------------------------------------------------
+// smooth monotonic dispersion curve 400 .. 900 nm with small noise
+int stepper_bench_make_table(char *filename, int rows)
+{
+  unsigned int seed = 12345;
+  double x;
+  FILE *file;
+  int i;
+
+  if ((file = fopen(filename, "w")) == NULL)
+  {
+    fprintf(stderr, "**Error**: stepper_bench_make_table: Cannot create %s\n", filename);
+    return -1;
+  }
+
+  for (i = 0; i < rows; i++)
+  {
+    x = (double)i / rows;
+    fprintf(file, "%d\t%.6f\n", i * 3, 400.0 + 450.0 * x + 50.0 * x * x + (stepper_bench_random(&seed) % 1000) * 1e-9);
+  }
+
+  if (fclose(file) != 0)
+  {
+    fprintf(stderr, "**Error**: stepper_bench_make_table: Cannot write %s\n", filename);
+    return -2;
+  }
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// text load, binary load and lookups for one table size
+int stepper_bench_table(char *tmp_dir, int rows, int lookups)
+{
+  char text_name[512];
+  char binary_name[512];
+  struct wl_cal_context_struc *wl_cal_context = NULL;
+  long long times_ns[50];
+  long long t0_ns;
+  unsigned int seed = 54321;
+  double *wavelengths;
+  int reps;
+  int step;
+  int failed = 0;
+  int result;
+  int i;
+
+  SNPRINTF(text_name, sizeof(text_name), "%s/bench_%d.txt", tmp_dir, rows);
+  SNPRINTF(binary_name, sizeof(binary_name), "%s/bench_%d.wlcb", tmp_dir, rows);
+
+  fprintf(stderr, "table of %d rows\n", rows);
+  result = stepper_bench_make_table(text_name, rows);
+  if (result < 0) return result;
+
+  // small tables load in microseconds, repeat them for stable figures
+  reps = 1000000 / rows;
+  if (reps > 50) reps = 50;
+  if (reps < 3) reps = 3;
+
+  result = wl_cal_allocate_context(&wl_cal_context);
+  if (result < 0) goto done;
+
+  for (i = 0; i < reps; i++)
+  {
+    t0_ns = stepper_bench_now_ns();
+    result = wl_cal_read_table_file(wl_cal_context, text_name);
+    times_ns[i] = stepper_bench_now_ns() - t0_ns;
+    if (result < 0) goto done;
+  }
+  qsort(times_ns, reps, sizeof(long long), stepper_bench_compare);
+  printf("{\"bench\": \"load_text\", \"rows\": %d, \"reps\": %d, \"min_ms\": %.3f, \"median_ms\": %.3f, \"median_ns_per_row\": %.1f}\n",
+    rows, reps, times_ns[0] / 1e6, times_ns[reps / 2] / 1e6, (double)times_ns[reps / 2] / rows);
+
+  result = wl_cal_write_table_binary(wl_cal_context, binary_name);
+  if (result < 0) goto done;
+
+  for (i = 0; i < reps; i++)
+  {
+    t0_ns = stepper_bench_now_ns();
+    result = wl_cal_open_table_file(wl_cal_context, binary_name);
+    times_ns[i] = stepper_bench_now_ns() - t0_ns;
+    if (result < 0) goto done;
+  }
+  qsort(times_ns, reps, sizeof(long long), stepper_bench_compare);
+  printf("{\"bench\": \"load_binary\", \"rows\": %d, \"reps\": %d, \"min_ms\": %.3f, \"median_ms\": %.3f, \"median_ns_per_row\": %.1f}\n",
+    rows, reps, times_ns[0] / 1e6, times_ns[reps / 2] / 1e6, (double)times_ns[reps / 2] / rows);
+
+  // table from the text file again, as instruments normally run
+  result = wl_cal_read_table_file(wl_cal_context, text_name);
+  if (result < 0) goto done;
+
+  if ((wavelengths = (double *)malloc(lookups * sizeof(double))) == NULL)
+  {
+    fprintf(stderr, "**Error**: stepper_bench_table: Failed to allocate memory for wavelengths\n");
+    result = -3;
+    goto done;
+  }
+  for (i = 0; i < lookups; i++) wavelengths[i] = 401.0 + (stepper_bench_random(&seed) % 1000000) * 498e-6;
+
+  // first lookup may build index or lut
+  wl_cal_wl2step(wl_cal_context, 650.0, &step);
+
+  t0_ns = stepper_bench_now_ns();
+  for (i = 0; i < lookups; i++)
+  {
+    if (wl_cal_wl2step(wl_cal_context, wavelengths[i], &step) < 0) failed ++;
+  }
+  printf("{\"bench\": \"wl2step\", \"rows\": %d, \"lookups\": %d, \"failed\": %d, \"ns_per_lookup\": %.1f}\n",
+    rows, lookups, failed, (double)(stepper_bench_now_ns() - t0_ns) / lookups);
+  free(wavelengths);
+
+done:
+  if (wl_cal_context != NULL) wl_cal_free_context(&wl_cal_context);
+  remove(text_name);
+  remove(binary_name);
+  return result;
+}
+
+// ---------------------------------------------------------------------------
+// stepper_rotate of zero length moves, latency from call to return
+int stepper_bench_rotate(int moves)
+{
+  const char *names[2] = {"per-byte", "frame"};
+  int modes[2] = {STEPPER_TX_PER_BYTE, STEPPER_TX_FRAME};
+  struct plm002_sim_config_struc config;
+  struct plm002_sim_struc sim;
+  struct rs232_port_struc port;
+  long long *latency_us;
+  long long t0_us;
+  double sum_us;
+  int count;
+  int failed;
+  int mode;
+  int i;
+
+  if ((latency_us = (long long *)malloc(moves * sizeof(long long))) == NULL)
+  {
+    fprintf(stderr, "**Error**: stepper_bench_rotate: Failed to allocate memory for latencies\n");
+    return -1;
+  }
+
+  memset(&config, 0, sizeof(config));
+  config.seed = 1;
+  if (plm002_sim_start(&sim, &config) < 0)
+  {
+    free(latency_us);
+    return -2;
+  }
+
+  if (rs232_open(&port, sim.s_slave_name) < 0)
+  {
+    plm002_sim_stop(&sim);
+    free(latency_us);
+    return -3;
+  }
+
+  for (mode = 0; mode < 2; mode++)
+  {
+    fprintf(stderr, "%d round trips, %s\n", moves, names[mode]);
+    stepper_set_tx_mode(modes[mode]);
+    count = 0;
+    failed = 0;
+    sum_us = 0;
+
+    for (i = 0; i < moves; i++)
+    {
+      t0_us = rs232_now_us();
+      if (stepper_rotate(port.pt_fd, 0, 0, 3200) != STEPPER_MOVE_OK)
+      {
+        failed ++;
+        continue;
+      }
+      latency_us[count] = rs232_now_us() - t0_us;
+      sum_us += latency_us[count];
+      count ++;
+    }
+
+    qsort(latency_us, count, sizeof(long long), stepper_bench_compare);
+    printf("{\"bench\": \"rotate\", \"tx_mode\": \"%s\", \"moves\": %d, \"failed\": %d, \"mean_us\": %.1f, "
+      "\"min_us\": %lld, \"p50_us\": %lld, \"p99_us\": %lld, \"max_us\": %lld}\n", names[mode], moves, failed,
+      count ? sum_us / count : 0.0, count ? latency_us[0] : 0, count ? latency_us[count / 2] : 0,
+      count ? latency_us[count * 99 / 100] : 0, count ? latency_us[count - 1] : 0);
+  }
+
+  stepper_set_tx_mode(STEPPER_TX_PER_BYTE);
+  rs232_close(&port);
+  plm002_sim_stop(&sim);
+  free(latency_us);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  char *tmp_dir = "/tmp";
+  int max_rows = 10000000;
+  int lookups = 1000000;
+  int moves = 200;
+  int rows;
+  int result;
+  int i;
+
+  for (i = 1; i < argc; i++)
+  {
+    if ((strcmp(argv[i], "-m") == 0) && (i + 1 < argc)) max_rows = atoi(argv[++i]); else
+    if ((strcmp(argv[i], "-l") == 0) && (i + 1 < argc)) lookups = atoi(argv[++i]); else
+    if ((strcmp(argv[i], "-r") == 0) && (i + 1 < argc)) moves = atoi(argv[++i]); else
+    if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc)) tmp_dir = argv[++i]; else
+    {
+      fprintf(stderr, "Usage: %s [-m max_rows] [-l lookups] [-r moves] [-t tmp_dir]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if ((max_rows < 1000) || (lookups < 1) || (moves < 1))
+  {
+    fprintf(stderr, "**Error**: main: Need at least 1000 rows, one lookup and one move\n");
+    return 1;
+  }
+
+  printf("{\"bench\": \"meta\", \"version\": %d, \"compiler\": \"%s\", \"max_rows\": %d, \"lookups\": %d, \"moves\": %d}\n",
+    STEPPER_BENCH_VERSION, __VERSION__, max_rows, lookups, moves);
+
+  for (rows = 1000; rows <= max_rows; rows *= 10)
+  {
+    result = stepper_bench_table(tmp_dir, rows, lookups);
+    if (result < 0) return 2;
+  }
+
+  result = stepper_bench_rotate(moves);
+  if (result < 0) return 3;
+
+  return 0;
+}
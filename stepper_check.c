@@ -0,0 +1,923 @@
+// Self checks of frame encoding, planning and motor bookkeeping, no hardware
+// needed; prints failed checks and exits with their number
+//   stepper_check
+
+#define STEPPER_NO_MAIN
+#include "try.c"
+
+#include <sys/socket.h>
+
+int stepper_check_failed = 0;
+
+#define STEPPER_CHECK(condition) stepper_check_expect((condition), #condition, __LINE__)
+
+// ---------------------------------------------------------------------------
+void stepper_check_expect(int condition, const char *text, int line)
+{
+  if (condition) return;
+
+  fprintf(stderr, "**Error**: line %d: %s\n", line, text);
+  stepper_check_failed ++;
+}
+
+// ---------------------------------------------------------------------------
+// scratch file in /tmp, name unique per process and tag
+char *stepper_check_file(const char *tag, const char *text, size_t length)
+{
+  static char name[256];
+  FILE *file;
+
+  SNPRINTF(name, sizeof(name), "/tmp/stepper_check_%d_%s", (int)getpid(), tag);
+  if ((file = fopen(name, "wb")) == NULL) return name;
+  fwrite(text, 1, length, file);
+  fclose(file);
+
+  return name;
+}
+
+// ---------------------------------------------------------------------------
+// radix sort orders any steps, negative ones included, and keeps equal steps
+// in file order; rows sharing a step are merged into their mean
+void stepper_check_sort_table(void)
+{
+  const char *table = "30\t630.0\n-10\t590.0\n10\t610.0\n10\t612.0\n20\t620.0\n10\t614.0\n";
+  struct wl_cal_point_struc points[1000];
+  struct wl_cal_context_struc *wl_cal_context;
+  unsigned int seed = 1;
+  char *name;
+  int ordered = 1;
+  int i;
+
+  for (i = 0; i < 1000; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    points[i].step = (int)(seed >> 8) - (1 << 23) + ((i % 3) ? 0 : 0x40000000);
+    if (i % 5 == 0) points[i].step = 77;
+    points[i].wavelength = i;
+  }
+  STEPPER_CHECK(wl_cal_radix_sort_points(points, 1000) == 0);
+  for (i = 0; i < 999; i++)
+  {
+    if (points[i].step > points[i + 1].step) ordered = 0;
+    if ((points[i].step == points[i + 1].step) && (points[i].wavelength > points[i + 1].wavelength)) ordered = 0;
+  }
+  STEPPER_CHECK(ordered);
+
+  name = stepper_check_file("sort.txt", table, strlen(table));
+  wl_cal_allocate_context(&wl_cal_context);
+  STEPPER_CHECK(wl_cal_read_table_file(wl_cal_context, name) == 0);
+  STEPPER_CHECK(wl_cal_context->cal_data_size == 4);
+  STEPPER_CHECK((wl_cal_context->cal_data[0].step == -10) && (wl_cal_context->cal_data[3].step == 30));
+  STEPPER_CHECK((wl_cal_context->cal_data[1].step == 10) && (fabs(wl_cal_context->cal_data[1].wavelength - 612.0) < 1e-9));
+  wl_cal_free_context(&wl_cal_context);
+  remove(name);
+}
+
+// ---------------------------------------------------------------------------
+// number parser agrees with strtod, rejected lines are reported by their number
+void stepper_check_parse_table(void)
+{
+  const char *numbers[] = {"656.2808", "-0.5", "1e3", "4.5E-2", "0.000000000000000000001234",
+    "123456789012345678901234567890", "3.14159265358979323846264338327950288419716939937510582097494459", "7"};
+  const char *table = "# header\n10\t600.5\n\n20 x\n30\t610.5\n40\tinf\n50\t620.5 junk\n60\t630.5\r\n70\tnan\n";
+  struct wl_cal_context_struc *wl_cal_context;
+  const char *p;
+  double v;
+  char *name;
+  char line[128];
+  FILE *saved;
+  FILE *log;
+  int i;
+
+  for (i = 0; i < (int)(sizeof(numbers) / sizeof(numbers[0])); i++)
+  {
+    p = numbers[i];
+    STEPPER_CHECK((wl_cal_parse_double(&p, numbers[i] + strlen(numbers[i]), &v) == 0) && (v == strtod(numbers[i], NULL)));
+    STEPPER_CHECK(p == numbers[i] + strlen(numbers[i]));
+  }
+  p = "inf";
+  STEPPER_CHECK(wl_cal_parse_double(&p, p + 3, &v) == -3);
+  p = "1e999";
+  STEPPER_CHECK(wl_cal_parse_double(&p, p + 5, &v) == -3);
+
+  // rejected rows go to stderr with their line numbers
+  name = stepper_check_file("parse.txt", table, strlen(table));
+  log = tmpfile();
+  saved = stderr;
+  stderr = log;
+  wl_cal_allocate_context(&wl_cal_context);
+  i = wl_cal_read_table_file(wl_cal_context, name);
+  stderr = saved;
+
+  STEPPER_CHECK((i == 0) && (wl_cal_context->cal_data_size == 3));
+  rewind(log);
+  i = 0;
+  while (fgets(line, sizeof(line), log) != NULL)
+  {
+    if (strstr(line, "line 4 rejected, wavelength is not a number") || strstr(line, "line 6 rejected, wavelength is not finite") ||
+      strstr(line, "line 7 rejected, unexpected text") || strstr(line, "line 9 rejected, wavelength is not finite")) i++;
+  }
+  STEPPER_CHECK(i == 4);
+
+  fclose(log);
+  wl_cal_free_context(&wl_cal_context);
+  remove(name);
+}
+
+// ---------------------------------------------------------------------------
+// copy of a binary table with header patched by caller, header checksum redone
+int stepper_check_patched_binary(const char *source, const char *tag, UINT64 x_step_offset, int payload_flip,
+  struct wl_cal_context_struc *wl_cal_context)
+{
+  struct wl_cal_bin_header_struc *header;
+  char *image;
+  long length;
+  FILE *file;
+  char *name;
+  int result;
+
+  file = fopen(source, "rb");
+  fseek(file, 0, SEEK_END);
+  length = ftell(file);
+  rewind(file);
+  image = (char *)malloc(length);
+  if (fread(image, 1, length, file) != (size_t)length) length = 0;
+  fclose(file);
+
+  header = (struct wl_cal_bin_header_struc *)image;
+  if (x_step_offset) header->x_step_offset = x_step_offset;
+  header->header_checksum = wl_cal_fnv1a(WL_CAL_FNV1A_INIT, header, offsetof(struct wl_cal_bin_header_struc, header_checksum));
+  if (payload_flip) image[length - 1] ^= 0x01;
+
+  name = stepper_check_file(tag, image, length);
+  free(image);
+
+  result = wl_cal_open_table_file(wl_cal_context, name);
+  if (result == 0) result = wl_cal_verify_table_binary(wl_cal_context);
+  remove(name);
+
+  return result;
+}
+
+// ---------------------------------------------------------------------------
+// binary table maps back to the same conversions as its text source; damaged
+// payload and section offsets pointing anywhere but their place are refused
+void stepper_check_binary_table(void)
+{
+  const char *table = "0\t500.0\n100\t510.0\n200\t525.0\n300\t545.0\n400\t570.0\n";
+  struct wl_cal_context_struc *text_context;
+  struct wl_cal_context_struc *binary_context;
+  struct wl_cal_bin_header_struc header;
+  char text_name[256];
+  char binary_name[256];
+  double wl_text;
+  double wl_binary;
+  int step_text;
+  int step_binary;
+  int same = 1;
+  int results[4];
+  int i;
+  FILE *saved = stderr;
+
+  SNPRINTF(text_name, sizeof(text_name), "%s", stepper_check_file("bin.txt", table, strlen(table)));
+  SNPRINTF(binary_name, sizeof(binary_name), "%s.wlcb", text_name);
+
+  wl_cal_allocate_context(&text_context);
+  wl_cal_allocate_context(&binary_context);
+  STEPPER_CHECK(wl_cal_read_table_file(text_context, text_name) == 0);
+  STEPPER_CHECK(wl_cal_write_table_binary(text_context, binary_name) == 0);
+  STEPPER_CHECK(wl_cal_open_table_file(binary_context, binary_name) == 0);
+  STEPPER_CHECK(binary_context->mapping.m_ptr != NULL);
+  STEPPER_CHECK(wl_cal_verify_table_binary(binary_context) == 0);
+
+  for (i = 0; i <= 140; i++)
+  {
+    wl_cal_wl2step(text_context, 500.0 + i * 0.5, &step_text);
+    wl_cal_wl2step(binary_context, 500.0 + i * 0.5, &step_binary);
+    wl_cal_step2wl(text_context, i * 2, &wl_text);
+    wl_cal_step2wl(binary_context, i * 2, &wl_binary);
+    if ((step_text != step_binary) || (wl_text != wl_binary)) same = 0;
+  }
+  STEPPER_CHECK(same);
+
+  // each attempt drops the mapping, keep header apart
+  memcpy(&header, binary_context->mapping.m_ptr, sizeof(header));
+  stderr = tmpfile();
+  results[0] = stepper_check_patched_binary(binary_name, "flip.wlcb", 0, 1, binary_context);
+  results[1] = stepper_check_patched_binary(binary_name, "odd.wlcb", header.x_step_offset + 4, 0, binary_context);
+  results[2] = stepper_check_patched_binary(binary_name, "overlap.wlcb", header.x_wl_offset, 0, binary_context);
+  results[3] = stepper_check_patched_binary(binary_name, "huge.wlcb", ~(UINT64)7, 0, binary_context);
+  fclose(stderr);
+  stderr = saved;
+  for (i = 0; i < 4; i++) STEPPER_CHECK(results[i] < 0);
+
+  wl_cal_free_context(&text_context);
+  wl_cal_free_context(&binary_context);
+  remove(text_name);
+  remove(binary_name);
+}
+
+// ---------------------------------------------------------------------------
+// cubic modes go through every calibration point; PCHIP stays monotonic and
+// within neighbouring points even where the curve bends sharply
+void stepper_check_interpolation(void)
+{
+  const char *table = "0\t500.0\n100\t500.5\n200\t501.0\n300\t540.0\n400\t541.0\n500\t541.5\n600\t560.0\n";
+  const int steps[7] = {0, 100, 200, 300, 400, 500, 600};
+  const double wavelengths[7] = {500.0, 500.5, 501.0, 540.0, 541.0, 541.5, 560.0};
+  struct wl_cal_context_struc *wl_cal_context;
+  double previous;
+  double wl;
+  double step;
+  int knots_exact;
+  int monotonic = 1;
+  int bounded = 1;
+  int mode;
+  int k;
+  int i;
+  char *name = stepper_check_file("interp.txt", table, strlen(table));
+
+  for (mode = WL_CAL_INTERP_PCHIP; mode <= WL_CAL_INTERP_SPLINE; mode++)
+  {
+    wl_cal_allocate_context(&wl_cal_context);
+    STEPPER_CHECK(wl_cal_set_interp_mode(wl_cal_context, mode) == 0);
+    STEPPER_CHECK(wl_cal_read_table_file(wl_cal_context, name) == 0);
+
+    knots_exact = 1;
+    for (k = 0; k < 7; k++)
+    {
+      if ((wl_cal_step2wl_lookup(wl_cal_context, steps[k], &wl) < 0) || (fabs(wl - wavelengths[k]) > 1e-9)) knots_exact = 0;
+      if ((wl_cal_wl2step_lookup(wl_cal_context, wavelengths[k], &step) < 0) || (fabs(step - steps[k]) > 1e-6)) knots_exact = 0;
+    }
+    STEPPER_CHECK(knots_exact);
+
+    if (mode == WL_CAL_INTERP_PCHIP)
+    {
+      previous = 0;
+      for (i = 0; i <= 600; i++)
+      {
+        wl_cal_step2wl_lookup(wl_cal_context, i, &wl);
+        if ((i > 0) && (wl < previous)) monotonic = 0;
+        k = i / 100;
+        if ((k < 6) && ((wl < wavelengths[k] - 1e-9) || (wl > wavelengths[k + 1] + 1e-9))) bounded = 0;
+        previous = wl;
+      }
+      for (i = 0; i <= 600; i++)
+      {
+        wl_cal_wl2step_lookup(wl_cal_context, 500.0 + i * 0.1, &step);
+        if ((i > 0) && (step < previous)) monotonic = 0;
+        previous = step;
+      }
+      STEPPER_CHECK(monotonic);
+      STEPPER_CHECK(bounded);
+    }
+
+    wl_cal_free_context(&wl_cal_context);
+  }
+
+  remove(name);
+}
+
+// ---------------------------------------------------------------------------
+struct stepper_check_reader_struc
+{
+  struct wl_cal_registry_struc *cr_registry;
+  int cr_stop;
+  long cr_lookups;
+  long cr_bad;
+};
+
+// ---------------------------------------------------------------------------
+// every table it may see maps 550 nm to 500 or 1000 steps, nothing else
+void *stepper_check_reader(void *arg)
+{
+  struct stepper_check_reader_struc *reader = (struct stepper_check_reader_struc *)arg;
+  struct wl_cal_context_struc *wl_cal_context;
+  int token;
+  int step;
+
+  while (! __atomic_load_n(&reader->cr_stop, __ATOMIC_ACQUIRE))
+  {
+    wl_cal_context = wl_cal_registry_acquire(reader->cr_registry, &token);
+    if ((wl_cal_context == NULL) || (wl_cal_wl2step(wl_cal_context, 550.0, &step) < 0) || ((step != 500) && (step != 1000)))
+      reader->cr_bad ++;
+    __atomic_fetch_add(&reader->cr_lookups, 1, __ATOMIC_RELAXED);
+    wl_cal_registry_release(reader->cr_registry, token);
+  }
+
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// old table stays usable while a reader holds it and is retired only after
+// release; failed reload keeps current table; readers survive many swaps
+void stepper_check_registry(void)
+{
+  const char *table_a = "0\t500.0\n1000\t600.0\n";
+  const char *table_b = "0\t500.0\n2000\t600.0\n";
+  struct wl_cal_registry_struc registry;
+  struct wl_cal_context_struc *wl_cal_context;
+  struct stepper_check_reader_struc readers[4];
+  pthread_t threads[4];
+  char name_a[256];
+  char name_b[256];
+  int token;
+  int step;
+  int busy;
+  int result;
+  int i;
+  FILE *saved = stderr;
+
+  SNPRINTF(name_a, sizeof(name_a), "%s", stepper_check_file("reg_a.txt", table_a, strlen(table_a)));
+  SNPRINTF(name_b, sizeof(name_b), "%s", stepper_check_file("reg_b.txt", table_b, strlen(table_b)));
+
+  STEPPER_CHECK(wl_cal_registry_init(&registry, WL_CAL_INTERP_LINEAR, 0, 1) == 0);
+  wl_cal_context = wl_cal_registry_acquire(&registry, &token);
+  STEPPER_CHECK(wl_cal_context == NULL);
+  wl_cal_registry_release(&registry, token);
+
+  STEPPER_CHECK(wl_cal_registry_load(&registry, name_a) == 0);
+
+  // reader holds table a across a reload
+  wl_cal_context = wl_cal_registry_acquire(&registry, &token);
+  STEPPER_CHECK(wl_cal_registry_reload_async(&registry, name_b) == 0);
+  usleep(50000);
+  busy = __atomic_load_n(&registry.r_loader_busy, __ATOMIC_ACQUIRE);
+  STEPPER_CHECK(busy);
+  STEPPER_CHECK((wl_cal_wl2step(wl_cal_context, 550.0, &step) == 0) && (step == 500));
+  wl_cal_registry_release(&registry, token);
+  STEPPER_CHECK(wl_cal_registry_wait_reload(&registry) == 0);
+
+  wl_cal_context = wl_cal_registry_acquire(&registry, &token);
+  STEPPER_CHECK((wl_cal_wl2step(wl_cal_context, 550.0, &step) == 0) && (step == 1000));
+  wl_cal_registry_release(&registry, token);
+
+  stderr = tmpfile();
+  result = wl_cal_registry_load(&registry, "/nonexistent/table.txt");
+  fclose(stderr);
+  stderr = saved;
+  STEPPER_CHECK(result < 0);
+  wl_cal_context = wl_cal_registry_acquire(&registry, &token);
+  STEPPER_CHECK((wl_cal_context != NULL) && (wl_cal_wl2step(wl_cal_context, 550.0, &step) == 0) && (step == 1000));
+  wl_cal_registry_release(&registry, token);
+
+  // swaps under load
+  memset(readers, 0, sizeof(readers));
+  for (i = 0; i < 4; i++)
+  {
+    readers[i].cr_registry = &registry;
+    pthread_create(&threads[i], NULL, stepper_check_reader, &readers[i]);
+  }
+  // all readers running before swapping starts, matters on one cpu
+  for (i = 0; i < 4; i++)
+  {
+    while (__atomic_load_n(&readers[i].cr_lookups, __ATOMIC_RELAXED) == 0) usleep(1000);
+  }
+  result = 0;
+  for (i = 0; i < 50; i++)
+  {
+    if (wl_cal_registry_load(&registry, (i & 1) ? name_a : name_b) < 0) result = -1;
+  }
+  for (i = 0; i < 4; i++)
+  {
+    __atomic_store_n(&readers[i].cr_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(threads[i], NULL);
+    STEPPER_CHECK((readers[i].cr_lookups > 0) && (readers[i].cr_bad == 0));
+  }
+  STEPPER_CHECK(result == 0);
+
+  STEPPER_CHECK(wl_cal_registry_destroy(&registry) == 0);
+  remove(name_a);
+  remove(name_b);
+}
+
+// ---------------------------------------------------------------------------
+// scripted controller on the other end of a socket pair, takes one frame
+struct stepper_check_controller_struc
+{
+  int cc_fd;
+  int cc_drop_ack;           // byte of first attempt left unanswered, -1 none
+  int cc_bad_ack;            // byte of first attempt answered with garbage, -1 none
+  int cc_noise;              // late duplicate ack and a zero byte right after last ack
+  long long cc_done_delay_us;
+  long long cc_gap_us;       // silence before frame was sent again
+  long long cc_acked_us;     // last ack sent
+  unsigned char cc_frame[STEPPER_FRAME_SIZE];
+};
+
+// ---------------------------------------------------------------------------
+void *stepper_check_controller(void *arg)
+{
+  struct stepper_check_controller_struc *controller = (struct stepper_check_controller_struc *)arg;
+  unsigned char ack = STEPPER_ACK_BYTE;
+  unsigned char done = STEPPER_DONE_BYTE;
+  unsigned char garbage = 0x00;
+  unsigned char noise[2] = {STEPPER_ACK_BYTE, 0x00};
+  long long dropped_us = 0;
+  int byte = 0;
+
+  while (byte < STEPPER_FRAME_SIZE)
+  {
+    if (rs232_read_deadline(controller->cc_fd, &controller->cc_frame[byte], 1, rs232_now_us() + 2000000) != 1) return NULL;
+
+    if (dropped_us)
+    {
+      controller->cc_gap_us = rs232_now_us() - dropped_us;
+      dropped_us = 0;
+    }
+
+    if (byte == controller->cc_drop_ack)
+    {
+      // sender gives up the attempt and starts over
+      controller->cc_drop_ack = -1;
+      dropped_us = rs232_now_us();
+      byte = 0;
+      continue;
+    }
+
+    if (byte == controller->cc_bad_ack)
+    {
+      controller->cc_bad_ack = -1;
+      rs232_write_all(controller->cc_fd, &garbage, 1);
+      dropped_us = rs232_now_us();
+      byte = 0;
+      continue;
+    }
+
+    rs232_write_all(controller->cc_fd, &ack, 1);
+    byte ++;
+  }
+  __atomic_store_n(&controller->cc_acked_us, rs232_now_us(), __ATOMIC_RELEASE);
+
+  if (controller->cc_noise) rs232_write_all(controller->cc_fd, noise, 2);
+  usleep(controller->cc_done_delay_us);
+  rs232_write_all(controller->cc_fd, &done, 1);
+
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// runs one move of given steps at 3200 Hz through a queue against the script
+int stepper_check_queue_move(struct stepper_check_controller_struc *controller, int steps, struct stepper_completion_struc *completion)
+{
+  struct stepper_queue_struc queue;
+  pthread_t thread;
+  int sv[2];
+  int failed;
+
+  socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+  controller->cc_fd = sv[1];
+  pthread_create(&thread, NULL, stepper_check_controller, controller);
+
+  stepper_queue_init(&queue, sv[0], 1);
+  stepper_queue_push(&queue, steps, 0, 3200, NULL, NULL);
+  failed = stepper_queue_run(&queue);
+  stepper_queue_pop_completion(&queue, completion);
+
+  pthread_join(thread, NULL);
+  close(sv[0]);
+  close(sv[1]);
+
+  return failed;
+}
+
+// ---------------------------------------------------------------------------
+// late duplicate ack or noise right after the frame is not completion
+void stepper_check_queue_completion(void)
+{
+  struct stepper_check_controller_struc controller;
+  struct stepper_completion_struc completion;
+  int failed;
+
+  memset(&controller, 0, sizeof(controller));
+  controller.cc_drop_ack = -1;
+  controller.cc_bad_ack = -1;
+  controller.cc_noise = 1;
+  controller.cc_done_delay_us = 100000; // 320 steps at 3200 Hz
+  failed = stepper_check_queue_move(&controller, 320, &completion);
+
+  STEPPER_CHECK(failed == 0);
+  STEPPER_CHECK(completion.status == STEPPER_MOVE_OK);
+  STEPPER_CHECK(completion.done_us - controller.cc_acked_us >= 90000);
+}
+
+// ---------------------------------------------------------------------------
+// lost ack leaves line silent for resync gap, then whole frame is sent again
+void stepper_check_queue_resync(void)
+{
+  struct stepper_check_controller_struc controller;
+  struct stepper_completion_struc completion;
+  unsigned char frame[STEPPER_FRAME_SIZE];
+  int failed;
+
+  memset(&controller, 0, sizeof(controller));
+  controller.cc_drop_ack = 2;
+  controller.cc_bad_ack = -1;
+  controller.cc_done_delay_us = 10000;
+  failed = stepper_check_queue_move(&controller, 32, &completion);
+
+  stepper_encode_frame(frame, 32, 0, 3200);
+  STEPPER_CHECK(failed == 0);
+  STEPPER_CHECK(completion.status == STEPPER_MOVE_OK);
+  STEPPER_CHECK(controller.cc_gap_us >= STEPPER_RESYNC_GAP_US + STEPPER_RETRY_BACKOFF_US);
+  STEPPER_CHECK(memcmp(controller.cc_frame, frame, STEPPER_FRAME_SIZE) == 0);
+}
+
+// ---------------------------------------------------------------------------
+// runs one 32 step move through the protocol, controller NULL never answers
+int stepper_check_protocol_move(struct stepper_check_controller_struc *controller, struct stepper_protocol_struc *proto)
+{
+  pthread_t thread;
+  int sv[2];
+
+  socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+  if (controller != NULL)
+  {
+    controller->cc_fd = sv[1];
+    pthread_create(&thread, NULL, stepper_check_controller, controller);
+  }
+
+  stepper_protocol_init(proto, 32, 0, 3200, rs232_now_us() + stepper_move_budget_us(32, 0, 3200));
+  stepper_protocol_run(proto, sv[0]);
+
+  if (controller != NULL) pthread_join(thread, NULL);
+  close(sv[0]);
+  close(sv[1]);
+
+  return proto->p_result;
+}
+
+// ---------------------------------------------------------------------------
+// lost and bad acks resync and resend the frame, silence gives up in bounds
+void stepper_check_protocol_retry(void)
+{
+  struct stepper_check_controller_struc controller;
+  struct stepper_protocol_struc proto;
+  unsigned char frame[STEPPER_FRAME_SIZE];
+  long long t0_us;
+
+  stepper_encode_frame(frame, 32, 0, 3200);
+
+  memset(&controller, 0, sizeof(controller));
+  controller.cc_drop_ack = 2;
+  controller.cc_bad_ack = -1;
+  STEPPER_CHECK(stepper_check_protocol_move(&controller, &proto) == STEPPER_MOVE_OK);
+  STEPPER_CHECK(proto.p_retries == 1);
+  STEPPER_CHECK(controller.cc_gap_us >= STEPPER_RESYNC_GAP_US + STEPPER_RETRY_BACKOFF_US);
+  STEPPER_CHECK(memcmp(controller.cc_frame, frame, STEPPER_FRAME_SIZE) == 0);
+
+  memset(&controller, 0, sizeof(controller));
+  controller.cc_drop_ack = -1;
+  controller.cc_bad_ack = 1;
+  STEPPER_CHECK(stepper_check_protocol_move(&controller, &proto) == STEPPER_MOVE_OK);
+  STEPPER_CHECK(proto.p_retries == 1);
+  STEPPER_CHECK(proto.p_garbage_bytes >= 1);
+  STEPPER_CHECK(controller.cc_gap_us >= STEPPER_RESYNC_GAP_US + STEPPER_RETRY_BACKOFF_US);
+  STEPPER_CHECK(memcmp(controller.cc_frame, frame, STEPPER_FRAME_SIZE) == 0);
+
+  // every attempt times out on its first byte
+  t0_us = rs232_now_us();
+  STEPPER_CHECK(stepper_check_protocol_move(NULL, &proto) == STEPPER_MOVE_ACK_TIMEOUT);
+  STEPPER_CHECK(proto.p_retries == STEPPER_RETRY_LIMIT);
+  STEPPER_CHECK(proto.p_ack_timeouts == STEPPER_RETRY_LIMIT + 1);
+  STEPPER_CHECK(rs232_now_us() - t0_us < stepper_move_budget_us(32, 0, 3200));
+}
+
+// ---------------------------------------------------------------------------
+// bytes read ahead by a line read reach frame reads and the queue
+void stepper_check_reader_handover(void)
+{
+  unsigned char reply[] = {'h', 'i', '\r', '\n', STEPPER_ACK_BYTE, STEPPER_ACK_BYTE, STEPPER_ACK_BYTE,
+    STEPPER_ACK_BYTE, STEPPER_ACK_BYTE, STEPPER_DONE_BYTE};
+  struct stepper_completion_struc completion;
+  struct stepper_queue_struc queue;
+  unsigned char bytes[2];
+  char line[16];
+  int sv[2];
+
+  socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+  rs232_reader_reset(&rs232_readers[sv[0]]);
+
+  rs232_write_all(sv[1], reply, 6);
+  STEPPER_CHECK(rs232_read_buffer(sv[0], line, sizeof(line)) == 2);
+  STEPPER_CHECK(strcmp(line, "hi") == 0);
+  STEPPER_CHECK(rs232_reader_pending(sv[0]) == 2);
+  STEPPER_CHECK(rs232_read_deadline(sv[0], bytes, 2, rs232_now_us() + 100000) == 2);
+  STEPPER_CHECK((bytes[0] == STEPPER_ACK_BYTE) && (bytes[1] == STEPPER_ACK_BYTE));
+
+  // whole exchange of a zero length move is buffered before the queue looks
+  rs232_write_all(sv[1], reply, sizeof(reply));
+  STEPPER_CHECK(rs232_read_buffer(sv[0], line, sizeof(line)) == 2);
+  STEPPER_CHECK(rs232_reader_pending(sv[0]) == 6);
+  stepper_queue_init(&queue, sv[0], 1);
+  stepper_queue_push(&queue, 0, 0, 3200, NULL, NULL);
+  STEPPER_CHECK(stepper_queue_run(&queue) == 0);
+  STEPPER_CHECK(stepper_queue_pop_completion(&queue, &completion) && (completion.status == STEPPER_MOVE_OK));
+  STEPPER_CHECK(rs232_reader_pending(sv[0]) == 0);
+
+  rs232_reader_reset(&rs232_readers[sv[0]]);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// ---------------------------------------------------------------------------
+// stopping driver waits for the executing move, only unsent ones are cancelled
+void stepper_check_driver_stop(void)
+{
+  struct stepper_check_controller_struc controller;
+  struct stepper_completion_struc completion[2];
+  struct stepper_driver_struc driver;
+  pthread_t thread;
+  int sv[2];
+
+  memset(&controller, 0, sizeof(controller));
+  controller.cc_drop_ack = -1;
+  controller.cc_bad_ack = -1;
+  controller.cc_done_delay_us = 100000;
+  socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+  controller.cc_fd = sv[1];
+  pthread_create(&thread, NULL, stepper_check_controller, &controller);
+
+  stepper_driver_start(&driver, sv[0], 1);
+  stepper_driver_submit(&driver, 320, 0, 3200);
+  stepper_driver_submit(&driver, 320, 0, 3200);
+  while (__atomic_load_n(&controller.cc_acked_us, __ATOMIC_ACQUIRE) == 0) usleep(1000);
+  stepper_driver_stop(&driver);
+
+  STEPPER_CHECK(stepper_driver_poll_completion(&driver, &completion[0]) == 1);
+  STEPPER_CHECK(stepper_driver_poll_completion(&driver, &completion[1]) == 1);
+  STEPPER_CHECK(completion[0].status == STEPPER_MOVE_OK);
+  STEPPER_CHECK(completion[1].status == STEPPER_MOVE_CANCELLED);
+
+  stepper_driver_free(&driver);
+  pthread_join(thread, NULL);
+  close(sv[0]);
+  close(sv[1]);
+}
+
+// ---------------------------------------------------------------------------
+// moves longer than one frame are timed frame by frame
+void stepper_check_plan_long_moves(void)
+{
+  struct stepper_limits_struc limits;
+  struct stepper_plan_rates_struc rates;
+  struct stepper_plan_struc plan;
+
+  // 200000 steps at 3200 Hz take 62.5 s, 16 bit step count must not wrap
+  STEPPER_CHECK(llabs(stepper_plan_pulses_us(200000, 3200, 0) - 62500000) < 100000);
+  STEPPER_CHECK(llabs(stepper_plan_pulses_us(131072, 3200, 0) - 40960000) < 100000);
+  STEPPER_CHECK(stepper_plan_pulses_us(2 * STEPPER_MAX_STEPS, 3200, 1000) ==
+    2 * stepper_move_duration_us(STEPPER_MAX_STEPS, 0, 3200) + 2 * 1000);
+
+  stepper_limits_default(&limits);
+  stepper_plan_rates(limits.l_max_freq, &rates);
+  memset(&plan, 0, sizeof(plan));
+  STEPPER_CHECK(stepper_plan_segment(&plan, &limits, &rates, &rates, 0, 1000000, 0) == 0);
+  STEPPER_CHECK(plan.p_count > 0);
+  STEPPER_CHECK(plan.p_duration_us >= stepper_plan_pulses_us(1000000 / limits.l_micro_ratio, limits.l_max_freq, 0));
+  stepper_plan_free(&plan);
+}
+
+// ---------------------------------------------------------------------------
+// true pulse rate of a frequency argument
+double stepper_check_rate(int stepper_freq)
+{
+  return 60000 * 1e6 / stepper_move_duration_us(60000, 0, stepper_freq);
+}
+
+// ---------------------------------------------------------------------------
+// full step and microstep limits apply to their own pulses, every part of a
+// segment takes the cheaper of the candidate rates
+void stepper_check_plan_rates(void)
+{
+  struct stepper_limits_struc limits;
+  struct stepper_plan_rates_struc full_rates;
+  struct stepper_plan_rates_struc micro_rates;
+  struct stepper_plan_struc plan;
+
+  // no microstepping: full step limit counts, microstep limit is unused
+  stepper_limits_default(&limits);
+  limits.l_max_freq = 1000;
+  limits.l_max_micro_freq = 3200;
+  stepper_plan_rates(limits.l_max_freq, &full_rates);
+  stepper_plan_rates(limits.l_max_micro_freq, &micro_rates);
+  STEPPER_CHECK(full_rates.pr_count == 2);
+  STEPPER_CHECK(full_rates.pr_freq[1] < STEPPER_LOW_SPEED_THRESHOLD);
+
+  memset(&plan, 0, sizeof(plan));
+  STEPPER_CHECK(stepper_plan_segment(&plan, &limits, &full_rates, &micro_rates, 0, 5000, 0) == 0);
+  STEPPER_CHECK(plan.p_count == 1);
+  STEPPER_CHECK(plan.p_moves[0].steps == 5000);
+  STEPPER_CHECK(plan.p_moves[0].micro_step_flag == 0);
+  STEPPER_CHECK(stepper_check_rate(plan.p_moves[0].stepper_freq) <= 1000.0);
+  STEPPER_CHECK(stepper_check_rate(plan.p_moves[0].stepper_freq) > 990.0);
+  stepper_plan_free(&plan);
+
+  // 4 microsteps per full step: 1000 Hz full steps beat 3200 Hz microsteps,
+  // remainder goes in microsteps
+  limits.l_micro_ratio = 4;
+  memset(&plan, 0, sizeof(plan));
+  STEPPER_CHECK(stepper_plan_segment(&plan, &limits, &full_rates, &micro_rates, 0, 40001, 0) == 0);
+  STEPPER_CHECK(plan.p_count == 2);
+  STEPPER_CHECK((plan.p_moves[0].steps == 10000) && (plan.p_moves[0].micro_step_flag == 0));
+  STEPPER_CHECK((plan.p_moves[1].steps == 1) && (plan.p_moves[1].micro_step_flag == 1));
+  STEPPER_CHECK(stepper_check_rate(plan.p_moves[0].stepper_freq) <= 1000.0);
+  STEPPER_CHECK(stepper_check_rate(plan.p_moves[1].stepper_freq) <= 3200.0);
+  STEPPER_CHECK(plan.p_moves[1].position == 40001);
+  stepper_plan_free(&plan);
+
+  // limit below the low speed threshold has that clock as only candidate
+  limits.l_micro_ratio = 1;
+  limits.l_max_freq = 100;
+  stepper_plan_rates(limits.l_max_freq, &full_rates);
+  STEPPER_CHECK(full_rates.pr_count == 1);
+  memset(&plan, 0, sizeof(plan));
+  STEPPER_CHECK(stepper_plan_segment(&plan, &limits, &full_rates, &micro_rates, 300, 0, 0) == 0);
+  STEPPER_CHECK((plan.p_count == 1) && (plan.p_moves[0].steps == -300) && (plan.p_moves[0].position == 0));
+  STEPPER_CHECK(stepper_check_rate(plan.p_moves[0].stepper_freq) <= 100.0);
+  stepper_plan_free(&plan);
+}
+
+// ---------------------------------------------------------------------------
+// slowest accepted rate must survive encoding, anything slower is refused
+void stepper_check_min_freq(void)
+{
+  unsigned char frame[STEPPER_FRAME_SIZE];
+  int steps;
+  int micro;
+  int low_speed;
+  double rate;
+
+  STEPPER_CHECK(STEPPER_MIN_FREQ == 2);
+  STEPPER_CHECK(stepper_check_move("stepper_check_min_freq", 100, STEPPER_MIN_FREQ) == STEPPER_MOVE_OK);
+  STEPPER_CHECK(stepper_check_move("stepper_check_min_freq", 100, STEPPER_MIN_FREQ - 1) == STEPPER_MOVE_RANGE);
+
+  stepper_encode_frame(frame, 100, 0, STEPPER_MIN_FREQ);
+  stepper_decode_frame(frame, &steps, &micro, &low_speed, &rate);
+  STEPPER_CHECK(low_speed && (fabs(rate - STEPPER_MIN_FREQ) < 0.01));
+}
+
+// ---------------------------------------------------------------------------
+// failed frame that may have reached the controller makes position unknown
+void stepper_check_motor_lost_ack(void)
+{
+  struct stepper_motor_struc motor;
+  struct stepper_protocol_struc proto;
+
+  // per byte, first ack lost: frame never completed, position still valid
+  stepper_motor_init(&motor, -1, 1000);
+  stepper_protocol_init(&proto, 500, 0, 3200, 0);
+  proto.p_tx_mode = STEPPER_TX_PER_BYTE;
+  proto.p_result = STEPPER_MOVE_ACK_TIMEOUT;
+  stepper_motor_frame_done(&motor, &proto, "stepper_check_motor_lost_ack");
+  STEPPER_CHECK(motor.mt_known && (motor.mt_position == 1000));
+
+  // whole frame was written at once, controller may be running it
+  stepper_motor_init(&motor, -1, 1000);
+  stepper_protocol_init(&proto, 500, 0, 3200, 0);
+  proto.p_tx_mode = STEPPER_TX_FRAME;
+  proto.p_result = STEPPER_MOVE_ACK_TIMEOUT;
+  stepper_motor_frame_done(&motor, &proto, "stepper_check_motor_lost_ack");
+  STEPPER_CHECK(! motor.mt_known);
+
+  stepper_motor_init(&motor, -1, 1000);
+  stepper_protocol_init(&proto, 500, 0, 3200, 0);
+  proto.p_unconfirmed = 1;
+  proto.p_result = STEPPER_MOVE_DONE_TIMEOUT;
+  stepper_motor_frame_done(&motor, &proto, "stepper_check_motor_lost_ack");
+  STEPPER_CHECK(! motor.mt_known);
+}
+
+// ---------------------------------------------------------------------------
+// ramped move starts and stops at start rate and covers whole distance
+void stepper_check_ramp_edges(void)
+{
+  struct stepper_ramp_struc ramp;
+  struct stepper_plan_struc plan;
+  size_t i;
+  int profile;
+  int steps;
+
+  for (profile = STEPPER_RAMP_TRAPEZOID; profile <= STEPPER_RAMP_SCURVE; profile++)
+  {
+    stepper_ramp_default(&ramp);
+    ramp.rp_profile = profile;
+    memset(&plan, 0, sizeof(plan));
+
+    STEPPER_CHECK(stepper_ramp_build(&ramp, 20000, 0, 7, &plan, 0) == 0);
+    STEPPER_CHECK(plan.p_count > (size_t)(2 * ramp.rp_frames));
+    if (plan.p_count < 2) continue;
+
+    STEPPER_CHECK(plan.p_moves[0].stepper_freq == ramp.rp_start_freq);
+    STEPPER_CHECK(plan.p_moves[plan.p_count - 1].stepper_freq == ramp.rp_start_freq);
+    STEPPER_CHECK(plan.p_moves[plan.p_count - 1].index == 7);
+
+    steps = 0;
+    for (i = 0; i < plan.p_count; i++)
+    {
+      steps += plan.p_moves[i].steps;
+      STEPPER_CHECK(plan.p_moves[i].stepper_freq <= ramp.rp_max_freq);
+    }
+    STEPPER_CHECK(steps == 20000);
+    stepper_plan_free(&plan);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// recording follows rs232_stats_enable, odd port names stay valid JSON
+void stepper_check_stats_dump(void)
+{
+  char text[4096];
+  FILE *file;
+  size_t length;
+  int fds[2];
+
+  // writes are timed only while enabled
+  pipe(fds);
+  rs232_stats_reset(fds[1], "pipe");
+  rs232_stats_enable(1);
+  rs232_write_all(fds[1], "x", 1);
+  rs232_stats_enable(0);
+  rs232_write_all(fds[1], "x", 1);
+  STEPPER_CHECK(rs232_stats[fds[1]].st_hist[RS232_STAT_WRITE].h_count == 1);
+  memset(&rs232_stats[fds[1]], 0, sizeof(rs232_stats[fds[1]]));
+  close(fds[0]);
+  close(fds[1]);
+
+  rs232_stats_reset(5, "/dev/a\"b\\c\n");
+  rs232_stats_record(5, RS232_STAT_ACK, 100);
+
+  file = tmpfile();
+  STEPPER_CHECK(rs232_stats_dump(file, RS232_STATS_JSON) == 0);
+  rewind(file);
+  length = fread(text, 1, sizeof(text) - 1, file);
+  text[length] = 0;
+  fclose(file);
+  STEPPER_CHECK(strstr(text, "\"port\": \"/dev/a\\\"b\\\\c\\u000a\", \"fd\": 5") != NULL);
+
+  memset(&rs232_stats[5], 0, sizeof(rs232_stats[5]));
+
+  // failed install leaves nothing open behind
+  STEPPER_CHECK(rs232_stats_dump_on_signal(SIGKILL, "/dev/null", RS232_STATS_JSON) == -3);
+  STEPPER_CHECK((rs232_stats_dumper.sd_pipe[0] == -1) && (rs232_stats_dumper.sd_pipe[1] == -1));
+  STEPPER_CHECK(fcntl(fds[0], F_GETFD) < 0);
+}
+
+// ---------------------------------------------------------------------------
+// slot claimed by a writer but still holding previous lap is not a loss
+void stepper_check_trace_claimed_slot(void)
+{
+  unsigned char byte = 0x55;
+  int i;
+
+  // off unless asked for, records fill whole cache lines
+  STEPPER_CHECK(rs232_trace_enabled == 0);
+  STEPPER_CHECK(sizeof(struct rs232_trace_record_struc) == 64);
+  memset(&rs232_trace_ring, 0, sizeof(rs232_trace_ring));
+  rs232_trace(3, RS232_TRACE_TX, &byte, 1);
+  STEPPER_CHECK(rs232_trace_ring.tc_head == 0);
+
+  rs232_trace_enabled = 1;
+  for (i = 0; i < RS232_TRACE_SIZE; i++) rs232_trace(3, RS232_TRACE_TX, &byte, 1);
+  STEPPER_CHECK(rs232_trace_decode(stdout, RS232_TRACE_QUIET) == RS232_TRACE_SIZE);
+
+  // writer got its index, slot is not touched yet
+  __atomic_fetch_add(&rs232_trace_ring.tc_head, 1, __ATOMIC_RELAXED);
+  STEPPER_CHECK(rs232_trace_decode(stdout, RS232_TRACE_QUIET) == 0);
+  STEPPER_CHECK(rs232_trace_ring.tc_lost == 0);
+  STEPPER_CHECK(rs232_trace_ring.tc_tail == RS232_TRACE_SIZE);
+
+  // writer finishes
+  rs232_trace_ring.tc_records[0].tr_length = 1;
+  __atomic_store_n(&rs232_trace_ring.tc_records[0].tr_seq, RS232_TRACE_SIZE + 1, __ATOMIC_RELEASE);
+  STEPPER_CHECK(rs232_trace_decode(stdout, RS232_TRACE_QUIET) == 1);
+  STEPPER_CHECK(rs232_trace_ring.tc_lost == 0);
+  rs232_trace_enabled = 0;
+}
+
+// ---------------------------------------------------------------------------
+int main(void)
+{
+  stepper_check_sort_table();
+  stepper_check_parse_table();
+  stepper_check_binary_table();
+  stepper_check_interpolation();
+  stepper_check_registry();
+  stepper_check_reader_handover();
+  stepper_check_protocol_retry();
+  stepper_check_queue_completion();
+  stepper_check_queue_resync();
+  stepper_check_driver_stop();
+  stepper_check_plan_long_moves();
+  stepper_check_plan_rates();
+  stepper_check_min_freq();
+  stepper_check_motor_lost_ack();
+  stepper_check_ramp_edges();
+  stepper_check_stats_dump();
+  stepper_check_trace_claimed_slot();
+
+  if (stepper_check_failed) fprintf(stderr, "%d checks failed\n", stepper_check_failed);
+  else printf("all checks passed\n");
+
+  return stepper_check_failed;
+}
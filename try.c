@@ -1,6 +1,12 @@
+#ifdef __unix__
+  #define _GNU_SOURCE // posix_openpt, ptsname_r
+#endif // __unix__
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <math.h>
 
 #ifdef __unix__
   #include <termios.h>
@@ -11,9 +17,22 @@
   #include <errno.h>
 //  #include <getopt.h>
   #include <sys/stat.h>
+  #include <sys/mman.h>
+  #include <pthread.h>
+  #include <poll.h>
+  #include <sys/eventfd.h>
+  #include <sys/epoll.h>
+  #include <sys/ioctl.h>
+  #include <signal.h>
+  #ifdef __linux__
+    #include <linux/serial.h>
+  #endif // __linux__
+  #include <time.h>
   #define UINT64 unsigned long
   #define SNPRINTF snprintf
   #define FILE_SIZE_T size_t
+  #define HINT_LOAD(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+  #define HINT_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
 #endif // __unix__
 #ifdef _WIN32
 //  #include "getopt.h" // use custom file
@@ -21,6 +40,8 @@
   #define UINT64 unsigned long long
   #define SNPRINTF sprintf_s
   #define FILE_SIZE_T unsigned long long
+  #define HINT_LOAD(p)     (*(volatile int *)(p))
+  #define HINT_STORE(p, v) (*(volatile int *)(p) = (v))
   //#include <stdlib.h>
   #include <crtdbg.h>
 #endif // _WIN32
@@ -28,11 +49,84 @@
 
 #define STEPPER_SRC_FREQ (7372800) // 7.4 MHz
 
-struct termios orig_serial_port_settings;
-struct termios curr_serial_port_settings;
+// PLM002 command frame: freq word (high, low), step count (high, low), control byte
+#define STEPPER_FRAME_SIZE          (5)
+#define STEPPER_CTRL_MICROSTEP      (1 << 0)
+#define STEPPER_CTRL_NEGATIVE       (1 << 2) // direction
+#define STEPPER_CTRL_NRESET         (1 << 3) // -reset, must always be 1
+#define STEPPER_CTRL_LOW_SPEED      (1 << 4) // clock divided by STEPPER_LOW_SPEED_DIV
+#define STEPPER_LOW_SPEED_DIV       (64)
+#define STEPPER_LOW_SPEED_THRESHOLD (120)    // Hz, slower moves use low speed clock
+#define STEPPER_MAX_STEPS           (0xFFFF) // per frame
+// Hz, slowest rate whose low speed divider still fits in the 16 bit frequency word
+#define STEPPER_MIN_FREQ            ((STEPPER_SRC_FREQ + STEPPER_LOW_SPEED_DIV * 0xFFFF - 1) / (STEPPER_LOW_SPEED_DIV * 0xFFFF))
+
+#define STEPPER_ACK_BYTE  (0xFA) // controller accepted a byte
+#define STEPPER_DONE_BYTE (0xFB) // sent by simulator when move is over, real firmware may differ
+
+#define STEPPER_ACK_TIMEOUT_US  (10000)  // controller acknowledges every byte well within this
+#define STEPPER_DONE_TIMEOUT_US (100000) // completion byte may come this late after computed move end
+#define STEPPER_DURATION_SLACK  (0.02)   // controller clock tolerance on computed move time
+
+// frame retries: line is left silent for the resync gap (controller then takes
+// the next byte as frame start, as the simulator does) plus a backoff doubling
+// per attempt, then whole frame is sent again
+#define STEPPER_RETRY_LIMIT          (3)
+#define STEPPER_RESYNC_GAP_US        (20000)
+#define STEPPER_RETRY_BACKOFF_US     (2000)
+#define STEPPER_RETRY_BACKOFF_MAX_US (50000)
+
+// how frames go out: byte by byte, each after previous byte's ack, or whole
+// frame in one write with acks collected afterwards. Per byte is what firmware
+// was written against; whole frame saves four turnarounds per command, but
+// once all bytes are out a bad ack cannot be retried safely
+#define STEPPER_TX_PER_BYTE (0)
+#define STEPPER_TX_FRAME    (1)
+
+// move results
+#define STEPPER_MOVE_OK            (0)
+#define STEPPER_MOVE_ACK_TIMEOUT   (-1) // controller stopped acknowledging
+#define STEPPER_MOVE_DONE_TIMEOUT  (-2) // frame accepted, completion never came
+#define STEPPER_MOVE_IO_ERROR      (-3)
+#define STEPPER_MOVE_CANCELLED     (-4) // driver stopped before move was sent
+#define STEPPER_MOVE_BAD_ACK       (-5) // garbage instead of acks on every attempt
+#define STEPPER_MOVE_DEADLINE      (-6) // caller's deadline passed
+#define STEPPER_MOVE_RANGE         (-7) // step count does not fit a frame or bad frequency
+
+// line settings
+#define RS232_PARITY_NONE (0)
+#define RS232_PARITY_ODD  (1)
+#define RS232_PARITY_EVEN (2)
+
+#define RS232_FLOW_NONE    (0)
+#define RS232_FLOW_RTSCTS  (1)
+#define RS232_FLOW_XONXOFF (2)
+
+struct rs232_config_struc
+{
+  int baud;         // bits per second, must be a standard rate
+  int parity;       // RS232_PARITY_*
+  int stop_bits;    // 1 or 2
+  int flow;         // RS232_FLOW_*
+  int low_latency;  // ask driver to skip its receive batching, where supported
+  int vmin;         // read() returns after vmin bytes ...
+  int vtime;        // ... or vtime tenths of second; 0/0 never blocks
+};
+
+int stepper_tx_mode = STEPPER_TX_PER_BYTE; // STEPPER_TX_*, see stepper_set_tx_mode
+
+// one per serial port, so any number of controllers can be driven at once
+struct rs232_port_struc
+{
+  int pt_fd;
+  char pt_name[256];
+  struct rs232_config_struc pt_config;
+  struct termios pt_orig_settings; // restored on close
+  struct termios pt_curr_settings;
+};
 
 // --------------------------------------------------------------------------
-void print_dump(char *data, int size)
+void fprint_dump(FILE *file, char *data, int size)
 {
   int paragraphs = size / 0x10 + (!!(size % 0x10));
   int curr_tetrade = 0;
@@ -42,7 +136,7 @@ void print_dump(char *data, int size)
   for (curr_paragraph = 0; curr_paragraph < paragraphs; curr_paragraph ++)
   {
     // display address
-    printf("%08X | ", curr_paragraph * 0x10);
+    fprintf(file, "%08X | ", curr_paragraph * 0x10);
 
     // display hex bytes
     for (curr_tetrade = 0; curr_tetrade < 4; curr_tetrade++)
@@ -52,15 +146,15 @@ void print_dump(char *data, int size)
         if (curr_paragraph * 0x10 + curr_tetrade * 4 + curr_byte < size)
         {
           // print actual hex value if byte offset is below array size
-          printf("%02X ", data[curr_paragraph * 0x10 + curr_tetrade * 4 + curr_byte] & 0xFF);
+          fprintf(file, "%02X ", data[curr_paragraph * 0x10 + curr_tetrade * 4 + curr_byte] & 0xFF);
         } else
         {
           // else print white space
-          printf("   ");
+          fprintf(file, "   ");
         }
       }
       // print tetrade delimiter
-      printf("| ");
+      fprintf(file, "| ");
     }
 
     // display ascii values
@@ -69,18 +163,24 @@ void print_dump(char *data, int size)
       if (curr_paragraph * 0x10 + curr_byte < size)
       {
         // print only readable data, otherwice put '.'
-        printf("%c", ((data[curr_paragraph * 0x10 + curr_byte] < 32) || (data[curr_paragraph * 0x10 + curr_byte] > 127)) ? 
+        fprintf(file, "%c", ((data[curr_paragraph * 0x10 + curr_byte] < 32) || (data[curr_paragraph * 0x10 + curr_byte] > 127)) ? 
           '.' : 
           data[curr_paragraph * 0x10 + curr_byte]);
       } else
       {
-        printf(" ");
+        fprintf(file, " ");
       }
     }
-    printf("\n");
+    fprintf(file, "\n");
   }
 }
 
+// ---------------------------------------------------------------------------
+void print_dump(char *data, int size)
+{
+  fprint_dump(stdout, data, size);
+}
+
 
 // ---------------------------------------------------------------------------
 struct wl_cal_point_struc
@@ -89,11 +189,75 @@ struct wl_cal_point_struc
   double wavelength;
 };
 
+// cubic segment, value = c0 + t * (c1 + t * (c2 + t * c3)), t = x - x0
+struct wl_cal_segment_struc
+{
+  double x0;
+  double c0;
+  double c1;
+  double c2;
+  double c3;
+};
+
+#define WL_CAL_INTERP_LINEAR (0) // piecewise linear
+#define WL_CAL_INTERP_PCHIP  (1) // monotone cubic Hermite (Fritsch-Carlson), never overshoots
+#define WL_CAL_INTERP_SPLINE (2) // natural cubic spline, smoothest, may overshoot on noisy tables
+
+#define WL_CAL_ORDER_NONMONOTONIC (0)
+#define WL_CAL_ORDER_ASCENDING    (1)
+#define WL_CAL_ORDER_DESCENDING   (2)
+
 struct wl_cal_context_struc
 {
   int initialized;
   struct wl_cal_point_struc *cal_data;
   int cal_data_size;
+
+  int wl_order; // one of WL_CAL_ORDER_*, wavelength direction along increasing steps
+
+  // wavelength index, structure of arrays by ascending wavelength (monotonic tables only)
+  struct
+  {
+    double *x_wl;     // cal_data_size entries
+    int *x_step;      // cal_data_size entries
+    double *x_slope;  // cal_data_size entries, steps per wavelength unit of segment [k, k+1], last one is 0
+  } wl_index;
+
+  int interp_mode; // one of WL_CAL_INTERP_*, survives table reloads
+  struct wl_cal_segment_struc *wl_segments; // step as function of wavelength, one per wl_index segment, non-linear modes only
+  struct wl_cal_segment_struc *step_segments; // wavelength as function of step, one per cal_data segment, non-linear modes only
+
+  // last segment used by each direction, only a starting guess for the next lookup,
+  // so sweeps cost O(1) per point; shared by all readers, relaxed atomics are enough
+  struct
+  {
+    int c_wl_segment;
+    int c_step_segment;
+  } cache;
+
+  // optional dense lookup tables, see wl_cal_set_lut
+  struct
+  {
+    size_t l_max_bytes;       // requested footprint, 0 means off, survives table reloads
+    int l_threads;            // build threads
+
+    int l_step_min;
+    int l_step_count;
+    double *l_step_wl;        // wavelength of every step in [l_step_min, l_step_min + l_step_count)
+
+    double l_wl_min;
+    double l_wl_quantum;
+    double l_wl_inv_quantum;
+    int l_wl_count;
+    int *l_wl_step;           // step at l_wl_min + k * l_wl_quantum
+  } lut;
+
+  // binary table image, when set cal_data and wl_index point into it and are read only
+  struct
+  {
+    char *m_ptr;
+    FILE_SIZE_T m_length;
+  } mapping;
 };
 
 
@@ -213,6 +377,69 @@ int read_file_image(char *filename, char **image, FILE_SIZE_T *image_length)
   }
 }
 
+// ---------------------------------------------------------------------------
+// read only view of the whole file, mmap where available, heap copy otherwise
+int map_file_image(char *filename, char **image, FILE_SIZE_T *image_length)
+{
+#ifdef __unix__
+  int fd;
+  struct stat file_stat_struc;
+
+  *image = NULL;
+  *image_length = 0;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+  {
+    fprintf(stderr, "**Error**: open returned error %d, \"%s\", file \"%s\"\n", errno, strerror(errno), filename);
+    return -3;
+  }
+
+  if (fstat(fd, &file_stat_struc) != 0)
+  {
+    fprintf(stderr, "**Error**: fstat returned error %d, \"%s\", file \"%s\"\n", errno, strerror(errno), filename);
+    close(fd);
+    return -1;
+  }
+
+  // nothing to map, empty image
+  if (file_stat_struc.st_size == 0)
+  {
+    close(fd);
+    return 0;
+  }
+
+  *image = (char *)mmap(NULL, (size_t)file_stat_struc.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (*image == MAP_FAILED)
+  {
+    fprintf(stderr, "**Error**: mmap returned error %d, \"%s\", file \"%s\"\n", errno, strerror(errno), filename);
+    *image = NULL;
+    return -2;
+  }
+
+  *image_length = file_stat_struc.st_size;
+  return 0;
+#endif // __unix__
+
+#ifdef _WIN32
+  return read_file_image(filename, image, image_length);
+#endif // _WIN32
+}
+
+// ---------------------------------------------------------------------------
+void unmap_file_image(char *image, FILE_SIZE_T image_length)
+{
+  if (image == NULL) return;
+
+#ifdef __unix__
+  munmap(image, (size_t)image_length);
+#endif // __unix__
+
+#ifdef _WIN32
+  free(image);
+#endif // _WIN32
+}
+
 // ---------------------------------------------------------------------------
 int wl_cal_allocate_context(struct wl_cal_context_struc **wl_cal_context)
 {
@@ -226,16 +453,65 @@ int wl_cal_allocate_context(struct wl_cal_context_struc **wl_cal_context)
   return 0;
 }
 
+// ---------------------------------------------------------------------------
+void wl_cal_free_index(struct wl_cal_context_struc *wl_cal_context)
+{
+  if (wl_cal_context->mapping.m_ptr == NULL)
+  {
+    free(wl_cal_context->wl_index.x_wl);
+    free(wl_cal_context->wl_index.x_step);
+    free(wl_cal_context->wl_index.x_slope);
+  }
+  memset(&wl_cal_context->wl_index, 0, sizeof(wl_cal_context->wl_index));
+}
+
+// ---------------------------------------------------------------------------
+void wl_cal_free_lut(struct wl_cal_context_struc *wl_cal_context)
+{
+  free(wl_cal_context->lut.l_step_wl);
+  wl_cal_context->lut.l_step_wl = NULL;
+  wl_cal_context->lut.l_step_count = 0;
+
+  free(wl_cal_context->lut.l_wl_step);
+  wl_cal_context->lut.l_wl_step = NULL;
+  wl_cal_context->lut.l_wl_count = 0;
+}
+
+// ---------------------------------------------------------------------------
+// drops table data, heap or mapped, context itself stays allocated
+void wl_cal_release_table(struct wl_cal_context_struc *wl_cal_context)
+{
+  wl_cal_free_index(wl_cal_context);
+
+  free(wl_cal_context->wl_segments);
+  wl_cal_context->wl_segments = NULL;
+  free(wl_cal_context->step_segments);
+  wl_cal_context->step_segments = NULL;
+
+  wl_cal_free_lut(wl_cal_context);
+
+  if (wl_cal_context->mapping.m_ptr != NULL)
+  {
+    unmap_file_image(wl_cal_context->mapping.m_ptr, wl_cal_context->mapping.m_length);
+    wl_cal_context->mapping.m_ptr = NULL;
+    wl_cal_context->mapping.m_length = 0;
+  } else
+  if (wl_cal_context->cal_data != NULL)
+  {
+    free(wl_cal_context->cal_data);
+  }
+
+  wl_cal_context->cal_data = NULL;
+  wl_cal_context->cal_data_size = 0;
+  wl_cal_context->initialized = 0;
+}
+
 // ---------------------------------------------------------------------------
 int wl_cal_free_context(struct wl_cal_context_struc **wl_cal_context)
 {
   if (*wl_cal_context != NULL)
   {
-    if ((*wl_cal_context)->cal_data != NULL)
-    {
-      free((*wl_cal_context)->cal_data);
-      (*wl_cal_context)->cal_data = NULL;
-    }
+    wl_cal_release_table(*wl_cal_context);
 
     free(*wl_cal_context);
     *wl_cal_context = NULL;
@@ -245,574 +521,5588 @@ int wl_cal_free_context(struct wl_cal_context_struc **wl_cal_context)
 }
 
 // ---------------------------------------------------------------------------
-int wl_cal_read_table_file(struct wl_cal_context_struc *wl_cal_context, char *filename)
+int wl_cal_build_index(struct wl_cal_context_struc *wl_cal_context)
 {
-  int result;
-  int sorted;
-  FILE_SIZE_T i;
-  struct wl_cal_point_struc temp_point;
+  int i;
+  int src;
+  int size = wl_cal_context->cal_data_size;
+  int ascending = 1;
+  int descending = 1;
 
-  struct
+  wl_cal_free_index(wl_cal_context);
+
+  // cal_data is sorted by step, check which way wavelength goes
+  for (i = 0; i < size - 1; i++)
   {
-    char *i_ptr;
-    FILE_SIZE_T i_length;
-  } image;
+    if (wl_cal_context->cal_data[i].wavelength >= wl_cal_context->cal_data[i+1].wavelength) ascending = 0;
+    if (wl_cal_context->cal_data[i].wavelength <= wl_cal_context->cal_data[i+1].wavelength) descending = 0;
+  }
 
-  struct
+  if (ascending)
   {
-    char **l_array;
-    int l_count;
-    int l_index;
-  } line;
+    wl_cal_context->wl_order = WL_CAL_ORDER_ASCENDING;
+  } else
+  if (descending)
+  {
+    wl_cal_context->wl_order = WL_CAL_ORDER_DESCENDING;
+  } else
+  {
+    wl_cal_context->wl_order = WL_CAL_ORDER_NONMONOTONIC;
+    fprintf(stderr, "**Warning**: wl_cal_build_index: Wavelength is not monotonic along steps, "
+      "wl_cal_wl2step falls back to linear search and returns the first matching segment\n");
+    return 0;
+  }
 
-  if (wl_cal_context == NULL)
+  if (size < 1) return 0;
+
+  wl_cal_context->wl_index.x_wl = (double *)malloc(size * sizeof(double));
+  wl_cal_context->wl_index.x_step = (int *)malloc(size * sizeof(int));
+  wl_cal_context->wl_index.x_slope = (double *)malloc(size * sizeof(double));
+  if ((wl_cal_context->wl_index.x_wl == NULL) || (wl_cal_context->wl_index.x_step == NULL) || (wl_cal_context->wl_index.x_slope == NULL))
   {
-    fprintf(stderr, "**Error**: wl_cal_read_table_file: No context\n");
+    fprintf(stderr, "**Error**: wl_cal_build_index: Failed to allocate memory for wavelength index\n");
+    wl_cal_free_index(wl_cal_context);
     return -1;
   }
 
-  memset(&line, 0, sizeof(line));
+  for (i = 0; i < size; i++)
+  {
+    src = (wl_cal_context->wl_order == WL_CAL_ORDER_ASCENDING) ? i : (size - 1 - i);
+    wl_cal_context->wl_index.x_wl[i] = wl_cal_context->cal_data[src].wavelength;
+    wl_cal_context->wl_index.x_step[i] = wl_cal_context->cal_data[src].step;
+  }
 
-  result = read_file_image(filename, &image.i_ptr, &image.i_length);
-  if (result < 0) return result;
+  for (i = 0; i < size - 1; i++)
+  {
+    wl_cal_context->wl_index.x_slope[i] = (wl_cal_context->wl_index.x_step[i+1] - wl_cal_context->wl_index.x_step[i]) /
+      (wl_cal_context->wl_index.x_wl[i+1] - wl_cal_context->wl_index.x_wl[i]);
+  }
+  wl_cal_context->wl_index.x_slope[size - 1] = 0;
+
+  return 0;
+}
 
-  for (i = 0; i < image.i_length; i++)
+// ---------------------------------------------------------------------------
+// find segment [k, k+1] of ascending x_wl with x_wl[k] < wavelength <= x_wl[k+1],
+// interpolation probes alternate with bisection, so worst case stays O(log n)
+int wl_cal_index_search(const double *x_wl, int size, double wavelength)
+{
+  int lo = 0;
+  int hi = size - 1;
+  int probe;
+  int bisect = 0;
+
+  if (wavelength <= x_wl[0]) return 0;
+
+  while (hi - lo > 1)
   {
-    // skip empty lines, etc
-    if ((image.i_ptr[i] != '\n') && (image.i_ptr[i] != '\r'))
+    if (bisect)
     {
-      line.l_count ++;
-      for (; i < image.i_length; i++)
-      {
-        if ((image.i_ptr[i] == '\n') || (image.i_ptr[i] == '\r'))
-        {
-          break;
-        }
-      }
+      probe = lo + (hi - lo) / 2;
     } else
     {
-      for (i++; i < image.i_length; i++)
-      {
-        if ((image.i_ptr[i] != '\n') && (image.i_ptr[i] != '\r'))
-        {
-          i--;
-          break;
-        }
-      }
+      probe = lo + (int)((wavelength - x_wl[lo]) / (x_wl[hi] - x_wl[lo]) * (hi - lo));
+      if (probe <= lo) probe = lo + 1;
+      if (probe >= hi) probe = hi - 1;
+    }
+    bisect = !bisect;
+
+    if (x_wl[probe] >= wavelength)
+    {
+      hi = probe;
+    } else
+    {
+      lo = probe;
     }
   }
 
-  if ((line.l_array = (char **)malloc(line.l_count * sizeof(char *))) == NULL)
+  return lo;
+}
+
+// ---------------------------------------------------------------------------
+// cubic coefficients through (x[k], y[k]) for strictly ascending x, n - 1 segments
+int wl_cal_build_segments(const double *x, const double *y, int n, int mode, struct wl_cal_segment_struc **segments)
+{
+  int k;
+  double h;
+  double d;
+  double w1;
+  double w2;
+  double *slope;  // derivative at nodes (pchip) or second derivative (spline)
+  double *delta;
+  double *diag;
+  struct wl_cal_segment_struc *seg;
+
+  *segments = NULL;
+  if (n < 2) return 0;
+
+  seg = (struct wl_cal_segment_struc *)malloc((n - 1) * sizeof(struct wl_cal_segment_struc));
+  slope = (double *)malloc(n * sizeof(double));
+  delta = (double *)malloc(n * sizeof(double));
+  diag = (double *)malloc(n * sizeof(double));
+  if ((seg == NULL) || (slope == NULL) || (delta == NULL) || (diag == NULL))
+  {
+    fprintf(stderr, "**Error**: wl_cal_build_segments: Failed to allocate memory for interpolation segments\n");
+    free(seg); free(slope); free(delta); free(diag);
+    return -1;
+  }
+
+  for (k = 0; k < n - 1; k++)
   {
-    fprintf(stderr, "**Error**: wl_cal_read_table_file: Failed to allocate memory for line buffer\n");
-    return -71;
+    delta[k] = (y[k+1] - y[k]) / (x[k+1] - x[k]);
   }
 
-  for (i = 0; i < image.i_length; i++)
+  if ((mode == WL_CAL_INTERP_PCHIP) || (n < 3))
   {
-    // skip empty lines, etc
-    if ((image.i_ptr[i] != '\n') && (image.i_ptr[i] != '\r'))
+    if (n < 3)
+    {
+      slope[0] = slope[1] = delta[0];
+    } else
     {
-      line.l_array[line.l_index] = image.i_ptr + i;
-      // remove leading spaces
-      for (; i < image.i_length; i++)
+      // interior: weighted harmonic mean of neighbour secants, flat at local extrema
+      for (k = 1; k < n - 1; k++)
       {
-        if ((image.i_ptr[i] == ' ') || (image.i_ptr[i] == '\t'))
+        if (delta[k-1] * delta[k] <= 0)
         {
-          line.l_array[line.l_index] ++;
+          slope[k] = 0;
         } else
         {
-          break;
+          w1 = 2 * (x[k+1] - x[k]) + (x[k] - x[k-1]);
+          w2 = (x[k+1] - x[k]) + 2 * (x[k] - x[k-1]);
+          slope[k] = (w1 + w2) / (w1 / delta[k-1] + w2 / delta[k]);
         }
       }
 
-      if ((image.i_ptr[i] != '\n') && (image.i_ptr[i] != '\r'))
-      {
-        line.l_index ++;
-      }
-
-      for (; i < image.i_length; i++)
-      {
-        if ((image.i_ptr[i] == '\n') || (image.i_ptr[i] == '\r'))
-        {
-          i--;
-          break;
-        }
-      }
-    } else
-    {
-      for (; i < image.i_length; i++)
+      // ends: three point estimate, limited to keep shape
+      for (k = 0; k < 2; k++)
       {
-        if ((image.i_ptr[i] != '\n') && (image.i_ptr[i] != '\r'))
+        int e = k ? n - 1 : 0;        // end node
+        int s0 = k ? n - 2 : 0;       // adjacent segment
+        int s1 = k ? n - 3 : 1;       // next segment
+        double h0 = x[s0+1] - x[s0];
+        double h1 = x[s1+1] - x[s1];
+
+        slope[e] = ((2 * h0 + h1) * delta[s0] - h0 * delta[s1]) / (h0 + h1);
+        if (slope[e] * delta[s0] <= 0)
         {
-          i--;
-          break;
+          slope[e] = 0;
         } else
+        if ((delta[s0] * delta[s1] <= 0) && (fabs(slope[e]) > fabs(3 * delta[s0])))
         {
-          image.i_ptr[i] = 0;
+          slope[e] = 3 * delta[s0];
         }
       }
     }
-  }
-
-  line.l_count = line.l_index;
-
-  // allocate array
-  if ((wl_cal_context->cal_data = (struct wl_cal_point_struc *)malloc(line.l_count * sizeof(struct wl_cal_point_struc))) == NULL)
-  {
-    fprintf(stderr, "**Error**: wl_cal_read_table_file: Failed to allocate memory for spectrum.\n");
-    return -81;
-  }
-
-  wl_cal_context->cal_data_size = 0;
 
-  for (i = 0; i < line.l_count; i++)
+    for (k = 0; k < n - 1; k++)
+    {
+      h = x[k+1] - x[k];
+      d = delta[k];
+      seg[k].x0 = x[k];
+      seg[k].c0 = y[k];
+      seg[k].c1 = slope[k];
+      seg[k].c2 = (3 * d - 2 * slope[k] - slope[k+1]) / h;
+      seg[k].c3 = (slope[k] + slope[k+1] - 2 * d) / (h * h);
+    }
+  } else
   {
-    if (line.l_array[i][0] != '#') // skip commented lines
+    // natural spline, second derivatives from tridiagonal system by Thomas algorithm,
+    // delta[] is reused as right hand side
+    slope[0] = 0;
+    slope[n-1] = 0;
+    diag[0] = 1;
+    for (k = n - 2; k >= 1; k--)
     {
-#ifdef __unix__
-      sscanf(line.l_array[i], "%d\t%lf", 
-        &wl_cal_context->cal_data[wl_cal_context->cal_data_size].step,
-        &wl_cal_context->cal_data[wl_cal_context->cal_data_size].wavelength);
-#endif // __unix__
-#ifdef _WIN32
-      sscanf_s(line.l_array[i], "%d\t%lf", 
-        &wl_cal_context->cal_data[wl_cal_context->cal_data_size].step,
-        &wl_cal_context->cal_data[wl_cal_context->cal_data_size].wavelength);
-#endif // _WIN32
-      wl_cal_context->cal_data_size ++;
+      delta[k] = 6 * (delta[k] - delta[k-1]);
     }
-  }
-
-  // free file image
-  free(image.i_ptr);
-  image.i_ptr = NULL;
-  image.i_length = 0;
-
-  // free line table
-  free(line.l_array);
-  line.l_array = NULL;
-  line.l_count = 0;
-  line.l_index = 0;
 
-  // sort
-  sorted = 0;
-  while (! sorted)
-  {
-    sorted = 1;
-    for (i = 0; i < wl_cal_context->cal_data_size - 1; i++)
+    for (k = 1; k < n - 1; k++)
     {
-      if (wl_cal_context->cal_data[i].step > wl_cal_context->cal_data[i+1].step)
-      {
-        temp_point = wl_cal_context->cal_data[i];
-        wl_cal_context->cal_data[i] = wl_cal_context->cal_data[i+1];
-        wl_cal_context->cal_data[i+1] = temp_point;
+      h = x[k] - x[k-1];
+      w1 = (k > 1) ? h / diag[k-1] : 0; // elimination factor
+      diag[k] = 2 * (x[k+1] - x[k-1]) - w1 * h;
+      if (k > 1) delta[k] -= w1 * delta[k-1];
+    }
 
-        sorted = 0;
-      }
+    for (k = n - 2; k >= 1; k--)
+    {
+      slope[k] = (delta[k] - ((k < n - 2) ? (x[k+1] - x[k]) * slope[k+1] : 0)) / diag[k];
     }
-  }
 
-/*
-  for (i = 0; i < wl_cal_context->cal_data_size; i++)
-  {
-    printf("%d\t%d\t%f\n", i, wl_cal_context->cal_data[i].step, wl_cal_context->cal_data[i].wavelength);
+    for (k = 0; k < n - 1; k++)
+    {
+      h = x[k+1] - x[k];
+      d = (y[k+1] - y[k]) / h;
+      seg[k].x0 = x[k];
+      seg[k].c0 = y[k];
+      seg[k].c1 = d - h * (2 * slope[k] + slope[k+1]) / 6;
+      seg[k].c2 = slope[k] / 2;
+      seg[k].c3 = (slope[k+1] - slope[k]) / (6 * h);
+    }
   }
-*/
 
-  wl_cal_context->initialized = 1;
+  free(slope);
+  free(delta);
+  free(diag);
 
+  *segments = seg;
   return 0;
 }
 
 // ---------------------------------------------------------------------------
-int wl_cal_wl2step(struct wl_cal_context_struc *wl_cal_context, double wavelength, int *step)
+// (re)computes segment cache for current interpolation mode, done once per load
+int wl_cal_prepare_interp(struct wl_cal_context_struc *wl_cal_context)
 {
   int i;
+  int result;
+  double *x;
+  double *y;
 
-  if (wl_cal_context == NULL)
+  free(wl_cal_context->wl_segments);
+  wl_cal_context->wl_segments = NULL;
+  free(wl_cal_context->step_segments);
+  wl_cal_context->step_segments = NULL;
+
+  if (wl_cal_context->interp_mode == WL_CAL_INTERP_LINEAR) return 0;
+
+  if (wl_cal_context->wl_order == WL_CAL_ORDER_NONMONOTONIC)
   {
-    fprintf(stderr, "**Error**: wl_cal_wl2step: No context\n");
+    fprintf(stderr, "**Error**: wl_cal_prepare_interp: Cubic interpolation needs monotonic calibration table\n");
     return -1;
   }
 
-  if (wl_cal_context->initialized != 1)
+  if ((y = (double *)malloc((wl_cal_context->cal_data_size + 1) * sizeof(double))) == NULL)
   {
-    fprintf(stderr, "**Error**: wl_cal_wl2step: Calibration table is not initialized\n");
+    fprintf(stderr, "**Error**: wl_cal_prepare_interp: Failed to allocate memory\n");
     return -2;
   }
 
-  for (i = 0; i < wl_cal_context->cal_data_size - 1; i++)
+  if ((x = (double *)malloc((wl_cal_context->cal_data_size + 1) * sizeof(double))) == NULL)
   {
-    if ((wl_cal_context->cal_data[i].wavelength <= wavelength) && (wl_cal_context->cal_data[i+1].wavelength >= wavelength))
-    {
-      *step = wl_cal_context->cal_data[i].step + (wl_cal_context->cal_data[i+1].step - wl_cal_context->cal_data[i].step) /
-        (wl_cal_context->cal_data[i+1].wavelength - wl_cal_context->cal_data[i].wavelength) *
-        (wavelength - wl_cal_context->cal_data[i].wavelength);
+    fprintf(stderr, "**Error**: wl_cal_prepare_interp: Failed to allocate memory\n");
+    free(y);
+    return -2;
+  }
 
-      return 0;
-    }
+  for (i = 0; i < wl_cal_context->cal_data_size; i++)
+  {
+    y[i] = wl_cal_context->wl_index.x_step[i];
   }
 
-  fprintf(stderr, "**Error**: wl_cal_wl2step: Specified wavelength is out of boundaries of calibration table\n");
-  return -3;
-}
+  result = wl_cal_build_segments(wl_cal_context->wl_index.x_wl, y, wl_cal_context->cal_data_size,
+    wl_cal_context->interp_mode, &wl_cal_context->wl_segments);
 
+  // and the other way round along cal_data
+  for (i = 0; (result == 0) && (i < wl_cal_context->cal_data_size); i++)
+  {
+    x[i] = wl_cal_context->cal_data[i].step;
+    y[i] = wl_cal_context->cal_data[i].wavelength;
+  }
 
-// ---------------------------------------------------------------------------
-int rs232_write_string(int fd, char *string)
-{
-  return write(fd, string, strlen(string));
-}
+  if (result == 0)
+  {
+    result = wl_cal_build_segments(x, y, wl_cal_context->cal_data_size,
+      wl_cal_context->interp_mode, &wl_cal_context->step_segments);
+  }
 
-// ---------------------------------------------------------------------------
-int rs232_read_buffer(int fd, char *buffer, int max_buf_length)
-{
-  int result;
-  int i;
+  free(x);
+  free(y);
 
-  for (i = 0; i < max_buf_length - 1; i++)
+  if (result < 0)
   {
-    if (result = read(fd, &buffer[i], 1) < 0) break;
-
-    if ((buffer[i] == '\n') || (buffer[i] == '\r')) break;
+    free(wl_cal_context->wl_segments);
+    wl_cal_context->wl_segments = NULL;
+    return -2;
   }
 
-  buffer[i] = 0;
-
-  return result;
+  return 0;
 }
 
-
 // ---------------------------------------------------------------------------
-int rs232_open(int *dev_fd, char *dev_file)
+int wl_cal_set_interp_mode(struct wl_cal_context_struc *wl_cal_context, int mode)
 {
   int result;
 
-  *dev_fd = open(dev_file, O_RDWR | O_NOCTTY );
-  if(*dev_fd < 0)
+  if (wl_cal_context == NULL)
   {
-    fprintf(stderr, "**Error**: rs232_open: Failed to open device %s, exiting\n", dev_file);
-    *dev_fd = 0;
+    fprintf(stderr, "**Error**: wl_cal_set_interp_mode: No context\n");
     return -1;
   }
 
-  // read current state of serial port
-  result = tcgetattr(*dev_fd, &orig_serial_port_settings);
-  if (result == -1)
+  if ((mode != WL_CAL_INTERP_LINEAR) && (mode != WL_CAL_INTERP_PCHIP) && (mode != WL_CAL_INTERP_SPLINE))
   {
-    fprintf(stderr, "**Error**: rs232_open: Unable to get terminal settings (%s)\n", strerror(errno));
+    fprintf(stderr, "**Error**: wl_cal_set_interp_mode: Unknown interpolation mode %d\n", mode);
     return -2;
   }
 
-  curr_serial_port_settings = orig_serial_port_settings;
+  wl_cal_context->interp_mode = mode;
 
-  result = cfsetispeed(&curr_serial_port_settings, B19200);
-  if (result == -1)
+  // table loaded later gets its segments at load time
+  if (wl_cal_context->initialized != 1) return 0;
+
+  result = wl_cal_prepare_interp(wl_cal_context);
+  if (result < 0)
   {
-    fprintf(stderr, "**Error**: rs232_open: Unable to set terminal input speed (%s)\n", strerror(errno));
+    wl_cal_context->interp_mode = WL_CAL_INTERP_LINEAR;
     return -3;
   }
 
-  result = cfsetospeed(&curr_serial_port_settings, B19200);
-  if (result == -1)
-  {
-    fprintf(stderr, "**Error**: rs232_open: Unable to set terminal output speed (%s)\n", strerror(errno));
-    return -4;
-  }
+  return 0;
+}
 
-  curr_serial_port_settings.c_lflag = 0;
+// ---------------------------------------------------------------------------
+// conversion result is rounded to nearest step, halves away from zero
+int wl_cal_round_step(double step)
+{
+  return (int)((step < 0) ? ceil(step - 0.5) : floor(step + 0.5));
+}
+
+// ---------------------------------------------------------------------------
+// true if segment k is the one wl_cal_index_search would return for value
+int wl_cal_segment_fits(const double *x, int size, int k, double value)
+{
+  if ((k < 0) || (k > size - 2)) return 0;
+
+  return (value <= x[k+1]) && ((value > x[k]) || ((k == 0) && (value >= x[0])));
+}
+
+// ---------------------------------------------------------------------------
+// same as wl_cal_index_search, but over steps of cal_data
+int wl_cal_step_search(const struct wl_cal_point_struc *points, int size, int step)
+{
+  int lo = 0;
+  int hi = size - 1;
+  int probe;
+
+  if (step <= points[0].step) return 0;
+
+  while (hi - lo > 1)
+  {
+    probe = lo + (hi - lo) / 2;
+    if (points[probe].step >= step)
+    {
+      hi = probe;
+    } else
+    {
+      lo = probe;
+    }
+  }
+
+  return lo;
+}
+
+// ---------------------------------------------------------------------------
+// fractional step on wl_index segment k, monotonic tables only
+double wl_cal_eval_wl_segment(struct wl_cal_context_struc *wl_cal_context, int k, double wavelength)
+{
+  double t;
+  struct wl_cal_segment_struc *seg;
+
+  if (wl_cal_context->wl_segments != NULL)
+  {
+    seg = &wl_cal_context->wl_segments[k];
+    t = wavelength - seg->x0;
+    return seg->c0 + t * (seg->c1 + t * (seg->c2 + t * seg->c3));
+  }
+
+  return wl_cal_context->wl_index.x_step[k] + wl_cal_context->wl_index.x_slope[k] * (wavelength - wl_cal_context->wl_index.x_wl[k]);
+}
+
+// ---------------------------------------------------------------------------
+// wavelength on cal_data segment k
+double wl_cal_eval_step_segment(struct wl_cal_context_struc *wl_cal_context, int k, int step)
+{
+  double t;
+  struct wl_cal_segment_struc *seg;
+  struct wl_cal_point_struc *points = wl_cal_context->cal_data;
+
+  if (wl_cal_context->step_segments != NULL)
+  {
+    seg = &wl_cal_context->step_segments[k];
+    t = step - seg->x0;
+    return seg->c0 + t * (seg->c1 + t * (seg->c2 + t * seg->c3));
+  }
+
+  return points[k].wavelength + (points[k+1].wavelength - points[k].wavelength) /
+    (points[k+1].step - points[k].step) * (step - points[k].step);
+}
+
+// ---------------------------------------------------------------------------
+struct wl_cal_lut_job_struc
+{
+  struct wl_cal_context_struc *j_context;
+  int j_from; // entry range [j_from, j_to) of both tables
+  int j_to;
+};
+
+// ---------------------------------------------------------------------------
+// fills one slice of both tables, walks segments sequentially, no shared state
+void *wl_cal_lut_worker(void *arg)
+{
+  struct wl_cal_lut_job_struc *job = (struct wl_cal_lut_job_struc *)arg;
+  struct wl_cal_context_struc *wl_cal_context = job->j_context;
+  int size = wl_cal_context->cal_data_size;
+  int k;
+  int i;
+  int step;
+  double wavelength;
+  double wl_max;
+
+  if (wl_cal_context->lut.l_step_wl != NULL)
+  {
+    k = (job->j_from < wl_cal_context->lut.l_step_count) ? job->j_from : wl_cal_context->lut.l_step_count;
+    i = wl_cal_step_search(wl_cal_context->cal_data, size, wl_cal_context->lut.l_step_min + k);
+    for (; (k < job->j_to) && (k < wl_cal_context->lut.l_step_count); k++)
+    {
+      step = wl_cal_context->lut.l_step_min + k;
+      while ((i < size - 2) && (step > wl_cal_context->cal_data[i+1].step)) i++;
+      wl_cal_context->lut.l_step_wl[k] = wl_cal_eval_step_segment(wl_cal_context, i, step);
+    }
+  }
+
+  if (wl_cal_context->lut.l_wl_step != NULL)
+  {
+    wl_max = wl_cal_context->wl_index.x_wl[size - 1];
+    k = (job->j_from < wl_cal_context->lut.l_wl_count) ? job->j_from : wl_cal_context->lut.l_wl_count;
+    wavelength = wl_cal_context->lut.l_wl_min + k * wl_cal_context->lut.l_wl_quantum;
+    i = wl_cal_index_search(wl_cal_context->wl_index.x_wl, size, (wavelength < wl_max) ? wavelength : wl_max);
+    for (; (k < job->j_to) && (k < wl_cal_context->lut.l_wl_count); k++)
+    {
+      wavelength = wl_cal_context->lut.l_wl_min + k * wl_cal_context->lut.l_wl_quantum;
+      if (wavelength > wl_max) wavelength = wl_max;
+      while ((i < size - 2) && (wavelength > wl_cal_context->wl_index.x_wl[i+1])) i++;
+      wl_cal_context->lut.l_wl_step[k] = wl_cal_round_step(wl_cal_eval_wl_segment(wl_cal_context, i, wavelength));
+    }
+  }
+
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Builds dense tables for the loaded calibration within lut.l_max_bytes:
+// step -> wavelength gets one entry per step of the table range (exact, used by
+// wl_cal_step2wl transparently) if it fits in half of the budget, the rest goes
+// to wavelength -> step with up to WL_CAL_LUT_WL_PER_STEP entries per step
+// (quantized, used by wl_cal_lut_wl2step and WL_CAL_LUT_WL2STEP only)
+#define WL_CAL_LUT_WL_PER_STEP (8)
+#define WL_CAL_LUT_MAX_THREADS (16)
+
+int wl_cal_prepare_lut(struct wl_cal_context_struc *wl_cal_context)
+{
+  int i;
+  int threads;
+  int entries;
+  int size = wl_cal_context->cal_data_size;
+  long long step_range;
+  size_t budget = wl_cal_context->lut.l_max_bytes;
+  size_t wl_count;
+  struct wl_cal_lut_job_struc jobs[WL_CAL_LUT_MAX_THREADS];
+#ifdef __unix__
+  pthread_t thread_ids[WL_CAL_LUT_MAX_THREADS];
+#endif // __unix__
+
+  wl_cal_free_lut(wl_cal_context);
+
+  if ((budget == 0) || (size < 2)) return 0;
+
+  step_range = (long long)wl_cal_context->cal_data[size-1].step - wl_cal_context->cal_data[0].step + 1;
+  if ((size_t)step_range * sizeof(double) <= budget / 2)
+  {
+    wl_cal_context->lut.l_step_min = wl_cal_context->cal_data[0].step;
+    wl_cal_context->lut.l_step_count = (int)step_range;
+    if ((wl_cal_context->lut.l_step_wl = (double *)malloc((size_t)step_range * sizeof(double))) == NULL)
+    {
+      fprintf(stderr, "**Error**: wl_cal_prepare_lut: Failed to allocate memory for step table\n");
+      return -1;
+    }
+    budget -= (size_t)step_range * sizeof(double);
+  } else
+  {
+    fprintf(stderr, "**Warning**: wl_cal_prepare_lut: Step range %lld does not fit in lookup table budget, step table skipped\n", step_range);
+  }
+
+  if (wl_cal_context->wl_order != WL_CAL_ORDER_NONMONOTONIC)
+  {
+    wl_count = budget / sizeof(int);
+    if (wl_count > (size_t)step_range * WL_CAL_LUT_WL_PER_STEP) wl_count = (size_t)step_range * WL_CAL_LUT_WL_PER_STEP;
+    if (wl_count > 0x7FFFFFFF) wl_count = 0x7FFFFFFF;
+
+    if (wl_count >= 2)
+    {
+      wl_cal_context->lut.l_wl_min = wl_cal_context->wl_index.x_wl[0];
+      wl_cal_context->lut.l_wl_quantum = (wl_cal_context->wl_index.x_wl[size-1] - wl_cal_context->wl_index.x_wl[0]) / (wl_count - 1);
+      wl_cal_context->lut.l_wl_inv_quantum = 1.0 / wl_cal_context->lut.l_wl_quantum;
+      wl_cal_context->lut.l_wl_count = (int)wl_count;
+      if ((wl_cal_context->lut.l_wl_step = (int *)malloc(wl_count * sizeof(int))) == NULL)
+      {
+        fprintf(stderr, "**Error**: wl_cal_prepare_lut: Failed to allocate memory for wavelength table\n");
+        wl_cal_free_lut(wl_cal_context);
+        return -1;
+      }
+    }
+  }
+
+  entries = (wl_cal_context->lut.l_step_count > wl_cal_context->lut.l_wl_count) ?
+    wl_cal_context->lut.l_step_count : wl_cal_context->lut.l_wl_count;
+
+  threads = wl_cal_context->lut.l_threads;
+  if (threads < 1) threads = 1;
+  if (threads > WL_CAL_LUT_MAX_THREADS) threads = WL_CAL_LUT_MAX_THREADS;
+
+  for (i = 0; i < threads; i++)
+  {
+    jobs[i].j_context = wl_cal_context;
+    jobs[i].j_from = (int)((long long)entries * i / threads);
+    jobs[i].j_to = (int)((long long)entries * (i + 1) / threads);
+  }
+
+#ifdef __unix__
+  for (i = 1; i < threads; i++)
+  {
+    if (pthread_create(&thread_ids[i], NULL, wl_cal_lut_worker, &jobs[i]) != 0)
+    {
+      // no thread, do the slice here
+      wl_cal_lut_worker(&jobs[i]);
+      jobs[i].j_context = NULL;
+    }
+  }
+
+  wl_cal_lut_worker(&jobs[0]);
+
+  for (i = 1; i < threads; i++)
+  {
+    if (jobs[i].j_context != NULL) pthread_join(thread_ids[i], NULL);
+  }
+#endif // __unix__
+
+#ifdef _WIN32
+  for (i = 0; i < threads; i++)
+  {
+    wl_cal_lut_worker(&jobs[i]);
+  }
+#endif // _WIN32
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// max_bytes of 0 switches dense tables off, threads is number of build threads
+int wl_cal_set_lut(struct wl_cal_context_struc *wl_cal_context, size_t max_bytes, int threads)
+{
+  if (wl_cal_context == NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_set_lut: No context\n");
+    return -1;
+  }
+
+  wl_cal_context->lut.l_max_bytes = max_bytes;
+  wl_cal_context->lut.l_threads = threads;
+
+  // table loaded later gets its lookup tables at load time
+  if (wl_cal_context->initialized != 1) return 0;
+
+  return (wl_cal_prepare_lut(wl_cal_context) < 0) ? -2 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// LSD radix sort by step, 8 bits per pass; passes where every key shares the digit are skipped
+int wl_cal_radix_sort_points(struct wl_cal_point_struc *points, int size)
+{
+  int i;
+  int pass;
+  int digit;
+  int skip;
+  unsigned int key;
+  int count[256];
+  struct wl_cal_point_struc *temp;
+  struct wl_cal_point_struc *src = points;
+  struct wl_cal_point_struc *dst;
+  struct wl_cal_point_struc *swap;
+
+  if ((temp = (struct wl_cal_point_struc *)malloc(size * sizeof(struct wl_cal_point_struc))) == NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_radix_sort_points: Failed to allocate memory for sort buffer\n");
+    return -1;
+  }
+  dst = temp;
+
+  for (pass = 0; pass < 4; pass++)
+  {
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < size; i++)
+    {
+      key = (unsigned int)src[i].step ^ 0x80000000u; // flip sign bit, so negative steps go first
+      count[(key >> (pass * 8)) & 0xFF] ++;
+    }
+
+    skip = 0;
+    for (digit = 0; digit < 256; digit++)
+    {
+      if (count[digit] == size) skip = 1;
+    }
+    if (skip) continue;
+
+    // exclusive prefix sum, gives first output slot of each digit
+    for (i = 0, digit = 0; digit < 256; digit++)
+    {
+      key = count[digit];
+      count[digit] = i;
+      i += key;
+    }
+
+    for (i = 0; i < size; i++)
+    {
+      key = (unsigned int)src[i].step ^ 0x80000000u;
+      dst[count[(key >> (pass * 8)) & 0xFF] ++] = src[i];
+    }
+
+    swap = src; src = dst; dst = swap;
+  }
+
+  if (src != points)
+  {
+    memcpy(points, src, size * sizeof(struct wl_cal_point_struc));
+  }
+
+  free(temp);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// orders cal_data by step in O(n), rows sharing a step are merged into one point with mean wavelength
+int wl_cal_sort_table(struct wl_cal_context_struc *wl_cal_context)
+{
+  int i;
+  int j;
+  int first;
+  int merged = 0;
+  int sorted = 1;
+  struct wl_cal_point_struc *points = wl_cal_context->cal_data;
+  int size = wl_cal_context->cal_data_size;
+
+  for (i = 0; i < size - 1; i++)
+  {
+    if (points[i].step > points[i+1].step)
+    {
+      sorted = 0;
+      break;
+    }
+  }
+
+  if (! sorted)
+  {
+    if (wl_cal_radix_sort_points(points, size) < 0) return -101;
+  }
+
+  // merge duplicates in place
+  for (i = 0, j = 0; i < size; j++)
+  {
+    first = i;
+    points[j] = points[i];
+    for (i++; (i < size) && (points[i].step == points[first].step); i++)
+    {
+      points[j].wavelength += points[i].wavelength;
+    }
+
+    if (i - first > 1)
+    {
+      points[j].wavelength /= (i - first);
+      merged += i - first - 1;
+    }
+  }
+
+  if (merged)
+  {
+    fprintf(stderr, "**Warning**: wl_cal_sort_table: %d row(s) with duplicate steps merged, wavelengths averaged\n", merged);
+  }
+
+  wl_cal_context->cal_data_size = j;
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// parses optionally signed decimal integer at *cursor, advances cursor past it
+int wl_cal_parse_int(const char **cursor, const char *end, int *value)
+{
+  const char *p = *cursor;
+  int negative = 0;
+  long long v = 0;
+
+  if ((p < end) && ((*p == '-') || (*p == '+')))
+  {
+    negative = (*p == '-');
+    p++;
+  }
+
+  if ((p >= end) || (*p < '0') || (*p > '9')) return -1;
+
+  for (; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+  {
+    v = v * 10 + (*p - '0');
+    if (v > 0x80000000LL) return -2; // overflow
+  }
+
+  if (negative) v = -v;
+  if (v > 0x7FFFFFFFLL) return -2;
+
+  *value = (int)v;
+  *cursor = p;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// parses decimal floating point number at *cursor, advances cursor past it.
+// Up to 15 significant digits and power of ten within 1e22 are converted exactly
+// by a single multiplication or division, anything longer goes through strtod.
+// Returns -1 if there is no number, -3 for inf, nan or values overflowing
+// double (sscanf used to let them in and they broke the wavelength index),
+// -4 if memory for a very long token could not be allocated
+int wl_cal_parse_double(const char **cursor, const char *end, double *value)
+{
+  static const double pow10[] =
+  {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const char *p = *cursor;
+  const char *start = *cursor;
+  int negative = 0;
+  int digits = 0;
+  int exponent = 0;
+  int exp_value = 0;
+  int exp_negative = 0;
+  int any_digit = 0;
+  unsigned long long mantissa = 0;
+  char token[64];
+  char *long_token;
+  double v;
+
+  if ((p < end) && ((*p == '-') || (*p == '+')))
+  {
+    negative = (*p == '-');
+    p++;
+  }
+
+  // integer part, leading zeros do not count as significant digits
+  for (; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+  {
+    any_digit = 1;
+    if ((mantissa == 0) && (*p == '0')) continue;
+    if (digits < 19)
+    {
+      mantissa = mantissa * 10 + (*p - '0');
+    } else
+    {
+      exponent ++;
+    }
+    digits ++;
+  }
+
+  if ((p < end) && (*p == '.'))
+  {
+    for (p++; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+    {
+      any_digit = 1;
+      if ((mantissa == 0) && (*p == '0'))
+      {
+        exponent --;
+        continue;
+      }
+      if (digits < 19)
+      {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent --;
+      }
+      digits ++;
+    }
+  }
+
+  if (! any_digit)
+  {
+    // any case, as strtod spells them
+    if ((end - p >= 3) && ((((p[0] | 0x20) == 'i') && ((p[1] | 0x20) == 'n') && ((p[2] | 0x20) == 'f')) ||
+      (((p[0] | 0x20) == 'n') && ((p[1] | 0x20) == 'a') && ((p[2] | 0x20) == 'n')))) return -3;
+    return -1;
+  }
+
+  if ((p < end) && ((*p == 'e') || (*p == 'E')))
+  {
+    const char *exp_start = p;
+
+    p++;
+    if ((p < end) && ((*p == '-') || (*p == '+')))
+    {
+      exp_negative = (*p == '-');
+      p++;
+    }
+
+    if ((p >= end) || (*p < '0') || (*p > '9'))
+    {
+      p = exp_start; // not an exponent, leave 'e' to the caller
+    } else
+    {
+      for (; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+      {
+        if (exp_value < 10000) exp_value = exp_value * 10 + (*p - '0');
+      }
+      exponent += exp_negative ? -exp_value : exp_value;
+    }
+  }
+
+  if ((digits <= 15) && (exponent >= -22) && (exponent <= 22))
+  {
+    v = (double)mantissa;
+    v = (exponent < 0) ? v / pow10[-exponent] : v * pow10[exponent];
+  } else
+  {
+    // slow path, exact rounding by C library; image is not zero terminated
+    long_token = token;
+    if ((size_t)(p - start) >= sizeof(token))
+    {
+      if ((long_token = (char *)malloc(p - start + 1)) == NULL) return -4;
+    }
+    memcpy(long_token, start, p - start);
+    long_token[p - start] = 0;
+    v = strtod(long_token, NULL);
+    if (long_token != token) free(long_token);
+    negative = 0; // sign already handled by strtod
+
+    if (! isfinite(v)) return -3;
+  }
+
+  *value = negative ? -v : v;
+  *cursor = p;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+int wl_cal_read_table_file(struct wl_cal_context_struc *wl_cal_context, char *filename)
+{
+  int result;
+  int line_number;
+  int rejected = 0;
+  int capacity;
+  const char *p;
+  const char *end;
+  const char *error_text;
+  struct wl_cal_point_struc point;
+  struct wl_cal_point_struc *grown;
+
+  struct
+  {
+    char *i_ptr;
+    FILE_SIZE_T i_length;
+  } image;
+
+  if (wl_cal_context == NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_read_table_file: No context\n");
+    return -1;
+  }
+
+  result = map_file_image(filename, &image.i_ptr, &image.i_length);
+  if (result < 0) return result;
+
+  // drop previous table if context is reused
+  wl_cal_release_table(wl_cal_context);
+
+  // typical row is "12345\t678.901\n", grown by doubling if the guess is short
+  capacity = (int)(image.i_length / 12) + 16;
+  if ((wl_cal_context->cal_data = (struct wl_cal_point_struc *)malloc(capacity * sizeof(struct wl_cal_point_struc))) == NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_read_table_file: Failed to allocate memory for spectrum.\n");
+    unmap_file_image(image.i_ptr, image.i_length);
+    return -81;
+  }
+
+  wl_cal_context->cal_data_size = 0;
+
+  p = image.i_ptr;
+  end = image.i_ptr + image.i_length;
+  line_number = 1;
+
+  while (p < end)
+  {
+    // remove leading spaces
+    while ((p < end) && ((*p == ' ') || (*p == '\t'))) p++;
+
+    error_text = NULL;
+
+    if ((p < end) && (*p != '\n') && (*p != '\r') && (*p != '#')) // skip empty and commented lines
+    {
+      result = wl_cal_parse_int(&p, end, &point.step);
+      if (result < 0)
+      {
+        error_text = (result == -2) ? "step is out of integer range" : "step is not an integer";
+      } else
+      if ((p >= end) || ((*p != ' ') && (*p != '\t')))
+      {
+        error_text = "missing separator after step";
+      } else
+      {
+        while ((p < end) && ((*p == ' ') || (*p == '\t'))) p++;
+
+        result = wl_cal_parse_double(&p, end, &point.wavelength);
+        if (result < 0)
+        {
+          error_text = (result == -3) ? "wavelength is not finite (inf, nan and overflow are not accepted)" : "wavelength is not a number";
+        } else
+        {
+          while ((p < end) && ((*p == ' ') || (*p == '\t'))) p++;
+
+          if ((p < end) && (*p != '\n') && (*p != '\r') && (*p != '#'))
+          {
+            error_text = "unexpected text after wavelength";
+          }
+        }
+      }
+
+      if (error_text != NULL)
+      {
+        fprintf(stderr, "**Error**: wl_cal_read_table_file: \"%s\" line %d rejected, %s\n", filename, line_number, error_text);
+        rejected ++;
+      } else
+      {
+        if (wl_cal_context->cal_data_size == capacity)
+        {
+          capacity *= 2;
+          if ((grown = (struct wl_cal_point_struc *)realloc(wl_cal_context->cal_data, capacity * sizeof(struct wl_cal_point_struc))) == NULL)
+          {
+            fprintf(stderr, "**Error**: wl_cal_read_table_file: Failed to allocate memory for spectrum.\n");
+            free(wl_cal_context->cal_data);
+            wl_cal_context->cal_data = NULL;
+            wl_cal_context->cal_data_size = 0;
+            unmap_file_image(image.i_ptr, image.i_length);
+            return -81;
+          }
+          wl_cal_context->cal_data = grown;
+        }
+
+        wl_cal_context->cal_data[wl_cal_context->cal_data_size ++] = point;
+      }
+    }
+
+    // skip rest of line and line break, "\r\n" counts as one
+    while ((p < end) && (*p != '\n') && (*p != '\r')) p++;
+    if (p < end)
+    {
+      if ((*p == '\r') && (p + 1 < end) && (p[1] == '\n')) p++;
+      p++;
+      line_number ++;
+    }
+  }
+
+  // free file image
+  unmap_file_image(image.i_ptr, image.i_length);
+  image.i_ptr = NULL;
+  image.i_length = 0;
+
+  if (rejected)
+  {
+    fprintf(stderr, "**Warning**: wl_cal_read_table_file: \"%s\" %d line(s) rejected\n", filename, rejected);
+  }
+
+  // give back unused tail of the guess
+  if ((wl_cal_context->cal_data_size > 0) && (wl_cal_context->cal_data_size < capacity))
+  {
+    if ((grown = (struct wl_cal_point_struc *)realloc(wl_cal_context->cal_data, wl_cal_context->cal_data_size * sizeof(struct wl_cal_point_struc))) != NULL)
+    {
+      wl_cal_context->cal_data = grown;
+    }
+  }
+
+  // sort
+  result = wl_cal_sort_table(wl_cal_context);
+  if (result < 0) return result;
+
+/*
+  for (i = 0; i < wl_cal_context->cal_data_size; i++)
+  {
+    printf("%d\t%d\t%f\n", i, wl_cal_context->cal_data[i].step, wl_cal_context->cal_data[i].wavelength);
+  }
+*/
+
+  result = wl_cal_build_index(wl_cal_context);
+  if (result < 0) return -91;
+
+  result = wl_cal_prepare_interp(wl_cal_context);
+  if (result < 0) return -92;
+
+  result = wl_cal_prepare_lut(wl_cal_context);
+  if (result < 0) return -93;
+
+  wl_cal_context->initialized = 1;
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Binary calibration table, native byte order, all sections 16 byte aligned:
+//   header | cal_data (sorted by step) | x_wl | x_step | x_slope
+// index sections are absent (offset 0) for non-monotonic tables.
+// Opening checks only the header, so it costs the same for any table size,
+// full payload check is done by wl_cal_verify_table_binary on request.
+#define WL_CAL_BIN_MAGIC      "WLCALBIN"
+#define WL_CAL_BIN_VERSION    (1)
+#define WL_CAL_BIN_ENDIAN_TAG (0x01020304u)
+#define WL_CAL_BIN_ALIGN(x)   (((x) + 15) & ~((UINT64)15))
+
+struct wl_cal_bin_header_struc
+{
+  char magic[8];
+  unsigned int version;
+  unsigned int header_size;
+  unsigned int endian_tag;
+  int point_count;
+  int wl_order;
+  unsigned int point_size; // sizeof(struct wl_cal_point_struc) of the writer
+  UINT64 cal_data_offset;
+  UINT64 x_wl_offset;
+  UINT64 x_step_offset;
+  UINT64 x_slope_offset;
+  UINT64 file_size;
+  UINT64 payload_checksum; // FNV-1a over everything after the header
+  UINT64 header_checksum;  // FNV-1a over header up to this field, must stay last
+};
+
+// ---------------------------------------------------------------------------
+UINT64 wl_cal_fnv1a(UINT64 hash, const void *data, size_t length)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  size_t i;
+
+  for (i = 0; i < length; i++)
+  {
+    hash ^= p[i];
+    hash *= 0x100000001B3ULL;
+  }
+
+  return hash;
+}
+
+#define WL_CAL_FNV1A_INIT (0xCBF29CE484222325ULL)
+
+// ---------------------------------------------------------------------------
+int wl_cal_write_bin_section(FILE *file_stream, UINT64 *position, UINT64 offset, const void *data, size_t length, UINT64 *checksum)
+{
+  static const char padding[16] = {0};
+
+  if (offset > *position)
+  {
+    if (fwrite(padding, 1, (size_t)(offset - *position), file_stream) != (size_t)(offset - *position)) return -1;
+    *checksum = wl_cal_fnv1a(*checksum, padding, (size_t)(offset - *position));
+  }
+
+  if (fwrite(data, 1, length, file_stream) != length) return -1;
+  *checksum = wl_cal_fnv1a(*checksum, data, length);
+
+  *position = offset + length;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+int wl_cal_write_table_binary(struct wl_cal_context_struc *wl_cal_context, char *filename)
+{
+  FILE *file_stream;
+  struct wl_cal_bin_header_struc header;
+  UINT64 position;
+  UINT64 checksum;
+  int size;
+  int result = 0;
+
+  if (wl_cal_context == NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_write_table_binary: No context\n");
+    return -1;
+  }
+
+  if (wl_cal_context->initialized != 1)
+  {
+    fprintf(stderr, "**Error**: wl_cal_write_table_binary: Calibration table is not initialized\n");
+    return -2;
+  }
+
+  size = wl_cal_context->cal_data_size;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, WL_CAL_BIN_MAGIC, sizeof(header.magic));
+  header.version = WL_CAL_BIN_VERSION;
+  header.header_size = sizeof(header);
+  header.endian_tag = WL_CAL_BIN_ENDIAN_TAG;
+  header.point_count = size;
+  header.wl_order = wl_cal_context->wl_order;
+  header.point_size = sizeof(struct wl_cal_point_struc);
+
+  header.cal_data_offset = WL_CAL_BIN_ALIGN((UINT64)sizeof(header));
+  position = header.cal_data_offset + (UINT64)size * sizeof(struct wl_cal_point_struc);
+  if ((wl_cal_context->wl_order != WL_CAL_ORDER_NONMONOTONIC) && (size > 0))
+  {
+    header.x_wl_offset = WL_CAL_BIN_ALIGN(position);
+    header.x_step_offset = WL_CAL_BIN_ALIGN(header.x_wl_offset + (UINT64)size * sizeof(double));
+    header.x_slope_offset = WL_CAL_BIN_ALIGN(header.x_step_offset + (UINT64)size * sizeof(int));
+    position = header.x_slope_offset + (UINT64)size * sizeof(double);
+  }
+  header.file_size = position;
+
+#ifdef __unix__
+  if ((file_stream = fopen(filename, "wb")) == NULL)
+#endif // __unix__
+#ifdef _WIN32
+  if (fopen_s(&file_stream, filename, "wb"))
+#endif // _WIN32
+  {
+    fprintf(stderr, "**Error**: wl_cal_write_table_binary: Unable to create file \"%s\" (%s)\n", filename, strerror(errno));
+    return -3;
+  }
+
+  // header is rewritten once the payload checksum is known
+  if (fwrite(&header, sizeof(header), 1, file_stream) != 1) result = -4;
+
+  position = sizeof(header);
+  checksum = WL_CAL_FNV1A_INIT;
+  if (! result)
+  {
+    result = wl_cal_write_bin_section(file_stream, &position, header.cal_data_offset,
+      wl_cal_context->cal_data, size * sizeof(struct wl_cal_point_struc), &checksum);
+  }
+  if ((! result) && header.x_wl_offset)
+  {
+    result = wl_cal_write_bin_section(file_stream, &position, header.x_wl_offset,
+      wl_cal_context->wl_index.x_wl, size * sizeof(double), &checksum);
+    if (! result) result = wl_cal_write_bin_section(file_stream, &position, header.x_step_offset,
+      wl_cal_context->wl_index.x_step, size * sizeof(int), &checksum);
+    if (! result) result = wl_cal_write_bin_section(file_stream, &position, header.x_slope_offset,
+      wl_cal_context->wl_index.x_slope, size * sizeof(double), &checksum);
+  }
+
+  if (! result)
+  {
+    header.payload_checksum = checksum;
+    header.header_checksum = wl_cal_fnv1a(WL_CAL_FNV1A_INIT, &header, offsetof(struct wl_cal_bin_header_struc, header_checksum));
+    if ((fseek(file_stream, 0, SEEK_SET) != 0) || (fwrite(&header, sizeof(header), 1, file_stream) != 1)) result = -4;
+  }
+
+  if (fclose(file_stream) != 0) result = -4;
+
+  if (result < 0)
+  {
+    fprintf(stderr, "**Error**: wl_cal_write_table_binary: Failed to write file \"%s\" (%s)\n", filename, strerror(errno));
+    return -4;
+  }
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// section of length bytes at offset lies within [lowest, file_length) and is
+// aligned for doubles; written so that huge offsets cannot wrap around
+int wl_cal_bin_section_fits(UINT64 offset, UINT64 length, UINT64 lowest, UINT64 file_length)
+{
+  return (offset >= lowest) && (offset % sizeof(double) == 0) && (offset <= file_length) && (length <= file_length - offset);
+}
+
+// ---------------------------------------------------------------------------
+int wl_cal_map_table_binary(struct wl_cal_context_struc *wl_cal_context, char *filename)
+{
+  int result;
+  int size;
+  char *image;
+  FILE_SIZE_T image_length;
+  struct wl_cal_bin_header_struc *header;
+  const char *error_text = NULL;
+
+  if (wl_cal_context == NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_map_table_binary: No context\n");
+    return -1;
+  }
+
+  result = map_file_image(filename, &image, &image_length);
+  if (result < 0) return result;
+
+  header = (struct wl_cal_bin_header_struc *)image;
+  if (image_length < sizeof(struct wl_cal_bin_header_struc))
+  {
+    error_text = "file is too short";
+  } else
+  if (memcmp(header->magic, WL_CAL_BIN_MAGIC, sizeof(header->magic)) != 0)
+  {
+    error_text = "not a binary calibration table";
+  } else
+  if (header->endian_tag != WL_CAL_BIN_ENDIAN_TAG)
+  {
+    error_text = "written on machine with different byte order";
+  } else
+  if ((header->version != WL_CAL_BIN_VERSION) || (header->header_size != sizeof(struct wl_cal_bin_header_struc)) ||
+    (header->point_size != sizeof(struct wl_cal_point_struc)))
+  {
+    error_text = "unsupported format version";
+  } else
+  if (header->header_checksum != wl_cal_fnv1a(WL_CAL_FNV1A_INIT, header, offsetof(struct wl_cal_bin_header_struc, header_checksum)))
+  {
+    error_text = "header checksum mismatch";
+  } else
+  if ((header->file_size != image_length) || (header->point_count < 0) ||
+    (! wl_cal_bin_section_fits(header->cal_data_offset, (UINT64)header->point_count * sizeof(struct wl_cal_point_struc),
+      sizeof(struct wl_cal_bin_header_struc), image_length)) ||
+    ((header->wl_order != WL_CAL_ORDER_NONMONOTONIC) && (header->point_count > 0) && (! header->x_wl_offset)))
+  {
+    error_text = "file is truncated or damaged";
+  } else
+  if (header->x_wl_offset || header->x_step_offset || header->x_slope_offset)
+  {
+    // index sections follow the points in this order and must not overlap
+    if ((! wl_cal_bin_section_fits(header->x_wl_offset, (UINT64)header->point_count * sizeof(double),
+        header->cal_data_offset + (UINT64)header->point_count * sizeof(struct wl_cal_point_struc), image_length)) ||
+      (! wl_cal_bin_section_fits(header->x_step_offset, (UINT64)header->point_count * sizeof(int),
+        header->x_wl_offset + (UINT64)header->point_count * sizeof(double), image_length)) ||
+      (! wl_cal_bin_section_fits(header->x_slope_offset, (UINT64)header->point_count * sizeof(double),
+        header->x_step_offset + (UINT64)header->point_count * sizeof(int), image_length)))
+    {
+      error_text = "index sections are out of file, misaligned or overlap";
+    }
+  }
+
+  if (error_text != NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_map_table_binary: \"%s\" %s\n", filename, error_text);
+    unmap_file_image(image, image_length);
+    return -11;
+  }
+
+  wl_cal_release_table(wl_cal_context);
+
+  size = header->point_count;
+  wl_cal_context->mapping.m_ptr = image;
+  wl_cal_context->mapping.m_length = image_length;
+  wl_cal_context->cal_data = (struct wl_cal_point_struc *)(image + header->cal_data_offset);
+  wl_cal_context->cal_data_size = size;
+  wl_cal_context->wl_order = header->wl_order;
+  if (header->x_wl_offset)
+  {
+    wl_cal_context->wl_index.x_wl = (double *)(image + header->x_wl_offset);
+    wl_cal_context->wl_index.x_step = (int *)(image + header->x_step_offset);
+    wl_cal_context->wl_index.x_slope = (double *)(image + header->x_slope_offset);
+  }
+
+  // linear mode reads the mapped index as is, cubic segments and dense tables are computed once here
+  result = wl_cal_prepare_interp(wl_cal_context);
+  if (result == 0) result = wl_cal_prepare_lut(wl_cal_context);
+  if (result < 0)
+  {
+    wl_cal_release_table(wl_cal_context);
+    return -12;
+  }
+
+  wl_cal_context->initialized = 1;
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// full payload check of a mapped table, O(n)
+int wl_cal_verify_table_binary(struct wl_cal_context_struc *wl_cal_context)
+{
+  struct wl_cal_bin_header_struc *header;
+
+  if ((wl_cal_context == NULL) || (wl_cal_context->mapping.m_ptr == NULL))
+  {
+    fprintf(stderr, "**Error**: wl_cal_verify_table_binary: Context has no binary table mapped\n");
+    return -1;
+  }
+
+  header = (struct wl_cal_bin_header_struc *)wl_cal_context->mapping.m_ptr;
+  if (header->payload_checksum != wl_cal_fnv1a(WL_CAL_FNV1A_INIT, wl_cal_context->mapping.m_ptr + sizeof(struct wl_cal_bin_header_struc),
+    (size_t)(wl_cal_context->mapping.m_length - sizeof(struct wl_cal_bin_header_struc))))
+  {
+    fprintf(stderr, "**Error**: wl_cal_verify_table_binary: Payload checksum mismatch\n");
+    return -2;
+  }
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// loads either format, binary tables are recognised by magic
+int wl_cal_open_table_file(struct wl_cal_context_struc *wl_cal_context, char *filename)
+{
+  FILE *file_stream;
+  char magic[8];
+  int is_binary = 0;
+
+#ifdef __unix__
+  if ((file_stream = fopen(filename, "rb")) != NULL)
+#endif // __unix__
+#ifdef _WIN32
+  if (! fopen_s(&file_stream, filename, "rb"))
+#endif // _WIN32
+  {
+    is_binary = (fread(magic, 1, sizeof(magic), file_stream) == sizeof(magic)) && (memcmp(magic, WL_CAL_BIN_MAGIC, sizeof(magic)) == 0);
+    fclose(file_stream);
+  }
+
+  return is_binary ? wl_cal_map_table_binary(wl_cal_context, filename) : wl_cal_read_table_file(wl_cal_context, filename);
+}
+
+// ---------------------------------------------------------------------------
+// lookup without context checks and diagnostics, shared by single and batch conversion,
+// result is fractional step
+int wl_cal_wl2step_lookup(struct wl_cal_context_struc *wl_cal_context, double wavelength, double *step)
+{
+  int i;
+  int size = wl_cal_context->cal_data_size;
+
+  if (wl_cal_context->wl_order != WL_CAL_ORDER_NONMONOTONIC)
+  {
+    if ((size > 1) && (wl_cal_context->wl_index.x_wl[0] <= wavelength) && (wl_cal_context->wl_index.x_wl[size-1] >= wavelength))
+    {
+      i = HINT_LOAD(&wl_cal_context->cache.c_wl_segment);
+      if (! wl_cal_segment_fits(wl_cal_context->wl_index.x_wl, size, i, wavelength))
+      {
+        if (wl_cal_segment_fits(wl_cal_context->wl_index.x_wl, size, i + 1, wavelength))
+        {
+          i++;
+        } else
+        {
+          i = wl_cal_index_search(wl_cal_context->wl_index.x_wl, size, wavelength);
+        }
+        HINT_STORE(&wl_cal_context->cache.c_wl_segment, i);
+      }
+
+      *step = wl_cal_eval_wl_segment(wl_cal_context, i, wavelength);
+
+      return 0;
+    }
+  } else
+  {
+    for (i = 0; i < size - 1; i++)
+    {
+      if ((wl_cal_context->cal_data[i].wavelength <= wavelength) && (wl_cal_context->cal_data[i+1].wavelength >= wavelength))
+      {
+        *step = wl_cal_context->cal_data[i].step + (wl_cal_context->cal_data[i+1].step - wl_cal_context->cal_data[i].step) /
+          (wl_cal_context->cal_data[i+1].wavelength - wl_cal_context->cal_data[i].wavelength) *
+          (wavelength - wl_cal_context->cal_data[i].wavelength);
+
+        return 0;
+      }
+    }
+  }
+
+  return -3;
+}
+
+// ---------------------------------------------------------------------------
+int wl_cal_wl2step(struct wl_cal_context_struc *wl_cal_context, double wavelength, int *step)
+{
+  double exact;
+
+  if (wl_cal_context == NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_wl2step: No context\n");
+    return -1;
+  }
+
+  if (wl_cal_context->initialized != 1)
+  {
+    fprintf(stderr, "**Error**: wl_cal_wl2step: Calibration table is not initialized\n");
+    return -2;
+  }
+
+  if (wl_cal_wl2step_lookup(wl_cal_context, wavelength, &exact) < 0)
+  {
+    fprintf(stderr, "**Error**: wl_cal_wl2step: Specified wavelength is out of boundaries of calibration table\n");
+    return -3;
+  }
+
+  *step = wl_cal_round_step(exact);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+#define WL_CAL_BATCH_BLOCK (256)
+
+// converts n wavelengths in one pass; entries out of table boundaries are left untouched
+int wl_cal_wl2step_batch(struct wl_cal_context_struc *wl_cal_context, const double *wl, int *steps, size_t n)
+{
+  size_t i;
+  size_t j;
+  size_t block;
+  size_t failed = 0;
+  size_t first_failed = 0;
+  int size;
+  int sorted;
+  int segment;
+  int seg[WL_CAL_BATCH_BLOCK];
+  size_t pos[WL_CAL_BATCH_BLOCK];
+  int count;
+  const double *x_wl;
+  const int *x_step;
+  const double *x_slope;
+  const struct wl_cal_segment_struc *segments;
+  double exact;
+  double t;
+  double lo_wl;
+  double hi_wl;
+
+  if (wl_cal_context == NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_wl2step_batch: No context\n");
+    return -1;
+  }
+
+  if (wl_cal_context->initialized != 1)
+  {
+    fprintf(stderr, "**Error**: wl_cal_wl2step_batch: Calibration table is not initialized\n");
+    return -2;
+  }
+
+  size = wl_cal_context->cal_data_size;
+
+  if ((wl_cal_context->wl_order == WL_CAL_ORDER_NONMONOTONIC) || (size < 2))
+  {
+    for (i = 0; i < n; i++)
+    {
+      if (wl_cal_wl2step_lookup(wl_cal_context, wl[i], &exact) < 0)
+      {
+        if (! failed) first_failed = i;
+        failed ++;
+      } else
+      {
+        steps[i] = wl_cal_round_step(exact);
+      }
+    }
+  } else
+  {
+    x_wl = wl_cal_context->wl_index.x_wl;
+    x_step = wl_cal_context->wl_index.x_step;
+    x_slope = wl_cal_context->wl_index.x_slope;
+    segments = wl_cal_context->wl_segments;
+    lo_wl = x_wl[0];
+    hi_wl = x_wl[size - 1];
+
+    // ascending plans are walked merge style, anything else is searched point by point
+    sorted = 1;
+    for (i = 1; i < n; i++)
+    {
+      if (wl[i] < wl[i-1])
+      {
+        sorted = 0;
+        break;
+      }
+    }
+
+    segment = 0;
+    for (block = 0; block < n; block += WL_CAL_BATCH_BLOCK)
+    {
+      // pass 1: locate segments
+      count = 0;
+      for (i = block; (i < n) && (i < block + WL_CAL_BATCH_BLOCK); i++)
+      {
+        if ((wl[i] < lo_wl) || (wl[i] > hi_wl))
+        {
+          if (! failed) first_failed = i;
+          failed ++;
+          continue;
+        }
+
+        if (sorted)
+        {
+          while ((segment < size - 2) && (x_wl[segment + 1] < wl[i])) segment ++;
+        } else
+        {
+          segment = wl_cal_index_search(x_wl, size, wl[i]);
+        }
+
+        seg[count] = segment;
+        pos[count] = i;
+        count ++;
+      }
+
+      // pass 2: branch free interpolation over the structure of arrays
+      if (segments == NULL)
+      {
+        for (j = 0; j < (size_t)count; j++)
+        {
+          steps[pos[j]] = wl_cal_round_step(x_step[seg[j]] + x_slope[seg[j]] * (wl[pos[j]] - x_wl[seg[j]]));
+        }
+      } else
+      {
+        for (j = 0; j < (size_t)count; j++)
+        {
+          t = wl[pos[j]] - segments[seg[j]].x0;
+          steps[pos[j]] = wl_cal_round_step(segments[seg[j]].c0 +
+            t * (segments[seg[j]].c1 + t * (segments[seg[j]].c2 + t * segments[seg[j]].c3)));
+        }
+      }
+    }
+  }
+
+  if (failed)
+  {
+    fprintf(stderr, "**Error**: wl_cal_wl2step_batch: %lu wavelength(s) out of boundaries of calibration table, first at index %lu\n",
+      (unsigned long)failed, (unsigned long)first_failed);
+    return -3;
+  }
+
+  return 0;
+}
+
+
+// ---------------------------------------------------------------------------
+int wl_cal_step_segment_fits(const struct wl_cal_point_struc *points, int size, int k, int step)
+{
+  if ((k < 0) || (k > size - 2)) return 0;
+
+  return (step <= points[k+1].step) && ((step > points[k].step) || ((k == 0) && (step >= points[0].step)));
+}
+
+// ---------------------------------------------------------------------------
+// inverse lookup without context checks and diagnostics, continues from the cached
+// segment, so motor sweeps in either direction cost O(1) per sample
+int wl_cal_step2wl_lookup(struct wl_cal_context_struc *wl_cal_context, int step, double *wavelength)
+{
+  int i;
+  int size = wl_cal_context->cal_data_size;
+  struct wl_cal_point_struc *points = wl_cal_context->cal_data;
+
+  if ((size < 2) || (step < points[0].step) || (step > points[size-1].step)) return -3;
+
+  // dense table holds exactly what the code below would compute
+  if (wl_cal_context->lut.l_step_wl != NULL)
+  {
+    *wavelength = wl_cal_context->lut.l_step_wl[step - wl_cal_context->lut.l_step_min];
+    return 0;
+  }
+
+  i = HINT_LOAD(&wl_cal_context->cache.c_step_segment);
+  if (! wl_cal_step_segment_fits(points, size, i, step))
+  {
+    if (wl_cal_step_segment_fits(points, size, i + 1, step))
+    {
+      i++;
+    } else
+    if (wl_cal_step_segment_fits(points, size, i - 1, step))
+    {
+      i--;
+    } else
+    {
+      i = wl_cal_step_search(points, size, step);
+    }
+    HINT_STORE(&wl_cal_context->cache.c_step_segment, i);
+  }
+
+  *wavelength = wl_cal_eval_step_segment(wl_cal_context, i, step);
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+int wl_cal_step2wl(struct wl_cal_context_struc *wl_cal_context, int step, double *wavelength)
+{
+  if (wl_cal_context == NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_step2wl: No context\n");
+    return -1;
+  }
+
+  if (wl_cal_context->initialized != 1)
+  {
+    fprintf(stderr, "**Error**: wl_cal_step2wl: Calibration table is not initialized\n");
+    return -2;
+  }
+
+  if (wl_cal_step2wl_lookup(wl_cal_context, step, wavelength) < 0)
+  {
+    fprintf(stderr, "**Error**: wl_cal_step2wl: Specified step is out of boundaries of calibration table\n");
+    return -3;
+  }
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// converts n steps in one pass; entries out of table boundaries are left untouched
+int wl_cal_step2wl_batch(struct wl_cal_context_struc *wl_cal_context, const int *steps, double *wl, size_t n)
+{
+  size_t i;
+  size_t failed = 0;
+  size_t first_failed = 0;
+
+  if (wl_cal_context == NULL)
+  {
+    fprintf(stderr, "**Error**: wl_cal_step2wl_batch: No context\n");
+    return -1;
+  }
+
+  if (wl_cal_context->initialized != 1)
+  {
+    fprintf(stderr, "**Error**: wl_cal_step2wl_batch: Calibration table is not initialized\n");
+    return -2;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    if (wl_cal_step2wl_lookup(wl_cal_context, steps[i], &wl[i]) < 0)
+    {
+      if (! failed) first_failed = i;
+      failed ++;
+    }
+  }
+
+  if (failed)
+  {
+    fprintf(stderr, "**Error**: wl_cal_step2wl_batch: %lu step(s) out of boundaries of calibration table, first at index %lu\n",
+      (unsigned long)failed, (unsigned long)first_failed);
+    return -3;
+  }
+
+  return 0;
+}
+
+
+// ---------------------------------------------------------------------------
+// Dense table access for real time loops, one load and no branches; caller
+// guarantees tables are built and the argument is inside calibration range
+#define WL_CAL_LUT_STEP2WL(ctx, step) \
+  ((ctx)->lut.l_step_wl[(step) - (ctx)->lut.l_step_min])
+#define WL_CAL_LUT_WL2STEP(ctx, wl) \
+  ((ctx)->lut.l_wl_step[(int)(((wl) - (ctx)->lut.l_wl_min) * (ctx)->lut.l_wl_inv_quantum + 0.5)])
+
+// ---------------------------------------------------------------------------
+// checked quantized conversion, error is within half a wavelength quantum
+int wl_cal_lut_wl2step(struct wl_cal_context_struc *wl_cal_context, double wavelength, int *step)
+{
+  double position;
+
+  if ((wl_cal_context == NULL) || (wl_cal_context->lut.l_wl_step == NULL))
+  {
+    fprintf(stderr, "**Error**: wl_cal_lut_wl2step: No wavelength lookup table, see wl_cal_set_lut\n");
+    return -1;
+  }
+
+  position = (wavelength - wl_cal_context->lut.l_wl_min) * wl_cal_context->lut.l_wl_inv_quantum + 0.5;
+  if ((position < 0) || (position >= wl_cal_context->lut.l_wl_count))
+  {
+    fprintf(stderr, "**Error**: wl_cal_lut_wl2step: Specified wavelength is out of boundaries of calibration table\n");
+    return -3;
+  }
+
+  *step = wl_cal_context->lut.l_wl_step[(int)position];
+  return 0;
+}
+
+
+#ifdef __unix__
+// ---------------------------------------------------------------------------
+// Calibration registry, lets tables be replaced while other threads convert.
+// Readers pin the current context with wl_cal_registry_acquire/release, which are
+// lock free: a reader counts itself in the counter selected by epoch parity and
+// backs out if the epoch moved meanwhile. Publisher swaps the pointer, flips the
+// epoch and frees the old context once the previous parity counter drains, so
+// nobody ever waits on a lock and only the publishing thread waits for readers.
+struct wl_cal_registry_struc
+{
+  struct wl_cal_context_struc *r_current;
+  unsigned int r_epoch;
+  int r_readers[2];
+  pthread_mutex_t r_publish_lock; // publishers only
+
+  // applied to every table loaded through the registry
+  int r_interp_mode;
+  size_t r_lut_bytes;
+  int r_lut_threads;
+
+  // background reload
+  pthread_t r_loader;
+  int r_loader_started; // thread exists and has not been joined
+  int r_loader_busy;    // thread still running
+  int r_loader_result;
+  char r_loader_filename[4096];
+};
+
+// ---------------------------------------------------------------------------
+int wl_cal_registry_init(struct wl_cal_registry_struc *registry, int interp_mode, size_t lut_bytes, int lut_threads)
+{
+  memset(registry, 0, sizeof(struct wl_cal_registry_struc));
+
+  if (pthread_mutex_init(&registry->r_publish_lock, NULL) != 0)
+  {
+    fprintf(stderr, "**Error**: wl_cal_registry_init: Failed to create mutex\n");
+    return -1;
+  }
+
+  registry->r_interp_mode = interp_mode;
+  registry->r_lut_bytes = lut_bytes;
+  registry->r_lut_threads = lut_threads;
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// returns current context or NULL if nothing published yet, token goes to release
+struct wl_cal_context_struc *wl_cal_registry_acquire(struct wl_cal_registry_struc *registry, int *token)
+{
+  unsigned int epoch;
+
+  for (;;)
+  {
+    epoch = __atomic_load_n(&registry->r_epoch, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&registry->r_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&registry->r_epoch, __ATOMIC_SEQ_CST) == epoch) break;
+
+    // publisher flipped epoch in between, retry with the new one
+    __atomic_fetch_sub(&registry->r_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+  }
+
+  *token = epoch & 1;
+  return __atomic_load_n(&registry->r_current, __ATOMIC_SEQ_CST);
+}
+
+// ---------------------------------------------------------------------------
+void wl_cal_registry_release(struct wl_cal_registry_struc *registry, int token)
+{
+  __atomic_fetch_sub(&registry->r_readers[token], 1, __ATOMIC_RELEASE);
+}
+
+// ---------------------------------------------------------------------------
+// makes wl_cal_context current, registry takes ownership; waits for readers of
+// the previous context, so call it from loader thread rather than a sweep
+int wl_cal_registry_publish(struct wl_cal_registry_struc *registry, struct wl_cal_context_struc *wl_cal_context)
+{
+  struct wl_cal_context_struc *old_context;
+  unsigned int epoch;
+
+  pthread_mutex_lock(&registry->r_publish_lock);
+
+  old_context = __atomic_exchange_n(&registry->r_current, wl_cal_context, __ATOMIC_SEQ_CST);
+
+  epoch = __atomic_load_n(&registry->r_epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&registry->r_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+
+  // grace period, anyone who could have seen old_context counted in old parity
+  while (__atomic_load_n(&registry->r_readers[epoch & 1], __ATOMIC_ACQUIRE) != 0)
+  {
+    usleep(100);
+  }
+
+  pthread_mutex_unlock(&registry->r_publish_lock);
+
+  wl_cal_free_context(&old_context);
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// loads table with registry settings and publishes it, blocks caller
+int wl_cal_registry_load(struct wl_cal_registry_struc *registry, char *filename)
+{
+  int result;
+  struct wl_cal_context_struc *wl_cal_context;
+
+  result = wl_cal_allocate_context(&wl_cal_context);
+  if (result < 0) return result;
+
+  wl_cal_context->interp_mode = registry->r_interp_mode;
+  wl_cal_context->lut.l_max_bytes = registry->r_lut_bytes;
+  wl_cal_context->lut.l_threads = registry->r_lut_threads;
+
+  result = wl_cal_open_table_file(wl_cal_context, filename);
+  if (result < 0)
+  {
+    // keep serving the previous table
+    fprintf(stderr, "**Error**: wl_cal_registry_load: Failed to load \"%s\", current table kept\n", filename);
+    wl_cal_free_context(&wl_cal_context);
+    return result;
+  }
+
+  return wl_cal_registry_publish(registry, wl_cal_context);
+}
+
+// ---------------------------------------------------------------------------
+void *wl_cal_registry_loader(void *arg)
+{
+  struct wl_cal_registry_struc *registry = (struct wl_cal_registry_struc *)arg;
+
+  registry->r_loader_result = wl_cal_registry_load(registry, registry->r_loader_filename);
+  __atomic_store_n(&registry->r_loader_busy, 0, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// returns result of last background reload, waits for it if still running
+int wl_cal_registry_wait_reload(struct wl_cal_registry_struc *registry)
+{
+  if (registry->r_loader_started)
+  {
+    pthread_join(registry->r_loader, NULL);
+    registry->r_loader_started = 0;
+  }
+
+  return registry->r_loader_result;
+}
+
+// ---------------------------------------------------------------------------
+// starts loading filename in background thread, returns at once
+int wl_cal_registry_reload_async(struct wl_cal_registry_struc *registry, char *filename)
+{
+  if (__atomic_load_n(&registry->r_loader_busy, __ATOMIC_ACQUIRE))
+  {
+    fprintf(stderr, "**Error**: wl_cal_registry_reload_async: Previous reload is still running\n");
+    return -1;
+  }
+
+  // finished thread, collect it
+  wl_cal_registry_wait_reload(registry);
+
+  if (strlen(filename) >= sizeof(registry->r_loader_filename))
+  {
+    fprintf(stderr, "**Error**: wl_cal_registry_reload_async: File name is too long\n");
+    return -2;
+  }
+  strcpy(registry->r_loader_filename, filename);
+
+  registry->r_loader_result = 0;
+  __atomic_store_n(&registry->r_loader_busy, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&registry->r_loader, NULL, wl_cal_registry_loader, registry) != 0)
+  {
+    __atomic_store_n(&registry->r_loader_busy, 0, __ATOMIC_RELEASE);
+    fprintf(stderr, "**Error**: wl_cal_registry_reload_async: Failed to start loader thread\n");
+    return -3;
+  }
+  registry->r_loader_started = 1;
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// no readers may be active
+int wl_cal_registry_destroy(struct wl_cal_registry_struc *registry)
+{
+  wl_cal_registry_wait_reload(registry);
+
+  wl_cal_free_context(&registry->r_current);
+  pthread_mutex_destroy(&registry->r_publish_lock);
+
+  return 0;
+}
+#endif // __unix__
+
+
+// ---------------------------------------------------------------------------
+// monotonic time in microseconds, all serial deadlines are absolute values of it
+long long rs232_now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ---------------------------------------------------------------------------
+// Serial path instrumentation: write syscalls, byte to ack round trips and
+// first byte to completion of every move go into per port histograms, keyed by
+// descriptor. Histograms are log linear like HDR ones: 16 buckets per power of
+// two (about 6% resolution) from 1 us to days, updated with relaxed atomics so
+// any thread records without locks. Everything is skipped until
+// rs232_stats_enable(1), recording costs two clock reads otherwise.
+#define RS232_STATS_PORTS   (64)  // descriptors below this are tracked
+#define RS232_HIST_SUB_BITS (4)
+#define RS232_HIST_BUCKETS  (40 * (1 << RS232_HIST_SUB_BITS))
+
+#define RS232_STAT_WRITE (0) // write() of a byte or frame, us
+#define RS232_STAT_ACK   (1) // byte written to its ack, us
+#define RS232_STAT_MOVE  (2) // first byte of frame to completion byte, us
+#define RS232_STATS      (3)
+
+#define RS232_STATS_JSON (0)
+#define RS232_STATS_CSV  (1)
+
+struct rs232_histogram_struc
+{
+  unsigned long h_counts[RS232_HIST_BUCKETS];
+  unsigned long h_count;
+  unsigned long long h_sum;
+  unsigned long long h_min_plus_1; // 0 while empty
+  unsigned long long h_max;
+};
+
+struct rs232_stats_struc
+{
+  char st_name[64];
+  unsigned long st_bytes_written;
+  struct rs232_histogram_struc st_hist[RS232_STATS];
+};
+
+int rs232_stats_enabled = 0;
+struct rs232_stats_struc rs232_stats[RS232_STATS_PORTS];
+
+// ---------------------------------------------------------------------------
+// switches recording on or off for all ports, figures gathered so far are kept
+void rs232_stats_enable(int enabled)
+{
+  HINT_STORE(&rs232_stats_enabled, enabled ? 1 : 0);
+}
+
+// ---------------------------------------------------------------------------
+int rs232_histogram_bucket(unsigned long long value)
+{
+  int magnitude;
+  int index;
+
+  if (value < (2 << RS232_HIST_SUB_BITS)) return (int)value;
+
+  magnitude = 63 - __builtin_clzll(value);
+  index = (magnitude - RS232_HIST_SUB_BITS) * (1 << RS232_HIST_SUB_BITS) + (int)(value >> (magnitude - RS232_HIST_SUB_BITS));
+
+  return (index < RS232_HIST_BUCKETS) ? index : RS232_HIST_BUCKETS - 1;
+}
+
+// ---------------------------------------------------------------------------
+// middle of the values bucket holds
+double rs232_histogram_value(int index)
+{
+  int magnitude;
+  unsigned long long low;
+
+  if (index < (2 << RS232_HIST_SUB_BITS)) return index;
+
+  magnitude = index / (1 << RS232_HIST_SUB_BITS) + RS232_HIST_SUB_BITS - 1;
+  low = (unsigned long long)(index % (1 << RS232_HIST_SUB_BITS) + (1 << RS232_HIST_SUB_BITS)) << (magnitude - RS232_HIST_SUB_BITS);
+
+  return low + ((1ULL << (magnitude - RS232_HIST_SUB_BITS)) - 1) / 2.0;
+}
+
+// ---------------------------------------------------------------------------
+void rs232_histogram_record(struct rs232_histogram_struc *hist, long long value)
+{
+  unsigned long long v = (value < 0) ? 0 : (unsigned long long)value;
+  unsigned long long seen;
+
+  __atomic_fetch_add(&hist->h_counts[rs232_histogram_bucket(v)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->h_count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->h_sum, v, __ATOMIC_RELAXED);
+
+  seen = __atomic_load_n(&hist->h_min_plus_1, __ATOMIC_RELAXED);
+  while (((seen == 0) || (v + 1 < seen)) &&
+    (! __atomic_compare_exchange_n(&hist->h_min_plus_1, &seen, v + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {}
+
+  seen = __atomic_load_n(&hist->h_max, __ATOMIC_RELAXED);
+  while ((v > seen) && (! __atomic_compare_exchange_n(&hist->h_max, &seen, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {}
+}
+
+// ---------------------------------------------------------------------------
+// value below which given fraction of samples lie, bucket resolution
+double rs232_histogram_percentile(const struct rs232_histogram_struc *hist, double fraction)
+{
+  unsigned long count = __atomic_load_n(&hist->h_count, __ATOMIC_RELAXED);
+  unsigned long rank;
+  unsigned long seen = 0;
+  double value;
+  int i;
+
+  if (count == 0) return 0;
+
+  rank = (unsigned long)(fraction * count + 0.5);
+  if (rank < 1) rank = 1;
+
+  for (i = 0; i < RS232_HIST_BUCKETS; i++)
+  {
+    seen += __atomic_load_n(&hist->h_counts[i], __ATOMIC_RELAXED);
+    if (seen < rank) continue;
+
+    // bucket middle can lie outside what was really seen
+    value = rs232_histogram_value(i);
+    if (value > hist->h_max) value = (double)hist->h_max;
+    if (value < hist->h_min_plus_1 - 1) value = (double)(hist->h_min_plus_1 - 1);
+    return value;
+  }
+
+  return (double)hist->h_max;
+}
+
+// ---------------------------------------------------------------------------
+void rs232_stats_record(int fd, int stat, long long value_us)
+{
+  if ((fd < 0) || (fd >= RS232_STATS_PORTS)) return;
+
+  rs232_histogram_record(&rs232_stats[fd].st_hist[stat], value_us);
+}
+
+// ---------------------------------------------------------------------------
+// starts a fresh set for a newly opened port
+void rs232_stats_reset(int fd, const char *name)
+{
+  if ((fd < 0) || (fd >= RS232_STATS_PORTS)) return;
+
+  memset(&rs232_stats[fd], 0, sizeof(struct rs232_stats_struc));
+  SNPRINTF(rs232_stats[fd].st_name, sizeof(rs232_stats[fd].st_name), "%s", name);
+}
+
+// ---------------------------------------------------------------------------
+// port name as quoted string; device paths may hold any byte
+void rs232_stats_print_name(FILE *file, const char *name, int format)
+{
+  const unsigned char *c;
+
+  fputc('"', file);
+  for (c = (const unsigned char *)name; *c; c++)
+  {
+    if (format == RS232_STATS_CSV)
+    {
+      if (*c == '"') fputc('"', file);
+      fputc(*c, file);
+    } else
+    if ((*c == '"') || (*c == '\\'))
+      fprintf(file, "\\%c", *c);
+    else
+    if (*c < 0x20)
+      fprintf(file, "\\u%04x", *c);
+    else
+      fputc(*c, file);
+  }
+  fputc('"', file);
+}
+
+// ---------------------------------------------------------------------------
+// one entry per port and metric that has samples; returns 0 or negative error
+int rs232_stats_dump(FILE *file, int format)
+{
+  const char *metric_names[RS232_STATS] = {"write", "ack", "move"};
+  struct rs232_histogram_struc *hist;
+  unsigned long count;
+  int first_port = 1;
+  int first_metric;
+  int fd;
+  int stat;
+
+  if (format == RS232_STATS_CSV)
+    fprintf(file, "port,fd,metric,count,mean_us,min_us,p50_us,p90_us,p99_us,p999_us,max_us\n");
+  else
+    fprintf(file, "{\"ports\": [");
+
+  for (fd = 0; fd < RS232_STATS_PORTS; fd++)
+  {
+    first_metric = 1;
+    for (stat = 0; stat < RS232_STATS; stat++)
+    {
+      hist = &rs232_stats[fd].st_hist[stat];
+      count = __atomic_load_n(&hist->h_count, __ATOMIC_RELAXED);
+      if (count == 0) continue;
+
+      if (format == RS232_STATS_CSV)
+      {
+        rs232_stats_print_name(file, rs232_stats[fd].st_name, format);
+        fprintf(file, ",%d,%s,%lu,%.1f,%llu,%.1f,%.1f,%.1f,%.1f,%llu\n",
+          fd, metric_names[stat], count, (double)hist->h_sum / count, hist->h_min_plus_1 - 1,
+          rs232_histogram_percentile(hist, 0.5), rs232_histogram_percentile(hist, 0.9),
+          rs232_histogram_percentile(hist, 0.99), rs232_histogram_percentile(hist, 0.999), hist->h_max);
+        continue;
+      }
+
+      if (first_metric)
+      {
+        fprintf(file, "%s\n  {\"port\": ", first_port ? "" : ",");
+        rs232_stats_print_name(file, rs232_stats[fd].st_name, format);
+        fprintf(file, ", \"fd\": %d, \"bytes_written\": %lu, \"metrics\": {", fd, rs232_stats[fd].st_bytes_written);
+        first_port = 0;
+      }
+      fprintf(file, "%s\n    \"%s\": {\"count\": %lu, \"mean_us\": %.1f, \"min_us\": %llu, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+        "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %llu}", first_metric ? "" : ",",
+        metric_names[stat], count, (double)hist->h_sum / count, hist->h_min_plus_1 - 1,
+        rs232_histogram_percentile(hist, 0.5), rs232_histogram_percentile(hist, 0.9),
+        rs232_histogram_percentile(hist, 0.99), rs232_histogram_percentile(hist, 0.999), hist->h_max);
+      first_metric = 0;
+    }
+
+    if ((format != RS232_STATS_CSV) && (! first_metric)) fprintf(file, "}}");
+  }
+
+  if (format != RS232_STATS_CSV) fprintf(file, "\n]}\n");
+  fflush(file);
+
+  return ferror(file) ? -1 : 0;
+}
+
+#ifdef __unix__
+// ---------------------------------------------------------------------------
+// Dump on signal: handler only writes to a pipe, a helper thread does the
+// file work outside signal context
+struct rs232_stats_dumper_struc
+{
+  int sd_pipe[2];
+  int sd_format;
+  char sd_path[256];
+  pthread_t sd_thread;
+};
+
+struct rs232_stats_dumper_struc rs232_stats_dumper = { .sd_pipe = {-1, -1} };
+
+// ---------------------------------------------------------------------------
+void rs232_stats_signal_handler(int signal_number)
+{
+  unsigned char byte = (unsigned char)signal_number;
+  int saved_errno = errno;
+
+  if (write(rs232_stats_dumper.sd_pipe[1], &byte, 1) < 0) {}
+  errno = saved_errno;
+}
+
+// ---------------------------------------------------------------------------
+void *rs232_stats_dumper_thread(void *arg)
+{
+  unsigned char byte;
+  FILE *file;
+
+  (void)arg;
+  while (read(rs232_stats_dumper.sd_pipe[0], &byte, 1) == 1)
+  {
+    file = fopen(rs232_stats_dumper.sd_path, "w");
+    if (file == NULL)
+    {
+      fprintf(stderr, "**Error**: rs232_stats_dumper_thread: Cannot open %s\n", rs232_stats_dumper.sd_path);
+      continue;
+    }
+    rs232_stats_dump(file, rs232_stats_dumper.sd_format);
+    fclose(file);
+  }
+
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// undoes pipe of a failed install, a later call may try again
+void rs232_stats_close_pipe(void)
+{
+  close(rs232_stats_dumper.sd_pipe[0]);
+  close(rs232_stats_dumper.sd_pipe[1]);
+  rs232_stats_dumper.sd_pipe[0] = -1;
+  rs232_stats_dumper.sd_pipe[1] = -1;
+}
+
+// ---------------------------------------------------------------------------
+// enables statistics and rewrites path with current figures on every signal
+int rs232_stats_dump_on_signal(int signal_number, const char *path, int format)
+{
+  struct sigaction action;
+  struct sigaction previous;
+
+  if (rs232_stats_dumper.sd_pipe[0] >= 0)
+  {
+    fprintf(stderr, "**Error**: rs232_stats_dump_on_signal: Already installed\n");
+    return -1;
+  }
+
+  if (pipe(rs232_stats_dumper.sd_pipe) < 0)
+  {
+    fprintf(stderr, "**Error**: rs232_stats_dump_on_signal: pipe failed with error %d, \"%s\"\n", errno, strerror(errno));
+    return -2;
+  }
+  fcntl(rs232_stats_dumper.sd_pipe[1], F_SETFL, O_NONBLOCK); // handler must never block
+
+  rs232_stats_dumper.sd_format = format;
+  SNPRINTF(rs232_stats_dumper.sd_path, sizeof(rs232_stats_dumper.sd_path), "%s", path);
+
+  // signals arriving before the thread runs just wait in the pipe
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = rs232_stats_signal_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(signal_number, &action, &previous) < 0)
+  {
+    fprintf(stderr, "**Error**: rs232_stats_dump_on_signal: sigaction failed with error %d, \"%s\"\n", errno, strerror(errno));
+    rs232_stats_close_pipe();
+    return -3;
+  }
+
+  if (pthread_create(&rs232_stats_dumper.sd_thread, NULL, rs232_stats_dumper_thread, NULL) != 0)
+  {
+    fprintf(stderr, "**Error**: rs232_stats_dump_on_signal: Could not start dumper thread\n");
+    sigaction(signal_number, &previous, NULL);
+    rs232_stats_close_pipe();
+    return -4;
+  }
+  pthread_detach(rs232_stats_dumper.sd_thread);
+
+  rs232_stats_enable(1);
+  return 0;
+}
+#endif // __unix__
+
+// ---------------------------------------------------------------------------
+// Wire trace: raw bytes written and read are copied with a timestamp into a
+// ring of fixed records, no formatting and no locks on the motion path, so it
+// may stay on in production. Recording is off (one relaxed load per call)
+// until rs232_trace_start or rs232_trace_enabled set by hand; ring overwrites
+// oldest records when nobody drains it. rs232_trace_decode (or the thread of rs232_trace_start) turns records
+// into print_dump layout; how much it prints is rs232_trace_verbosity, which
+// may be changed at any time.
+#define RS232_TRACE_SIZE (4096) // records, power of two
+#define RS232_TRACE_DATA (40)   // bytes per record, longer chunks take several
+
+#define RS232_TRACE_TX (0)
+#define RS232_TRACE_RX (1)
+
+#define RS232_TRACE_QUIET   (0) // records are consumed, nothing printed
+#define RS232_TRACE_SUMMARY (1) // one line per record
+#define RS232_TRACE_DUMP    (2) // plus hex and ascii of the bytes
+
+// one cache line, so concurrent writers do not share lines
+struct rs232_trace_record_struc
+{
+  unsigned long tr_seq;     // index + 1 once written, 0 while being written
+  long long tr_time_us;     // rs232_now_us
+  int tr_fd;
+  unsigned char tr_dir;     // RS232_TRACE_TX or _RX
+  unsigned char tr_length;
+  unsigned char tr_data[RS232_TRACE_DATA];
+} __attribute__((aligned(64)));
+
+struct rs232_trace_struc
+{
+  struct rs232_trace_record_struc tc_records[RS232_TRACE_SIZE];
+  unsigned long tc_head;  // next index to write, shared by writers
+  unsigned long tc_tail;  // next index to decode, decoder only
+  unsigned long tc_lost;  // overwritten before decoded
+};
+
+int rs232_trace_enabled = 0;
+int rs232_trace_verbosity = RS232_TRACE_SUMMARY;
+struct rs232_trace_struc rs232_trace_ring;
+
+// ---------------------------------------------------------------------------
+void rs232_trace(int fd, int dir, const void *data, int length)
+{
+  struct rs232_trace_record_struc *record;
+  unsigned long index;
+  int chunk;
+
+  if (! HINT_LOAD(&rs232_trace_enabled)) return;
+
+  while (length > 0)
+  {
+    chunk = (length > RS232_TRACE_DATA) ? RS232_TRACE_DATA : length;
+
+    index = __atomic_fetch_add(&rs232_trace_ring.tc_head, 1, __ATOMIC_RELAXED);
+    record = &rs232_trace_ring.tc_records[index & (RS232_TRACE_SIZE - 1)];
+
+    __atomic_store_n(&record->tr_seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->tr_time_us = rs232_now_us();
+    record->tr_fd = fd;
+    record->tr_dir = (unsigned char)dir;
+    record->tr_length = (unsigned char)chunk;
+    memcpy(record->tr_data, data, chunk);
+    __atomic_store_n(&record->tr_seq, index + 1, __ATOMIC_RELEASE);
+
+    data = (const char *)data + chunk;
+    length -= chunk;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// prints records written since last call at given verbosity, returns their
+// number; single decoder at a time
+int rs232_trace_decode(FILE *file, int verbosity)
+{
+  struct rs232_trace_record_struc *slot;
+  struct rs232_trace_record_struc record;
+  unsigned long head = __atomic_load_n(&rs232_trace_ring.tc_head, __ATOMIC_ACQUIRE);
+  unsigned long seq;
+  int decoded = 0;
+
+  // fell behind by more than a ring, skip to what is still there
+  if (head - rs232_trace_ring.tc_tail > RS232_TRACE_SIZE)
+  {
+    rs232_trace_ring.tc_lost += head - rs232_trace_ring.tc_tail - RS232_TRACE_SIZE;
+    if (verbosity > RS232_TRACE_QUIET)
+      fprintf(file, "--- %lu records lost\n", head - rs232_trace_ring.tc_tail - RS232_TRACE_SIZE);
+    rs232_trace_ring.tc_tail = head - RS232_TRACE_SIZE;
+  }
+
+  while (rs232_trace_ring.tc_tail != head)
+  {
+    slot = &rs232_trace_ring.tc_records[rs232_trace_ring.tc_tail & (RS232_TRACE_SIZE - 1)];
+
+    // copy and check it was not rewritten meanwhile
+    seq = __atomic_load_n(&slot->tr_seq, __ATOMIC_ACQUIRE);
+    // writer claimed the slot but has not started (previous lap still there)
+    // or not finished it, take it next time
+    if ((seq == 0) || (seq < rs232_trace_ring.tc_tail + 1)) break;
+    memcpy(&record, slot, sizeof(record));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((seq > rs232_trace_ring.tc_tail + 1) || (__atomic_load_n(&slot->tr_seq, __ATOMIC_RELAXED) != seq))
+    {
+      rs232_trace_ring.tc_lost ++;
+      if (verbosity > RS232_TRACE_QUIET) fprintf(file, "--- record overwritten\n");
+      rs232_trace_ring.tc_tail ++;
+      continue;
+    }
+    rs232_trace_ring.tc_tail ++;
+    decoded ++;
+
+    if (verbosity == RS232_TRACE_QUIET) continue;
+
+    fprintf(file, "%lld.%06lld fd %d %s %d byte%s\n", record.tr_time_us / 1000000, record.tr_time_us % 1000000,
+      record.tr_fd, (record.tr_dir == RS232_TRACE_TX) ? "TX" : "RX", record.tr_length, (record.tr_length == 1) ? "" : "s");
+    if (verbosity >= RS232_TRACE_DUMP) fprint_dump(file, (char *)record.tr_data, record.tr_length);
+  }
+
+  fflush(file);
+  return decoded;
+}
+
+#ifdef __unix__
+// ---------------------------------------------------------------------------
+// Decoder thread: drains ring every few milliseconds, writers never wait for it
+struct rs232_trace_decoder_struc
+{
+  FILE *td_file;
+  int td_stop;
+  pthread_t td_thread;
+};
+
+struct rs232_trace_decoder_struc rs232_trace_decoder;
+
+// ---------------------------------------------------------------------------
+void *rs232_trace_thread(void *arg)
+{
+  (void)arg;
+  while (! HINT_LOAD(&rs232_trace_decoder.td_stop))
+  {
+    if (rs232_trace_decode(rs232_trace_decoder.td_file, HINT_LOAD(&rs232_trace_verbosity)) == 0) usleep(10000);
+  }
+  rs232_trace_decode(rs232_trace_decoder.td_file, HINT_LOAD(&rs232_trace_verbosity));
+
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// switches recording on and prints records as they come
+int rs232_trace_start(FILE *file, int verbosity)
+{
+  HINT_STORE(&rs232_trace_verbosity, verbosity);
+  rs232_trace_decoder.td_file = file;
+  rs232_trace_decoder.td_stop = 0;
+
+  if (pthread_create(&rs232_trace_decoder.td_thread, NULL, rs232_trace_thread, NULL) != 0)
+  {
+    fprintf(stderr, "**Error**: rs232_trace_start: Could not start decoder thread\n");
+    return -1;
+  }
+
+  HINT_STORE(&rs232_trace_enabled, 1);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// switches recording off, prints what is left and stops decoder thread
+void rs232_trace_stop(void)
+{
+  HINT_STORE(&rs232_trace_enabled, 0);
+  HINT_STORE(&rs232_trace_decoder.td_stop, 1);
+  pthread_join(rs232_trace_decoder.td_thread, NULL);
+}
+#endif // __unix__
+
+// ---------------------------------------------------------------------------
+// sleeps in poll until fd has data or deadline passes, returns 1 if readable,
+// 0 on timeout, negative on error
+int rs232_wait_readable(int fd, long long deadline_us)
+{
+  struct pollfd pfd;
+  long long remaining_us;
+  int result;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  for (;;)
+  {
+    remaining_us = deadline_us - rs232_now_us();
+    if (remaining_us < 0) remaining_us = 0;
+
+    pfd.revents = 0;
+    // round up, otherwise sub-millisecond remainders turn into busy polling
+    result = poll(&pfd, 1, (int)((remaining_us + 999) / 1000));
+    if (result < 0)
+    {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "**Error**: rs232_wait_readable: poll failed with error %d, \"%s\"\n", errno, strerror(errno));
+      return -1;
+    }
+
+    if (result > 0)
+    {
+      if (pfd.revents & (POLLERR | POLLNVAL))
+      {
+        fprintf(stderr, "**Error**: rs232_wait_readable: Device reported error condition\n");
+        return -2;
+      }
+      return 1;
+    }
+
+    if (remaining_us == 0) return 0;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Buffered input: a ring per port gets everything the device has in one read()
+// and lines or frames are cut out of it, so a text reply costs a couple of
+// syscalls instead of one per byte. Bytes past the returned line stay buffered
+// for the next call; rs232_read_deadline hands them out before reading the
+// device, so frame protocol and queue see them too.
+#define RS232_READER_SIZE       (1024) // power of two
+#define RS232_READER_PORTS      (64)   // descriptors below this have a reader for rs232_read_buffer
+#define RS232_READ_TIMEOUT_US   (100000)
+
+struct rs232_reader_struc
+{
+  unsigned char rd_data[RS232_READER_SIZE];
+  unsigned int rd_head;
+  unsigned int rd_count;
+  long rd_reads;     // read() calls made
+  long rd_truncated; // lines longer than caller buffer
+};
+
+struct rs232_reader_struc rs232_readers[RS232_READER_PORTS];
+
+// ---------------------------------------------------------------------------
+void rs232_reader_reset(struct rs232_reader_struc *reader)
+{
+  memset(reader, 0, sizeof(struct rs232_reader_struc));
+}
+
+// ---------------------------------------------------------------------------
+// waits for input until deadline and appends what is there; returns number of
+// bytes added (0 on timeout or full ring) or negative error
+int rs232_reader_fill(struct rs232_reader_struc *reader, int fd, long long deadline_us)
+{
+  unsigned int tail;
+  unsigned int run;
+  int result;
+
+  if (reader->rd_count == RS232_READER_SIZE) return 0;
+
+  result = rs232_wait_readable(fd, deadline_us);
+  if (result <= 0) return result;
+
+  // only contiguous free space, wrapped part is picked up by next call
+  tail = (reader->rd_head + reader->rd_count) & (RS232_READER_SIZE - 1);
+  run = RS232_READER_SIZE - reader->rd_count;
+  if (run > RS232_READER_SIZE - tail) run = RS232_READER_SIZE - tail;
+
+  reader->rd_reads ++;
+  result = read(fd, &reader->rd_data[tail], run);
+  if (result > 0) rs232_trace(fd, RS232_TRACE_RX, &reader->rd_data[tail], result);
+  if (result < 0)
+  {
+    if ((errno == EINTR) || (errno == EAGAIN)) return 0;
+    fprintf(stderr, "**Error**: rs232_reader_fill: read from device failed with error %d, \"%s\"\n", errno, strerror(errno));
+    return -3;
+  }
+
+  // readable but nothing read means hangup of pty or usb adapter
+  if (result == 0) usleep(1000);
+
+  reader->rd_count += result;
+  return result;
+}
+
+// ---------------------------------------------------------------------------
+// offset of first byte c from head, or -1
+int rs232_reader_find(const struct rs232_reader_struc *reader, int c)
+{
+  unsigned int first = RS232_READER_SIZE - reader->rd_head;
+  const unsigned char *found;
+
+  if (first > reader->rd_count) first = reader->rd_count;
+
+  found = memchr(&reader->rd_data[reader->rd_head], c, first);
+  if (found != NULL) return (int)(found - &reader->rd_data[reader->rd_head]);
+
+  found = memchr(reader->rd_data, c, reader->rd_count - first);
+  if (found != NULL) return (int)(first + (found - reader->rd_data));
+
+  return -1;
+}
+
+// ---------------------------------------------------------------------------
+// moves length buffered bytes to buffer
+void rs232_reader_take(struct rs232_reader_struc *reader, void *buffer, unsigned int length)
+{
+  unsigned int first = RS232_READER_SIZE - reader->rd_head;
+
+  if (first > length) first = length;
+
+  memcpy(buffer, &reader->rd_data[reader->rd_head], first);
+  memcpy((char *)buffer + first, reader->rd_data, length - first);
+
+  reader->rd_head = (reader->rd_head + length) & (RS232_READER_SIZE - 1);
+  reader->rd_count -= length;
+}
+
+// ---------------------------------------------------------------------------
+void rs232_reader_drop(struct rs232_reader_struc *reader)
+{
+  reader->rd_head = (reader->rd_head + 1) & (RS232_READER_SIZE - 1);
+  reader->rd_count --;
+}
+
+// ---------------------------------------------------------------------------
+// next line ended by CR, LF or both into zero terminated buffer; empty lines
+// are skipped, longer lines come in max_buf_length - 1 pieces. Returns line
+// length, -4 if no full line came before deadline (partial one stays
+// buffered) or other negative error
+int rs232_reader_line(struct rs232_reader_struc *reader, int fd, char *buffer, int max_buf_length, long long deadline_us)
+{
+  int length;
+  int cr;
+  int result;
+
+  if (max_buf_length < 2)
+  {
+    fprintf(stderr, "**Error**: rs232_reader_line: Buffer too small\n");
+    return -5;
+  }
+
+  for (;;)
+  {
+    // leftovers of CR LF pairs and empty lines
+    while ((reader->rd_count > 0) &&
+      ((reader->rd_data[reader->rd_head] == '\r') || (reader->rd_data[reader->rd_head] == '\n')))
+      rs232_reader_drop(reader);
+
+    length = rs232_reader_find(reader, '\n');
+    cr = rs232_reader_find(reader, '\r');
+    if ((cr >= 0) && ((length < 0) || (cr < length))) length = cr;
+
+    if ((length >= 0) && (length <= max_buf_length - 1))
+    {
+      rs232_reader_take(reader, buffer, length);
+      buffer[length] = 0;
+
+      // terminator too, frame reads get what follows it
+      rs232_reader_drop(reader);
+      if ((cr == length) && (reader->rd_count > 0) && (reader->rd_data[reader->rd_head] == '\n')) rs232_reader_drop(reader);
+      return length;
+    }
+
+    // no room for the rest of it, give out what fits
+    if ((length >= 0) || (reader->rd_count >= (unsigned int)max_buf_length - 1) || (reader->rd_count == RS232_READER_SIZE))
+    {
+      length = (reader->rd_count < (unsigned int)max_buf_length - 1) ? (int)reader->rd_count : max_buf_length - 1;
+      reader->rd_truncated ++;
+      rs232_reader_take(reader, buffer, length);
+      buffer[length] = 0;
+      return length;
+    }
+
+    result = rs232_reader_fill(reader, fd, deadline_us);
+    if (result < 0) return result;
+    if ((result == 0) && (rs232_now_us() >= deadline_us)) break;
+  }
+
+  buffer[0] = 0;
+  return -4;
+}
+
+// ---------------------------------------------------------------------------
+// length bytes, e.g. a binary frame, with the same buffering; returns number
+// of bytes read (short on timeout) or negative error
+int rs232_reader_read(struct rs232_reader_struc *reader, int fd, void *buffer, int length, long long deadline_us)
+{
+  int result;
+
+  while (reader->rd_count < (unsigned int)length)
+  {
+    result = rs232_reader_fill(reader, fd, deadline_us);
+    if (result < 0) return result;
+    if ((result == 0) && ((reader->rd_count == RS232_READER_SIZE) || (rs232_now_us() >= deadline_us))) break;
+  }
+
+  if ((unsigned int)length > reader->rd_count) length = reader->rd_count;
+  rs232_reader_take(reader, buffer, length);
+
+  return length;
+}
+
+// ---------------------------------------------------------------------------
+// bytes a line read left buffered for fd
+unsigned int rs232_reader_pending(int fd)
+{
+  if ((fd < 0) || (fd >= RS232_READER_PORTS)) return 0;
+
+  return rs232_readers[fd].rd_count;
+}
+
+// ---------------------------------------------------------------------------
+// reads up to length bytes, returns as soon as length bytes arrived or deadline
+// passed; result is number of bytes read (may be short on timeout) or negative error
+int rs232_read_deadline(int fd, void *buffer, int length, long long deadline_us)
+{
+  int received = 0;
+  int result;
+
+  // bytes read ahead by a line read come first
+  if ((length > 0) && (rs232_reader_pending(fd) > 0))
+  {
+    received = (rs232_readers[fd].rd_count < (unsigned int)length) ? (int)rs232_readers[fd].rd_count : length;
+    rs232_reader_take(&rs232_readers[fd], buffer, received);
+  }
+
+  while (received < length)
+  {
+    result = rs232_wait_readable(fd, deadline_us);
+    if (result < 0) return result;
+    if (result == 0) break;
+
+    result = read(fd, (char *)buffer + received, length - received);
+    if (result > 0) rs232_trace(fd, RS232_TRACE_RX, (char *)buffer + received, result);
+    if (result < 0)
+    {
+      if ((errno == EINTR) || (errno == EAGAIN)) continue;
+      fprintf(stderr, "**Error**: rs232_read_deadline: read from device failed with error %d, \"%s\"\n", errno, strerror(errno));
+      return -3;
+    }
+
+    // readable but nothing read means hangup of pty or usb adapter
+    if (result == 0)
+    {
+      if (rs232_now_us() >= deadline_us) break;
+      usleep(1000);
+      continue;
+    }
+
+    received += result;
+  }
+
+  return received;
+}
+
+// ---------------------------------------------------------------------------
+// writes whole buffer, retrying partial writes; returns length or negative error
+int rs232_write_all(int fd, const void *buffer, int length)
+{
+  long long start_us = HINT_LOAD(&rs232_stats_enabled) ? rs232_now_us() : 0;
+  int sent = 0;
+  int result;
+
+  while (sent < length)
+  {
+    result = write(fd, (const char *)buffer + sent, length - sent);
+    if (result < 0)
+    {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN)
+      {
+        struct pollfd pfd;
+
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        poll(&pfd, 1, 10);
+        continue;
+      }
+      fprintf(stderr, "**Error**: rs232_write_all: write to device failed with error %d, \"%s\"\n", errno, strerror(errno));
+      return -1;
+    }
+
+    sent += result;
+  }
+  rs232_trace(fd, RS232_TRACE_TX, buffer, sent);
+
+  if (start_us && (fd >= 0) && (fd < RS232_STATS_PORTS))
+  {
+    rs232_stats_record(fd, RS232_STAT_WRITE, rs232_now_us() - start_us);
+    __atomic_fetch_add(&rs232_stats[fd].st_bytes_written, sent, __ATOMIC_RELAXED);
+  }
+
+  return sent;
+}
+
+// ---------------------------------------------------------------------------
+int rs232_write_string(int fd, char *string)
+{
+  return rs232_write_all(fd, string, strlen(string));
+}
+
+// ---------------------------------------------------------------------------
+// line reply of a device opened by rs232_open, see rs232_reader_line;
+// waits at most RS232_READ_TIMEOUT_US
+int rs232_read_buffer(int fd, char *buffer, int max_buf_length)
+{
+  if ((fd < 0) || (fd >= RS232_READER_PORTS))
+  {
+    fprintf(stderr, "**Error**: rs232_read_buffer: Descriptor %d out of range\n", fd);
+    return -6;
+  }
+
+  return rs232_reader_line(&rs232_readers[fd], fd, buffer, max_buf_length, rs232_now_us() + RS232_READ_TIMEOUT_US);
+}
+
+
+// ---------------------------------------------------------------------------
+// PLM002 line: 19200 8O1, no flow control, reads never block
+void rs232_config_default(struct rs232_config_struc *config)
+{
+  config->baud = 19200;
+  config->parity = RS232_PARITY_ODD;
+  config->stop_bits = 1;
+  config->flow = RS232_FLOW_NONE;
+  config->low_latency = 0;
+  config->vmin = 0;
+  config->vtime = 0;
+}
+
+// ---------------------------------------------------------------------------
+// termios speed constant of baud rate, 0 if there is none
+speed_t rs232_speed(int baud)
+{
+  switch (baud)
+  {
+    case 1200:    return B1200;
+    case 2400:    return B2400;
+    case 4800:    return B4800;
+    case 9600:    return B9600;
+    case 19200:   return B19200;
+    case 38400:   return B38400;
+    case 57600:   return B57600;
+    case 115200:  return B115200;
+    case 230400:  return B230400;
+#ifdef B460800
+    case 460800:  return B460800;
+#endif
+#ifdef B921600
+    case 921600:  return B921600;
+#endif
+#ifdef B1000000
+    case 1000000: return B1000000;
+#endif
+#ifdef B2000000
+    case 2000000: return B2000000;
+#endif
+#ifdef B3000000
+    case 3000000: return B3000000;
+#endif
+#ifdef B4000000
+    case 4000000: return B4000000;
+#endif
+  }
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// returns 1 if driver took low latency mode; ports that cannot (pty, most USB
+// adapters without the flag) are fine as they are
+int rs232_set_low_latency(int fd, int enable)
+{
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+  struct serial_struct serial;
+
+  if (ioctl(fd, TIOCGSERIAL, &serial) < 0) return 0;
+
+  if (enable)
+    serial.flags |= ASYNC_LOW_LATENCY;
+  else
+    serial.flags &= ~ASYNC_LOW_LATENCY;
+
+  if (ioctl(fd, TIOCSSERIAL, &serial) < 0) return 0;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// config NULL means rs232_config_default
+int rs232_open_config(struct rs232_port_struc *port, char *dev_file, const struct rs232_config_struc *config)
+{
+  speed_t speed;
+  int result;
+
+  memset(port, 0, sizeof(struct rs232_port_struc));
+  SNPRINTF(port->pt_name, sizeof(port->pt_name), "%s", dev_file);
+  if (config != NULL)
+    port->pt_config = *config;
+  else
+    rs232_config_default(&port->pt_config);
+
+  speed = rs232_speed(port->pt_config.baud);
+  if ((speed == 0) || (port->pt_config.stop_bits < 1) || (port->pt_config.stop_bits > 2) ||
+    (port->pt_config.vmin < 0) || (port->pt_config.vmin > 255) || (port->pt_config.vtime < 0) || (port->pt_config.vtime > 255))
+  {
+    fprintf(stderr, "**Error**: rs232_open: Unsupported line settings for %s (%d baud, %d stop bits)\n",
+      dev_file, port->pt_config.baud, port->pt_config.stop_bits);
+    port->pt_fd = -1;
+    return -7;
+  }
+
+  port->pt_fd = open(dev_file, O_RDWR | O_NOCTTY );
+  if(port->pt_fd < 0)
+  {
+    fprintf(stderr, "**Error**: rs232_open: Failed to open device %s, exiting\n", dev_file);
+    port->pt_fd = -1;
+    return -1;
+  }
+
+  // read current state of serial port
+  result = tcgetattr(port->pt_fd, &port->pt_orig_settings);
+  if (result == -1)
+  {
+    fprintf(stderr, "**Error**: rs232_open: Unable to get terminal settings (%s)\n", strerror(errno));
+    result = -2;
+    goto fail;
+  }
+
+  port->pt_curr_settings = port->pt_orig_settings;
+
+  result = cfsetispeed(&port->pt_curr_settings, speed);
+  if (result == -1)
+  {
+    fprintf(stderr, "**Error**: rs232_open: Unable to set terminal input speed (%s)\n", strerror(errno));
+    result = -3;
+    goto fail;
+  }
+
+  result = cfsetospeed(&port->pt_curr_settings, speed);
+  if (result == -1)
+  {
+    fprintf(stderr, "**Error**: rs232_open: Unable to set terminal output speed (%s)\n", strerror(errno));
+    result = -4;
+    goto fail;
+  }
+
+  port->pt_curr_settings.c_lflag = 0;
+
+  port->pt_curr_settings.c_oflag = 0;
+
+  port->pt_curr_settings.c_iflag = 0;
+  if (port->pt_config.flow == RS232_FLOW_XONXOFF) port->pt_curr_settings.c_iflag |= (IXON | IXOFF);
+
+  port->pt_curr_settings.c_cflag |= (CREAD | CLOCAL);
+  port->pt_curr_settings.c_cflag &= ~(CSIZE | CSTOPB | PARENB | PARODD | CRTSCTS);
+  port->pt_curr_settings.c_cflag |= CS8;  // 8 bit
+  if (port->pt_config.stop_bits == 2) port->pt_curr_settings.c_cflag |= CSTOPB;
+  if (port->pt_config.parity == RS232_PARITY_ODD) port->pt_curr_settings.c_cflag |= (PARENB | PARODD);
+  if (port->pt_config.parity == RS232_PARITY_EVEN) port->pt_curr_settings.c_cflag |= PARENB;
+  if (port->pt_config.flow == RS232_FLOW_RTSCTS) port->pt_curr_settings.c_cflag |= CRTSCTS;
+
+  port->pt_curr_settings.c_cc[VMIN]  = port->pt_config.vmin;
+  port->pt_curr_settings.c_cc[VTIME] = port->pt_config.vtime;
+
+  result = tcsetattr(port->pt_fd, TCSANOW, &port->pt_curr_settings);
+  if (result == -1)
+  {
+    fprintf(stderr, "**Error**: rs232_open: Unable to set terminal settings (%s)\n", strerror(errno));
+    result = -5;
+    goto fail;
+  }
+
+  rs232_stats_reset(port->pt_fd, dev_file);
+  if (port->pt_fd < RS232_READER_PORTS) rs232_reader_reset(&rs232_readers[port->pt_fd]);
+
+  // not part of termios, so rs232_close has to turn it off again
+  if (port->pt_config.low_latency && (! rs232_set_low_latency(port->pt_fd, 1)))
+  {
+    fprintf(stderr, "**Warning**: rs232_open: %s does not support low latency mode\n", dev_file);
+    port->pt_config.low_latency = 0;
+  }
+
+  // discard old data in rx and tx buffer
+  result = tcflush(port->pt_fd, TCIOFLUSH);
+  if (result == -1)
+  {
+    fprintf(stderr, "**Error**: rs232_open: Unable to flush terminal (%s)\n", strerror(errno));
+    result = -6;
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  close(port->pt_fd);
+  port->pt_fd = -1;
+  return result;
+}
+
+// ---------------------------------------------------------------------------
+int rs232_open(struct rs232_port_struc *port, char *dev_file)
+{
+  return rs232_open_config(port, dev_file, NULL);
+}
+
+// ---------------------------------------------------------------------------
+int rs232_close(struct rs232_port_struc *port)
+{
+  int result;
+
+  if (port->pt_fd < 0) return 0;
+
+  if (port->pt_config.low_latency) rs232_set_low_latency(port->pt_fd, 0);
+
+  result = tcsetattr(port->pt_fd, TCSANOW, &port->pt_orig_settings);
+  if (result == -1)
+  {
+    fprintf(stderr, "**Error**: rs232_close: unable to set terminal settings (%s)\n", strerror(errno));
+    return -1;
+  }
+
+  // discard old data in rx and tx buffer
+  result = tcflush(port->pt_fd, TCIOFLUSH);
+  if (result == -1)
+  {
+    fprintf(stderr, "**Error**: rs232_close: Unable to flush terminal (%s)\n", strerror(errno));
+    return -2;
+  }
+
+  close(port->pt_fd);
+  port->pt_fd = -1;
+
+  return 0;
+}
+
+
+// ---------------------------------------------------------------------------
+// Link probe: measures what the line really does with the controller (or the
+// simulator) on the other end. Controller acknowledges every byte, so single
+// bytes give the round trip and bursts give throughput. Probe never sends a
+// whole frame: after STEPPER_FRAME_SIZE - 1 bytes the line is left silent for
+// the resync gap and controller drops the partial frame without moving.
+struct rs232_probe_struc
+{
+  int pr_rounds;
+  int pr_samples;          // acknowledged single bytes
+  int pr_lost;             // bytes without ack
+  long long pr_rtt_min_us;
+  long long pr_rtt_max_us;
+  double pr_rtt_mean_us;
+  double pr_burst_bytes_per_s;  // acknowledged bytes per second in bursts
+  double pr_line_bytes_per_s;   // what baud rate and framing allow
+};
+
+// ---------------------------------------------------------------------------
+// rounds of single byte round trips and one burst each; returns 0 if device
+// answered at all
+int rs232_probe_link(struct rs232_port_struc *port, int rounds, struct rs232_probe_struc *probe)
+{
+  unsigned char frame[STEPPER_FRAME_SIZE - 1];
+  unsigned char reply[STEPPER_FRAME_SIZE];
+  long long t0_us;
+  long long rtt_us;
+  long long burst_us = 0;
+  long burst_bytes = 0;
+  double rtt_sum_us = 0;
+  int bits;
+  int result;
+  int round;
+  int i;
+
+  memset(probe, 0, sizeof(struct rs232_probe_struc));
+  memset(frame, 0, sizeof(frame)); // zero steps even if controller kept it
+  frame[0] = 0xFF;
+  frame[1] = 0x00;
+
+  // start, data, parity, stop bits
+  bits = 1 + 8 + (port->pt_config.parity != RS232_PARITY_NONE) + port->pt_config.stop_bits;
+  probe->pr_line_bytes_per_s = (double)port->pt_config.baud / bits;
+
+  for (round = 0; round < rounds; round++)
+  {
+    // first half of partial frame byte by byte
+    for (i = 0; i < (int)sizeof(frame) / 2; i++)
+    {
+      t0_us = rs232_now_us();
+      if (rs232_write_all(port->pt_fd, &frame[i], 1) < 0) return -1;
+      result = rs232_read_deadline(port->pt_fd, reply, 1, t0_us + STEPPER_ACK_TIMEOUT_US);
+      if (result < 0) return -2;
+      rtt_us = rs232_now_us() - t0_us;
+
+      if ((result == 0) || (reply[0] != STEPPER_ACK_BYTE))
+      {
+        probe->pr_lost ++;
+        continue;
+      }
+
+      if ((probe->pr_samples == 0) || (rtt_us < probe->pr_rtt_min_us)) probe->pr_rtt_min_us = rtt_us;
+      if (rtt_us > probe->pr_rtt_max_us) probe->pr_rtt_max_us = rtt_us;
+      rtt_sum_us += rtt_us;
+      probe->pr_samples ++;
+    }
+
+    // rest as one burst
+    t0_us = rs232_now_us();
+    if (rs232_write_all(port->pt_fd, &frame[i], sizeof(frame) - i) < 0) return -1;
+    result = rs232_read_deadline(port->pt_fd, reply, sizeof(frame) - i, t0_us + (sizeof(frame) - i) * STEPPER_ACK_TIMEOUT_US);
+    if (result < 0) return -2;
+    burst_us += rs232_now_us() - t0_us;
+    burst_bytes += result;
+    probe->pr_lost += (sizeof(frame) - i) - result;
+
+    // controller forgets partial frame, late acks are drained meanwhile
+    t0_us = rs232_now_us() + STEPPER_RESYNC_GAP_US + STEPPER_RETRY_BACKOFF_US;
+    while (rs232_now_us() < t0_us)
+    {
+      if (rs232_read_deadline(port->pt_fd, reply, sizeof(reply), t0_us) < 0) return -2;
+    }
+    probe->pr_rounds ++;
+  }
+
+  if (probe->pr_samples > 0) probe->pr_rtt_mean_us = rtt_sum_us / probe->pr_samples;
+  if (burst_us > 0) probe->pr_burst_bytes_per_s = burst_bytes * 1e6 / burst_us;
+
+  if (probe->pr_samples + burst_bytes == 0)
+  {
+    fprintf(stderr, "**Error**: rs232_probe_link: No answer from %s\n", port->pt_name);
+    return -3;
+  }
+
+  return 0;
+}
+
+
+/*
+// -------------------------------------------------------------------------
+int stepper_init(char *dev_file_name, int *dev_fd)
+{
+  int error;
+#ifdef SETUID
+  int old_uid, old_gid;
+  int uid_changed = 0;
+#endif // SETUID
+  struct termios old_dev_tio, new_dev_tio;
+
+  fd_set dev_read_fds;
+  struct timeval dev_tv;
+
+  char *dev_cmd_read_request = (channel_number == 1) ? ":acq1:lmem?\n" : ":acq2:lmem?\n";
+
+  int dev_data_index = 0;
+  int dev_read_len;
+
+#ifdef SETUID
+  if ((dev_fd = open(dev_file_name, O_RDWR | O_NOCTTY)) < 0) // check if we have permissions
+  {
+    old_uid = getuid(); old_gid = getgid();
+    if (setuid(0) || setgid(0))
+    {
+      fprintf(stderr, "**Error**: You have no permissions to access \"%s\"\n"
+                      "           Setting UID and GID to root failed\n", dev_file_name);
+      return ERR_DEVICE_OPEN;
+    }
+
+    uid_changed = 1;
+    // already root:wheel
+    if ((dev_fd = open(dev_file_name, O_RDWR | O_NOCTTY)) < 0)
+    {
+      fprintf(stderr, "**Error**: Error opening device \"%s\"\n", dev_file_name);
+      setuid(old_uid); setgid(old_gid);
+      return ERR_DEVICE_OPEN;
+    }
+  }
+#else // SETUID
+  if ((dev_fd = open(dev_file_name, O_RDWR | O_NOCTTY)) < 0)
+  {
+    fprintf(stderr, "**Error**: Error opening device \"%s\"\n", dev_file_name);
+    return ERR_DEVICE_OPEN;
+  }
+#endif // SETUID
+
+  tcgetattr(dev_fd, &old_dev_tio);
+  bzero(&new_dev_tio, sizeof(new_dev_tio));
+  new_dev_tio.c_cflag = B19200 | CS8 | CLOCAL | CREAD;
+  new_dev_tio.c_iflag = IGNBRK | IXON | IXOFF;
+  new_dev_tio.c_oflag = 0;
+  new_dev_tio.c_lflag = 0;
+  new_dev_tio.c_cc[VTIME] = 5;
+  new_dev_tio.c_cc[VMIN] = 1;
+  new_dev_tio.c_ispeed = 13;
+  new_dev_tio.c_ospeed = 13;
+  tcflush(dev_fd, TCIFLUSH);
+  tcsetattr(dev_fd, TCSANOW, &new_dev_tio);
+
+  write(dev_fd, dev_cmd_read_request, strlen(dev_cmd_read_request));
+
+  FD_ZERO(&dev_read_fds);
+  FD_SET(dev_fd, &dev_read_fds);
+
+  while (1)
+  {
+    dev_tv.tv_sec = 0;
+    dev_tv.tv_usec = 200000;
+    error = select(dev_fd + 1, &dev_read_fds, NULL, NULL, &dev_tv);
+    switch(error)
+    {
+       case -1:
+         fprintf(stderr, "**Error**: Error reading from device: select() failed with errorcode %d\n", error);
+         close(dev_fd);
+         return ERR_DEVICE_READ;
+       case 0:
+         close(dev_fd);
+         gds_buffer_length = dev_data_index;
+#ifdef SETUID
+         if (uid_changed)  // reset uid/gid to create files belonging to current user but not root
+         {
+           setuid(old_uid);
+           setgid(old_gid);
+         }
+#endif
+         return 0;
+       default:
+         dev_read_len = read(dev_fd, gds_buffer + dev_data_index, GDS_BUFFER_LENGTH - dev_data_index);
+         dev_data_index += dev_read_len;
+    }
+  }
+  
+}
+*/
+
+
+
+// ---------------------------------------------------------------------------
+void stepper_encode_frame(unsigned char *data_buffer, int steps, int micro_step_flag, int stepper_freq)
+{
+  int freq_word;
+
+  memset(data_buffer, 0, STEPPER_FRAME_SIZE);
+
+  data_buffer[4] = STEPPER_CTRL_NRESET; // -reset bit must always be equal to 1
+
+  if (stepper_freq < STEPPER_LOW_SPEED_THRESHOLD)
+  {
+    freq_word = (0xFFFF - (STEPPER_SRC_FREQ) / (stepper_freq * STEPPER_LOW_SPEED_DIV));
+    data_buffer[4] |= STEPPER_CTRL_LOW_SPEED; // set low speed bit
+  } else
+  {
+    freq_word = (0xFFFF - (STEPPER_SRC_FREQ) / (stepper_freq * 1));
+    data_buffer[4] &= ~STEPPER_CTRL_LOW_SPEED; // drop low speed bit
+  }
+
+  if (steps < 0)
+  {
+    data_buffer[4] |= STEPPER_CTRL_NEGATIVE; // negation sign
+    steps = -steps;
+  } else
+  {
+    data_buffer[4] &= ~STEPPER_CTRL_NEGATIVE; // positive
+  }
+
+  if (micro_step_flag)
+  {
+    data_buffer[4] |= STEPPER_CTRL_MICROSTEP; // microstep enable
+  } else
+  {
+    data_buffer[4] &= ~STEPPER_CTRL_MICROSTEP; // microstep disable
+  }
+
+  data_buffer[0] = (freq_word >> 8) & 0xFF;  // first high
+  data_buffer[1] = (freq_word >> 0) & 0xFF;  // then low
+
+  data_buffer[2] = (steps >> 8) & 0xFF;  // first high
+  data_buffer[3] = (steps >> 0) & 0xFF;  // then low
+}
+
+// ---------------------------------------------------------------------------
+// applies to frames started afterwards, from any thread
+int stepper_set_tx_mode(int tx_mode)
+{
+  if ((tx_mode != STEPPER_TX_PER_BYTE) && (tx_mode != STEPPER_TX_FRAME))
+  {
+    fprintf(stderr, "**Error**: stepper_set_tx_mode: Unknown mode %d\n", tx_mode);
+    return -1;
+  }
+
+  HINT_STORE(&stepper_tx_mode, tx_mode);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// frame holds 16 bit step count and frequency word is divided by frequency;
+// returns STEPPER_MOVE_OK or STEPPER_MOVE_RANGE
+int stepper_check_move(const char *func, int steps, int stepper_freq)
+{
+  if ((steps > STEPPER_MAX_STEPS) || (steps < -STEPPER_MAX_STEPS))
+  {
+    fprintf(stderr, "**Error**: %s: %d steps do not fit in one frame (max %d)\n", func, steps, STEPPER_MAX_STEPS);
+    return STEPPER_MOVE_RANGE;
+  }
+
+  if ((stepper_freq < STEPPER_MIN_FREQ) || (stepper_freq > STEPPER_SRC_FREQ))
+  {
+    fprintf(stderr, "**Error**: %s: Stepper frequency %d Hz is out of range (%d .. %d)\n", func, stepper_freq,
+      STEPPER_MIN_FREQ, STEPPER_SRC_FREQ);
+    return STEPPER_MOVE_RANGE;
+  }
+
+  return STEPPER_MOVE_OK;
+}
+
+// ---------------------------------------------------------------------------
+// inverse of stepper_encode_frame, step_rate is actual pulse rate the controller
+// produces from the frequency word, Hz
+void stepper_decode_frame(const unsigned char *data_buffer, int *steps, int *micro_step_flag, int *low_speed_flag, double *step_rate)
+{
+  int freq_word = (data_buffer[0] << 8) | data_buffer[1];
+  int divider = 0xFFFF - freq_word;
+
+  *low_speed_flag = !!(data_buffer[4] & STEPPER_CTRL_LOW_SPEED);
+  *micro_step_flag = !!(data_buffer[4] & STEPPER_CTRL_MICROSTEP);
+
+  *steps = (data_buffer[2] << 8) | data_buffer[3];
+  if (data_buffer[4] & STEPPER_CTRL_NEGATIVE) *steps = -*steps;
+
+  if (divider < 1) divider = 1;
+  *step_rate = (double)(STEPPER_SRC_FREQ) / ((double)divider * (*low_speed_flag ? STEPPER_LOW_SPEED_DIV : 1));
+}
+
+// ---------------------------------------------------------------------------
+// how long controller needs for the move, us; uses the rate the frequency word
+// really produces, prescaler and integer division included
+long long stepper_move_duration_us(int steps, int micro_step_flag, int stepper_freq)
+{
+  unsigned char data_buffer[STEPPER_FRAME_SIZE];
+  int frame_steps;
+  int frame_micro;
+  int low_speed_flag;
+  double step_rate;
+
+  stepper_encode_frame(data_buffer, steps, micro_step_flag, stepper_freq);
+  stepper_decode_frame(data_buffer, &frame_steps, &frame_micro, &low_speed_flag, &step_rate);
+
+  return (long long)(abs(frame_steps) * 1e6 / step_rate + 0.5);
+}
+
+// ---------------------------------------------------------------------------
+// Frame protocol state machine for one move. Each byte has to be answered by
+// STEPPER_ACK_BYTE; anything else or silence aborts the attempt, the line is
+// resynced and the frame resent, at most STEPPER_RETRY_LIMIT times. Once the
+// last byte is out a retry could run the move twice, so a bad last ack only
+// makes us wait for completion byte to learn whether frame was taken.
+#define STEPPER_PROTO_SEND      (0)
+#define STEPPER_PROTO_WAIT_ACK  (1)
+#define STEPPER_PROTO_WAIT_DONE (2)
+#define STEPPER_PROTO_RESYNC    (3) // line silent before resending
+#define STEPPER_PROTO_FINISHED  (4) // p_result holds STEPPER_MOVE_*
+
+struct stepper_protocol_struc
+{
+  int p_state;
+  int p_result;
+  unsigned char p_frame[STEPPER_FRAME_SIZE];
+  int p_byte;                   // byte being sent or acknowledged
+  int p_tx_mode;                // STEPPER_TX_*
+  int p_attempt;
+  int p_last_error;             // reason of last failed attempt
+  int p_unconfirmed;            // last ack was bad, completion decides
+  int p_started;                // stale input drained
+  int p_fd;                     // for statistics
+  long long p_start_us;         // first byte went out
+  long long p_sent_us;          // byte waiting for ack went out
+  long long p_state_deadline_us;
+  long long p_deadline_us;      // whole move
+  long long p_duration_us;      // computed motion time
+  long long p_done_timeout_us;  // wait for completion byte after last ack
+  long long p_acked_us;         // frame accepted, motion starts
+
+  // statistics
+  long p_garbage_bytes;
+  long p_ack_timeouts;
+  long p_retries;
+};
+
+// ---------------------------------------------------------------------------
+void stepper_protocol_init(struct stepper_protocol_struc *proto, int steps, int micro_step_flag, int stepper_freq,
+  long long deadline_us)
+{
+  memset(proto, 0, sizeof(struct stepper_protocol_struc));
+  stepper_encode_frame(proto->p_frame, steps, micro_step_flag, stepper_freq);
+  proto->p_state = STEPPER_PROTO_SEND;
+  proto->p_tx_mode = HINT_LOAD(&stepper_tx_mode);
+  proto->p_deadline_us = deadline_us;
+  proto->p_duration_us = stepper_move_duration_us(steps, micro_step_flag, stepper_freq);
+  proto->p_done_timeout_us = (long long)(proto->p_duration_us * (1.0 + STEPPER_DURATION_SLACK)) + STEPPER_DONE_TIMEOUT_US;
+}
+
+// ---------------------------------------------------------------------------
+void stepper_protocol_finish(struct stepper_protocol_struc *proto, int result)
+{
+  proto->p_state = STEPPER_PROTO_FINISHED;
+  proto->p_result = result;
+
+  if ((result == STEPPER_MOVE_OK) && HINT_LOAD(&rs232_stats_enabled))
+    rs232_stats_record(proto->p_fd, RS232_STAT_MOVE, rs232_now_us() - proto->p_start_us);
+}
+
+// ---------------------------------------------------------------------------
+// current attempt failed with given reason, schedules retry or gives up
+void stepper_protocol_fail_attempt(struct stepper_protocol_struc *proto, int reason)
+{
+  long long backoff_us;
+
+  proto->p_last_error = reason;
+
+  // after last byte the controller may be executing, never send twice
+  if ((proto->p_byte == STEPPER_FRAME_SIZE - 1) || (proto->p_tx_mode == STEPPER_TX_FRAME))
+  {
+    proto->p_unconfirmed = 1;
+    proto->p_acked_us = rs232_now_us();
+    proto->p_state = STEPPER_PROTO_WAIT_DONE;
+    proto->p_state_deadline_us = proto->p_acked_us + proto->p_done_timeout_us;
+    return;
+  }
+
+  if (proto->p_attempt >= STEPPER_RETRY_LIMIT)
+  {
+    stepper_protocol_finish(proto, reason);
+    return;
+  }
+
+  backoff_us = (long long)STEPPER_RETRY_BACKOFF_US << proto->p_attempt;
+  if (backoff_us > STEPPER_RETRY_BACKOFF_MAX_US) backoff_us = STEPPER_RETRY_BACKOFF_MAX_US;
+
+  proto->p_state = STEPPER_PROTO_RESYNC;
+  proto->p_state_deadline_us = rs232_now_us() + STEPPER_RESYNC_GAP_US + backoff_us;
+}
+
+// ---------------------------------------------------------------------------
+void stepper_protocol_on_byte(struct stepper_protocol_struc *proto, unsigned char byte)
+{
+  switch (proto->p_state)
+  {
+    case STEPPER_PROTO_WAIT_ACK:
+      // last ack lost but move already reports completion
+      if ((byte == STEPPER_DONE_BYTE) && (proto->p_byte == STEPPER_FRAME_SIZE - 1))
+      {
+        stepper_protocol_finish(proto, STEPPER_MOVE_OK);
+        break;
+      }
+
+      if (byte != STEPPER_ACK_BYTE)
+      {
+        proto->p_garbage_bytes ++;
+        stepper_protocol_fail_attempt(proto, STEPPER_MOVE_BAD_ACK);
+        break;
+      }
+
+      if (HINT_LOAD(&rs232_stats_enabled)) rs232_stats_record(proto->p_fd, RS232_STAT_ACK, rs232_now_us() - proto->p_sent_us);
+
+      proto->p_byte ++;
+      if (proto->p_byte < STEPPER_FRAME_SIZE)
+      {
+        if (proto->p_tx_mode == STEPPER_TX_FRAME)
+        {
+          // next byte is out already, its ack counts from this one
+          proto->p_sent_us = rs232_now_us();
+          proto->p_state_deadline_us = proto->p_sent_us + STEPPER_ACK_TIMEOUT_US;
+        } else
+          proto->p_state = STEPPER_PROTO_SEND;
+      } else
+      {
+        proto->p_acked_us = rs232_now_us();
+        proto->p_state = STEPPER_PROTO_WAIT_DONE;
+        proto->p_state_deadline_us = proto->p_acked_us + proto->p_done_timeout_us;
+      }
+      break;
+
+    case STEPPER_PROTO_WAIT_DONE:
+      // late or repeated acks are not completion
+      if (byte == STEPPER_ACK_BYTE)
+      {
+        proto->p_garbage_bytes ++;
+        break;
+      }
+      stepper_protocol_finish(proto, STEPPER_MOVE_OK);
+      break;
+
+    default:
+      // leftovers of an aborted attempt
+      proto->p_garbage_bytes ++;
+  }
+}
+
+// ---------------------------------------------------------------------------
+void stepper_protocol_on_timeout(struct stepper_protocol_struc *proto)
+{
+  switch (proto->p_state)
+  {
+    case STEPPER_PROTO_WAIT_ACK:
+      proto->p_ack_timeouts ++;
+      stepper_protocol_fail_attempt(proto, STEPPER_MOVE_ACK_TIMEOUT);
+      break;
+
+    case STEPPER_PROTO_WAIT_DONE:
+      stepper_protocol_finish(proto, proto->p_unconfirmed ? proto->p_last_error : STEPPER_MOVE_DONE_TIMEOUT);
+      break;
+
+    case STEPPER_PROTO_RESYNC:
+      proto->p_attempt ++;
+      proto->p_retries ++;
+      proto->p_byte = 0;
+      proto->p_state = STEPPER_PROTO_SEND;
+      break;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// drives the state machine until move finished, until frame is accepted if
+// stop_in_done is set, or until wait_until_us passed (0 just handles what is
+// there). Returns 1 if move finished, 0 otherwise
+int stepper_protocol_advance(struct stepper_protocol_struc *proto, int dev_fd, long long wait_until_us, int stop_in_done)
+{
+  unsigned char buffer[64];
+  long long deadline_us;
+  int result;
+  int i;
+
+  // whatever is waiting in input belongs to nobody
+  if (! proto->p_started)
+  {
+    while (rs232_read_deadline(dev_fd, buffer, sizeof(buffer), 0) == sizeof(buffer)) {}
+    proto->p_started = 1;
+    proto->p_fd = dev_fd;
+    proto->p_start_us = rs232_now_us();
+  }
+
+  while (proto->p_state != STEPPER_PROTO_FINISHED)
+  {
+    if (proto->p_state == STEPPER_PROTO_SEND)
+    {
+      if (rs232_write_all(dev_fd, &proto->p_frame[proto->p_byte],
+        (proto->p_tx_mode == STEPPER_TX_FRAME) ? STEPPER_FRAME_SIZE - proto->p_byte : 1) < 0)
+      {
+        stepper_protocol_finish(proto, STEPPER_MOVE_IO_ERROR);
+        break;
+      }
+      proto->p_state = STEPPER_PROTO_WAIT_ACK;
+      proto->p_sent_us = rs232_now_us();
+      proto->p_state_deadline_us = proto->p_sent_us + STEPPER_ACK_TIMEOUT_US;
+    }
+
+    if (stop_in_done && (proto->p_state == STEPPER_PROTO_WAIT_DONE)) return 0;
+
+    deadline_us = proto->p_state_deadline_us;
+    if (deadline_us > proto->p_deadline_us) deadline_us = proto->p_deadline_us;
+    if (deadline_us > wait_until_us) deadline_us = wait_until_us;
+
+    // takes everything that arrived in one read
+    result = rs232_read_deadline(dev_fd, buffer, 1, deadline_us);
+    if (result < 0)
+    {
+      stepper_protocol_finish(proto, STEPPER_MOVE_IO_ERROR);
+      break;
+    }
+
+    if (result == 0)
+    {
+      if (rs232_now_us() >= proto->p_deadline_us)
+      {
+        stepper_protocol_finish(proto, STEPPER_MOVE_DEADLINE);
+        break;
+      }
+      if (rs232_now_us() < proto->p_state_deadline_us) return 0; // caller's wait is over
+      stepper_protocol_on_timeout(proto);
+      continue;
+    }
+
+    result += rs232_read_deadline(dev_fd, buffer + 1, sizeof(buffer) - 1, 0);
+    for (i = 0; (i < result) && (proto->p_state != STEPPER_PROTO_FINISHED); i++)
+    {
+      stepper_protocol_on_byte(proto, buffer[i]);
+      // rest of a failed attempt's input is dropped with the resync
+      if (proto->p_state == STEPPER_PROTO_RESYNC)
+      {
+        proto->p_garbage_bytes += result - i - 1;
+        break;
+      }
+    }
+  }
+
+  return 1;
+}
+
+// ---------------------------------------------------------------------------
+// drives the state machine until move finished, returns STEPPER_MOVE_*
+int stepper_protocol_run(struct stepper_protocol_struc *proto, int dev_fd)
+{
+  stepper_protocol_advance(proto, dev_fd, proto->p_deadline_us, 0);
+
+  return proto->p_result;
+}
+
+// ---------------------------------------------------------------------------
+// worst case time of one move: every attempt may time out on each byte, plus
+// resyncs and completion wait
+long long stepper_move_budget_us(int steps, int micro_step_flag, int stepper_freq)
+{
+  return (long long)(STEPPER_RETRY_LIMIT + 1) * (STEPPER_FRAME_SIZE * STEPPER_ACK_TIMEOUT_US + STEPPER_RESYNC_GAP_US + STEPPER_RETRY_BACKOFF_MAX_US) +
+    (long long)(stepper_move_duration_us(steps, micro_step_flag, stepper_freq) * (1.0 + STEPPER_DURATION_SLACK)) + STEPPER_DONE_TIMEOUT_US;
+}
+
+// ---------------------------------------------------------------------------
+// prints what went wrong with a finished move
+void stepper_protocol_report(struct stepper_protocol_struc *proto, const char *func)
+{
+  if (proto->p_retries > 0)
+    fprintf(stderr, "**Warning**: %s: Frame needed %ld retries, %ld garbage bytes\n", func, proto->p_retries, proto->p_garbage_bytes);
+
+  switch (proto->p_result)
+  {
+    case STEPPER_MOVE_OK:
+      break;
+    case STEPPER_MOVE_ACK_TIMEOUT:
+      fprintf(stderr, "**Error**: %s: Controller does not acknowledge (byte %d)\n", func, proto->p_byte);
+      break;
+    case STEPPER_MOVE_BAD_ACK:
+      fprintf(stderr, "**Error**: %s: Controller answers with garbage (byte %d)\n", func, proto->p_byte);
+      break;
+    case STEPPER_MOVE_DONE_TIMEOUT:
+      fprintf(stderr, "**Error**: %s: Move did not complete within %lld us\n", func, proto->p_done_timeout_us);
+      break;
+    case STEPPER_MOVE_DEADLINE:
+      fprintf(stderr, "**Error**: %s: Deadline passed\n", func);
+      break;
+    default:
+      fprintf(stderr, "**Error**: %s: Device i/o failed\n", func);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// sends one move and waits for its completion; returns STEPPER_MOVE_OK or
+// negative STEPPER_MOVE_* code
+int stepper_rotate(int dev_fd, int steps, int micro_step_flag, int stepper_freq)
+{
+  struct stepper_protocol_struc proto;
+
+  if (stepper_check_move("stepper_rotate", steps, stepper_freq) < 0) return STEPPER_MOVE_RANGE;
+
+  stepper_protocol_init(&proto, steps, micro_step_flag, stepper_freq,
+    rs232_now_us() + stepper_move_budget_us(steps, micro_step_flag, stepper_freq));
+
+  stepper_protocol_run(&proto, dev_fd);
+  stepper_protocol_report(&proto, "stepper_rotate");
+
+  return proto.p_result;
+}
+
+// ---------------------------------------------------------------------------
+// Move handle: stepper_move_start returns once controller accepted the frame,
+// m_expected_done_us then tells when motion should end. Caller does other work
+// and polls, or blocks in stepper_move_wait which returns the moment the
+// completion byte arrives. Only one move may be open on a port at a time.
+struct stepper_move_struc
+{
+  int m_fd;
+  struct stepper_protocol_struc m_proto;
+  long long m_expected_done_us; // valid once started
+};
+
+// ---------------------------------------------------------------------------
+// sends frame, returns 0 when motion runs or negative STEPPER_MOVE_* if frame
+// could not be delivered
+int stepper_move_start(struct stepper_move_struc *move, int dev_fd, int steps, int micro_step_flag, int stepper_freq)
+{
+  if (stepper_check_move("stepper_move_start", steps, stepper_freq) < 0) return STEPPER_MOVE_RANGE;
+
+  move->m_fd = dev_fd;
+  stepper_protocol_init(&move->m_proto, steps, micro_step_flag, stepper_freq,
+    rs232_now_us() + stepper_move_budget_us(steps, micro_step_flag, stepper_freq));
+
+  if (stepper_protocol_advance(&move->m_proto, dev_fd, move->m_proto.p_deadline_us, 1))
+  {
+    // finished before motion could start means failure, or done byte came with last ack
+    move->m_expected_done_us = rs232_now_us();
+    if (move->m_proto.p_result != STEPPER_MOVE_OK) stepper_protocol_report(&move->m_proto, "stepper_move_start");
+    return move->m_proto.p_result;
+  }
+
+  move->m_expected_done_us = move->m_proto.p_acked_us + move->m_proto.p_duration_us;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// never blocks; returns 1 if move finished (result in stepper_move_wait)
+int stepper_move_poll(struct stepper_move_struc *move)
+{
+  return stepper_protocol_advance(&move->m_proto, move->m_fd, 0, 0);
+}
+
+// ---------------------------------------------------------------------------
+// waits until move finished or deadline_us passed; returns STEPPER_MOVE_* of
+// finished move, or 1 if still moving at deadline
+int stepper_move_wait(struct stepper_move_struc *move, long long deadline_us)
+{
+  if (! stepper_protocol_advance(&move->m_proto, move->m_fd, deadline_us, 0)) return 1;
+
+  if (move->m_proto.p_result != STEPPER_MOVE_OK) stepper_protocol_report(&move->m_proto, "stepper_move_wait");
+  return move->m_proto.p_result;
+}
+
+
+// ---------------------------------------------------------------------------
+// Scan planner: turns a wavelength list into moves that visit every point with
+// least wall time. On a line the shortest tour is a sweep: go to the nearer end
+// of [lowest, highest] position, then run to the other end. With backlash set
+// every point is approached upwards instead, so the sweep starts below the
+// lowest point. Each move is cut into frames of at most STEPPER_MAX_STEPS and
+// costs command overhead plus pulses over the rate its frequency word really
+// gives. Positions are in calibration steps; if l_micro_ratio > 1 these are
+// microsteps and a full step pulse moves l_micro_ratio of them, so a move runs
+// in full steps with microstep remainder when that is faster. Each part of a
+// move takes the cheapest of the candidate rates the limits allow, the fastest
+// one on the normal clock and the fastest one on the low speed clock.
+struct stepper_limits_struc
+{
+  int l_max_freq;          // Hz, full step pulses
+  int l_max_micro_freq;    // Hz, microstep pulses
+  int l_micro_ratio;       // calibration steps per full step pulse, 1 = no microstepping
+  int l_backlash;          // calibration steps, 0 = points may be approached from both sides
+  long long l_overhead_us; // per command: frame, acks and completion byte
+};
+
+struct stepper_plan_move_struc
+{
+  int index;           // wavelength reached after this move, -1 for intermediate moves
+  int position;        // after the move, calibration steps
+  int steps;           // pulses, signed
+  int micro_step_flag;
+  int stepper_freq;
+  long long duration_us; // including overhead
+};
+
+// frequency arguments worth trying for one kind of pulse
+struct stepper_plan_rates_struc
+{
+  int pr_freq[2];
+  int pr_count;
+};
+
+struct stepper_plan_struc
+{
+  struct stepper_plan_move_struc *p_moves;
+  size_t p_count;
+  size_t p_capacity;
+  int p_start;             // position plan starts from
+  long p_travel;           // calibration steps
+  long long p_duration_us; // predicted
+};
+
+// ---------------------------------------------------------------------------
+void stepper_limits_default(struct stepper_limits_struc *limits)
+{
+  limits->l_max_freq = 3200;
+  limits->l_max_micro_freq = 3200;
+  limits->l_micro_ratio = 1;
+  limits->l_backlash = 0;
+  limits->l_overhead_us = STEPPER_FRAME_SIZE * 1000 + 1000; // about 1 ms turnaround per byte
+}
+
+// ---------------------------------------------------------------------------
+// frequency argument of the fastest rate not above max_freq; integer divider
+// rounds rates up, and below STEPPER_LOW_SPEED_THRESHOLD the prescaled clock
+// makes the grid coarse
+int stepper_plan_freq(int max_freq)
+{
+  int freq = max_freq;
+
+  while ((freq > STEPPER_MIN_FREQ) && (stepper_move_duration_us(60000, 0, freq) < (long long)(60000 * 1e6 / max_freq))) freq --;
+
+  return freq;
+}
+
+// ---------------------------------------------------------------------------
+// candidates not above max_freq: fastest rate overall and, when that one runs
+// on the normal clock, fastest rate below STEPPER_LOW_SPEED_THRESHOLD
+void stepper_plan_rates(int max_freq, struct stepper_plan_rates_struc *rates)
+{
+  rates->pr_freq[0] = stepper_plan_freq(max_freq);
+  rates->pr_count = 1;
+
+  if ((rates->pr_freq[0] >= STEPPER_LOW_SPEED_THRESHOLD) && (STEPPER_LOW_SPEED_THRESHOLD - 1 >= STEPPER_MIN_FREQ))
+    rates->pr_freq[rates->pr_count ++] = stepper_plan_freq(STEPPER_LOW_SPEED_THRESHOLD - 1);
+}
+
+// ---------------------------------------------------------------------------
+int stepper_plan_compare(const void *a, const void *b)
+{
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+
+  return (x > y) - (x < y);
+}
+
+// ---------------------------------------------------------------------------
+long long stepper_plan_pulses_us(int pulses, int stepper_freq, long long overhead_us)
+{
+  int frames = (pulses + STEPPER_MAX_STEPS - 1) / STEPPER_MAX_STEPS;
+
+  // one frame holds 16 bit step count, whole frames and the remainder apart
+  return (pulses / STEPPER_MAX_STEPS) * stepper_move_duration_us(STEPPER_MAX_STEPS, 0, stepper_freq) +
+    stepper_move_duration_us(pulses % STEPPER_MAX_STEPS, 0, stepper_freq) + frames * overhead_us;
+}
+
+// ---------------------------------------------------------------------------
+// candidate rate taking least time for given pulses, frame overhead included
+int stepper_plan_best_freq(const struct stepper_plan_rates_struc *rates, int pulses, long long overhead_us, long long *cost_us)
+{
+  long long us;
+  int best = 0;
+  int i;
+
+  *cost_us = stepper_plan_pulses_us(pulses, rates->pr_freq[0], overhead_us);
+  for (i = 1; i < rates->pr_count; i++)
+  {
+    us = stepper_plan_pulses_us(pulses, rates->pr_freq[i], overhead_us);
+    if (us < *cost_us)
+    {
+      *cost_us = us;
+      best = i;
+    }
+  }
+
+  return rates->pr_freq[best];
+}
+
+// ---------------------------------------------------------------------------
+int stepper_plan_add(struct stepper_plan_struc *plan, int index, int position, int steps,
+  int micro_step_flag, int stepper_freq, long long overhead_us)
+{
+  struct stepper_plan_move_struc *moves;
+  size_t capacity;
+
+  if (plan->p_count == plan->p_capacity)
+  {
+    capacity = (plan->p_capacity < 16) ? 16 : plan->p_capacity * 2;
+    moves = (struct stepper_plan_move_struc *)realloc(plan->p_moves, capacity * sizeof(struct stepper_plan_move_struc));
+    if (moves == NULL)
+    {
+      fprintf(stderr, "**Error**: stepper_plan_add: Memory allocation failed\n");
+      return -1;
+    }
+    plan->p_moves = moves;
+    plan->p_capacity = capacity;
+  }
+
+  moves = &plan->p_moves[plan->p_count ++];
+  moves->index = index;
+  moves->position = position;
+  moves->steps = steps;
+  moves->micro_step_flag = micro_step_flag;
+  moves->stepper_freq = stepper_freq;
+  moves->duration_us = overhead_us + stepper_move_duration_us(steps, micro_step_flag, stepper_freq);
+
+  plan->p_duration_us += moves->duration_us;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// appends moves from current end of plan to target, last one marked with index
+int stepper_plan_segment(struct stepper_plan_struc *plan, const struct stepper_limits_struc *limits,
+  const struct stepper_plan_rates_struc *full_rates, const struct stepper_plan_rates_struc *micro_rates,
+  int from, int to, int index)
+{
+  int distance = abs(to - from);
+  int sign = (to < from) ? -1 : 1;
+  int ratio = limits->l_micro_ratio;
+  int full_pulses = distance;
+  int micro_pulses = 0;
+  int full_freq;
+  int micro_freq;
+  int pulses;
+  int position = from;
+  long long micro_us;
+  long long mixed_us;
+  long long rest_us;
+
+  // without microstepping every calibration step is a full step pulse
+  full_freq = stepper_plan_best_freq(full_rates, distance, limits->l_overhead_us, &mixed_us);
+  micro_freq = full_freq;
+
+  // full steps for the bulk only if it beats doing all in microsteps
+  if (ratio > 1)
+  {
+    micro_freq = stepper_plan_best_freq(micro_rates, distance, limits->l_overhead_us, &micro_us);
+    full_pulses = 0;
+    micro_pulses = distance;
+    if (distance >= ratio)
+    {
+      full_freq = stepper_plan_best_freq(full_rates, distance / ratio, limits->l_overhead_us, &mixed_us);
+      if (distance % ratio)
+      {
+        stepper_plan_best_freq(micro_rates, distance % ratio, limits->l_overhead_us, &rest_us);
+        mixed_us += rest_us;
+      }
+      if (mixed_us < micro_us)
+      {
+        full_pulses = distance / ratio;
+        micro_pulses = distance % ratio;
+        micro_freq = stepper_plan_best_freq(micro_rates, micro_pulses, limits->l_overhead_us, &rest_us);
+      }
+    }
+  }
+
+  while (full_pulses > 0)
+  {
+    pulses = (full_pulses > STEPPER_MAX_STEPS) ? STEPPER_MAX_STEPS : full_pulses;
+    full_pulses -= pulses;
+    position += sign * pulses * ratio;
+    if (stepper_plan_add(plan, ((full_pulses == 0) && (micro_pulses == 0)) ? index : -1, position,
+      sign * pulses, 0, full_freq, limits->l_overhead_us) < 0) return -1;
+  }
+
+  while (micro_pulses > 0)
+  {
+    pulses = (micro_pulses > STEPPER_MAX_STEPS) ? STEPPER_MAX_STEPS : micro_pulses;
+    micro_pulses -= pulses;
+    position += sign * pulses;
+    if (stepper_plan_add(plan, (micro_pulses == 0) ? index : -1, position,
+      sign * pulses, (ratio > 1), micro_freq, limits->l_overhead_us) < 0) return -1;
+  }
+
+  // point already there: zero length move keeps it in the plan, costs nothing
+  if (distance == 0)
+  {
+    if (stepper_plan_add(plan, index, position, 0, 0, full_freq, 0) < 0) return -1;
+  }
+
+  plan->p_travel += distance;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+void stepper_plan_free(struct stepper_plan_struc *plan)
+{
+  free(plan->p_moves);
+  memset(plan, 0, sizeof(struct stepper_plan_struc));
+}
+
+// ---------------------------------------------------------------------------
+// plans visiting all wavelengths starting from start_position; plan is
+// released with stepper_plan_free
+int stepper_plan_scan(struct wl_cal_context_struc *wl_cal_context, const double *wl, size_t n, int start_position,
+  const struct stepper_limits_struc *limits, struct stepper_plan_struc *plan)
+{
+  long long *keys;
+  long long index;
+  int *steps;
+  size_t i;
+  struct stepper_plan_rates_struc full_rates;
+  struct stepper_plan_rates_struc micro_rates;
+  int lowest;
+  int highest;
+  int upwards;
+  int position;
+  int result = 0;
+
+  memset(plan, 0, sizeof(struct stepper_plan_struc));
+  plan->p_start = start_position;
+  if (n == 0) return 0;
+
+  if ((limits->l_max_freq < STEPPER_MIN_FREQ) || (limits->l_max_micro_freq < STEPPER_MIN_FREQ) || (limits->l_micro_ratio < 1))
+  {
+    fprintf(stderr, "**Error**: stepper_plan_scan: Invalid limits\n");
+    return -1;
+  }
+
+  steps = (int *)malloc(n * sizeof(int));
+  keys = (long long *)malloc(n * sizeof(long long));
+  if ((steps == NULL) || (keys == NULL))
+  {
+    fprintf(stderr, "**Error**: stepper_plan_scan: Memory allocation failed\n");
+    free(steps);
+    free(keys);
+    return -2;
+  }
+
+  if (wl_cal_wl2step_batch(wl_cal_context, wl, steps, n) < 0)
+  {
+    result = -3;
+    goto done;
+  }
+
+  // sort order by position, original index rides in the low bits
+  for (i = 0; i < n; i++) keys[i] = ((long long)steps[i] << 32) | (long long)i;
+  qsort(keys, n, sizeof(long long), stepper_plan_compare);
+  for (i = 0; i < n; i++) keys[i] &= 0xFFFFFFFFLL;
+
+  stepper_plan_rates(limits->l_max_freq, &full_rates);
+  stepper_plan_rates(limits->l_max_micro_freq, &micro_rates);
+
+  lowest = steps[keys[0]];
+  highest = steps[keys[n - 1]];
+
+  // nearer end first, unless backlash requires approaching from below
+  if (limits->l_backlash > 0)
+    upwards = 1;
+  else
+    upwards = (abs(start_position - lowest) <= abs(start_position - highest));
+
+  position = start_position;
+  if (upwards && (limits->l_backlash > 0) && (position > lowest - limits->l_backlash))
+  {
+    if (stepper_plan_segment(plan, limits, &full_rates, &micro_rates, position, lowest - limits->l_backlash, -1) < 0)
+    {
+      result = -2;
+      goto done;
+    }
+    position = lowest - limits->l_backlash;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    index = keys[upwards ? i : n - 1 - i];
+    if (stepper_plan_segment(plan, limits, &full_rates, &micro_rates, position, steps[index], (int)index) < 0)
+    {
+      result = -2;
+      goto done;
+    }
+    position = steps[index];
+  }
+
+done:
+  if (result < 0) stepper_plan_free(plan);
+  free(steps);
+  free(keys);
+  return result;
+}
+
+
+// ---------------------------------------------------------------------------
+// Ramp engine: a constant rate move has to stay below the rate motor can start
+// from standstill. Long moves instead go as a series of frames with rising,
+// cruising and falling stepper_freq. rp_accel is the limit the load allows
+// (motor torque over load inertia, in steps/s^2). Trapezoidal ramps hold that
+// acceleration; S-curve ramps follow a raised cosine in rate, peaking at the
+// same acceleration without its jumps at ramp ends. Moves too short to reach
+// rp_max_freq get a triangular profile. Frames are appended to a plan and
+// should go out as one pipelined batch (stepper_plan_push), any gap between
+// frames stops the motor mid move.
+#define STEPPER_RAMP_TRAPEZOID (0)
+#define STEPPER_RAMP_SCURVE    (1)
+
+struct stepper_ramp_struc
+{
+  int rp_profile;      // STEPPER_RAMP_*
+  int rp_start_freq;   // Hz, motor starts and stops at this without losing steps
+  int rp_max_freq;     // Hz, cruise
+  double rp_accel;     // steps/s^2
+  int rp_frames;       // frames per ramp, more follow the curve closer
+};
+
+// ---------------------------------------------------------------------------
+void stepper_ramp_default(struct stepper_ramp_struc *ramp)
+{
+  ramp->rp_profile = STEPPER_RAMP_TRAPEZOID;
+  ramp->rp_start_freq = 400;
+  ramp->rp_max_freq = 3200;
+  ramp->rp_accel = 8000;
+  ramp->rp_frames = 8;
+}
+
+// ---------------------------------------------------------------------------
+// rate at time t into a ramp lasting ramp_s from v0 to v1
+double stepper_ramp_rate(const struct stepper_ramp_struc *ramp, double v0, double v1, double t, double ramp_s)
+{
+  if (ramp->rp_profile == STEPPER_RAMP_SCURVE) return v0 + (v1 - v0) * 0.5 * (1.0 - cos(M_PI * t / ramp_s));
+
+  return v0 + (v1 - v0) * t / ramp_s;
+}
+
+// ---------------------------------------------------------------------------
+// appends frames of a ramped move to plan, last frame gets index; returns 0 or
+// negative error
+int stepper_ramp_build(const struct stepper_ramp_struc *ramp, int steps, int micro_step_flag, int index,
+  struct stepper_plan_struc *plan, long long overhead_us)
+{
+  int up[64];
+  int freq[64];
+  int frames = ramp->rp_frames;
+  int distance = abs(steps);
+  int sign = (steps < 0) ? -1 : 1;
+  int position;
+  int ramp_steps = 0;
+  int cruise;
+  int pulses;
+  double v0 = ramp->rp_start_freq;
+  double v1 = ramp->rp_max_freq;
+  double ramp_s;
+  double dt;
+  double rate;
+  double scale;
+  int k;
+
+  if ((ramp->rp_start_freq < STEPPER_MIN_FREQ) || (ramp->rp_max_freq < ramp->rp_start_freq) || (ramp->rp_accel <= 0) || (frames < 1))
+  {
+    fprintf(stderr, "**Error**: stepper_ramp_build: Invalid ramp parameters\n");
+    return -1;
+  }
+  if (frames > 64) frames = 64;
+
+  position = (plan->p_count > 0) ? plan->p_moves[plan->p_count - 1].position : plan->p_start;
+
+  // peak rate: full speed if both ramps fit, else where they meet
+  if (ramp->rp_profile == STEPPER_RAMP_SCURVE)
+  {
+    if ((v1 * v1 - v0 * v0) * M_PI / (2 * ramp->rp_accel) > distance) v1 = sqrt(v0 * v0 + 2 * ramp->rp_accel * distance / M_PI);
+    ramp_s = M_PI / 2 * (v1 - v0) / ramp->rp_accel;
+  } else
+  {
+    if ((v1 * v1 - v0 * v0) / ramp->rp_accel > distance) v1 = sqrt(v0 * v0 + ramp->rp_accel * distance);
+    ramp_s = (v1 - v0) / ramp->rp_accel;
+  }
+
+  // nothing to ramp, or too short to split
+  if ((v1 - v0 < 1.0) || (distance < 2 * frames))
+  {
+    plan->p_travel += distance;
+    while (distance > 0)
+    {
+      pulses = (distance > STEPPER_MAX_STEPS) ? STEPPER_MAX_STEPS : distance;
+      distance -= pulses;
+      position += sign * pulses;
+      if (stepper_plan_add(plan, (distance == 0) ? index : -1, position, sign * pulses, micro_step_flag,
+        ramp->rp_start_freq, overhead_us) < 0) return -2;
+    }
+    return 0;
+  }
+
+  // each frame runs at ramp's rate at the start of its time slice, so the
+  // first frame and its mirror at the end go at rp_start_freq
+  dt = ramp_s / frames;
+  for (k = 0; k < frames; k++)
+  {
+    rate = stepper_ramp_rate(ramp, v0, v1, k * dt, ramp_s);
+    freq[k] = (int)(rate + 0.5);
+    up[k] = (int)(rate * dt + 0.5);
+    if (up[k] < 1) up[k] = 1;
+    ramp_steps += up[k];
+  }
+
+  // rounding may overshoot half the distance on triangular profiles
+  if (2 * ramp_steps > distance)
+  {
+    scale = (double)(distance / 2) / ramp_steps;
+    ramp_steps = 0;
+    for (k = 0; k < frames; k++)
+    {
+      up[k] = (int)(up[k] * scale);
+      if (up[k] < 1) up[k] = 1;
+      ramp_steps += up[k];
+    }
+  }
+  cruise = distance - 2 * ramp_steps;
+
+  for (k = 0; k < frames; k++)
+  {
+    position += sign * up[k];
+    if (stepper_plan_add(plan, -1, position, sign * up[k], micro_step_flag, freq[k], overhead_us) < 0) return -2;
+  }
+
+  while (cruise > 0)
+  {
+    pulses = (cruise > STEPPER_MAX_STEPS) ? STEPPER_MAX_STEPS : cruise;
+    cruise -= pulses;
+    position += sign * pulses;
+    if (stepper_plan_add(plan, -1, position, sign * pulses, micro_step_flag, (int)(v1 + 0.5), overhead_us) < 0) return -2;
+  }
+
+  for (k = frames - 1; k >= 0; k--)
+  {
+    position += sign * up[k];
+    if (stepper_plan_add(plan, (k == 0) ? index : -1, position, sign * up[k], micro_step_flag, freq[k], overhead_us) < 0) return -2;
+  }
+
+  plan->p_travel += distance;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Motor state: remembers where the motor is and what callers asked for. Moves
+// only accumulate a target, stepper_motor_flush sends the net difference, cut
+// into frames of at most STEPPER_MAX_STEPS. Requests that cancel out cost no
+// command at all. If a frame may have run but was not confirmed, position is
+// marked unknown and further moves are refused until stepper_motor_set_position.
+#define STEPPER_MOTOR_POSITION_MAX (0x3FFFFFFF) // keeps target arithmetic in int
+
+struct stepper_motor_struc
+{
+  int mt_fd;
+  int mt_position;      // confirmed, steps
+  int mt_target;        // where pending requests lead
+  int mt_known;         // mt_position can be trusted
+  int mt_min_position;  // soft travel limits
+  int mt_max_position;
+  int mt_micro_step_flag;
+  int mt_stepper_freq;
+
+  // statistics
+  long mt_requests;
+  long mt_commands;
+};
+
+// ---------------------------------------------------------------------------
+void stepper_motor_init(struct stepper_motor_struc *motor, int dev_fd, int position)
+{
+  memset(motor, 0, sizeof(struct stepper_motor_struc));
+  motor->mt_fd = dev_fd;
+  motor->mt_position = position;
+  motor->mt_target = position;
+  motor->mt_known = 1;
+  motor->mt_min_position = -STEPPER_MOTOR_POSITION_MAX;
+  motor->mt_max_position = STEPPER_MOTOR_POSITION_MAX;
+  motor->mt_stepper_freq = 3200;
+}
+
+// ---------------------------------------------------------------------------
+// after homing or manual check; drops pending requests
+void stepper_motor_set_position(struct stepper_motor_struc *motor, int position)
+{
+  motor->mt_position = position;
+  motor->mt_target = position;
+  motor->mt_known = 1;
+}
+
+// ---------------------------------------------------------------------------
+int stepper_motor_set_speed(struct stepper_motor_struc *motor, int stepper_freq, int micro_step_flag)
+{
+  if (stepper_check_move("stepper_motor_set_speed", 0, stepper_freq) < 0) return STEPPER_MOVE_RANGE;
+
+  motor->mt_stepper_freq = stepper_freq;
+  motor->mt_micro_step_flag = micro_step_flag;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// absolute request, nothing is sent until stepper_motor_flush
+int stepper_motor_goto(struct stepper_motor_struc *motor, int position)
+{
+  if (! motor->mt_known)
+  {
+    fprintf(stderr, "**Error**: stepper_motor_goto: Motor position is unknown\n");
+    return STEPPER_MOVE_RANGE;
+  }
+
+  if ((position < motor->mt_min_position) || (position > motor->mt_max_position))
+  {
+    fprintf(stderr, "**Error**: stepper_motor_goto: Position %d is outside [%d, %d]\n",
+      position, motor->mt_min_position, motor->mt_max_position);
+    return STEPPER_MOVE_RANGE;
+  }
+
+  motor->mt_target = position;
+  motor->mt_requests ++;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// relative request, adds to whatever is pending
+int stepper_motor_move(struct stepper_motor_struc *motor, int steps)
+{
+  long long position = (long long)motor->mt_target + steps;
+
+  if ((position < -STEPPER_MOTOR_POSITION_MAX) || (position > STEPPER_MOTOR_POSITION_MAX))
+  {
+    fprintf(stderr, "**Error**: stepper_motor_move: Move of %d steps overflows position\n", steps);
+    return STEPPER_MOVE_RANGE;
+  }
+
+  return stepper_motor_goto(motor, (int)position);
+}
+
+// ---------------------------------------------------------------------------
+// prepares next frame towards target, returns 0 if motor is there already
+int stepper_motor_next_frame(struct stepper_motor_struc *motor, struct stepper_protocol_struc *proto)
+{
+  int steps;
+
+  if (motor->mt_position == motor->mt_target) return 0;
+
+  steps = motor->mt_target - motor->mt_position;
+  if (steps > STEPPER_MAX_STEPS) steps = STEPPER_MAX_STEPS;
+  if (steps < -STEPPER_MAX_STEPS) steps = -STEPPER_MAX_STEPS;
+
+  stepper_protocol_init(proto, steps, motor->mt_micro_step_flag, motor->mt_stepper_freq,
+    rs232_now_us() + stepper_move_budget_us(steps, motor->mt_micro_step_flag, motor->mt_stepper_freq));
+  motor->mt_commands ++;
+
+  return 1;
+}
+
+// ---------------------------------------------------------------------------
+// accounts finished frame; on failure pending requests are dropped
+int stepper_motor_frame_done(struct stepper_motor_struc *motor, struct stepper_protocol_struc *proto, const char *func)
+{
+  int steps;
+  int micro_step_flag;
+  int low_speed_flag;
+  double step_rate;
+
+  if (proto->p_result != STEPPER_MOVE_OK)
+  {
+    stepper_protocol_report(proto, func);
+    // once last byte went out controller may have taken the frame; whole
+    // frame mode writes it together with the first one
+    if ((proto->p_byte >= STEPPER_FRAME_SIZE - 1) || (proto->p_tx_mode == STEPPER_TX_FRAME) || proto->p_unconfirmed)
+      motor->mt_known = 0;
+    motor->mt_target = motor->mt_position;
+    return proto->p_result;
+  }
+
+  stepper_decode_frame(proto->p_frame, &steps, &micro_step_flag, &low_speed_flag, &step_rate);
+  motor->mt_position += steps;
+
+  return STEPPER_MOVE_OK;
+}
+
+// ---------------------------------------------------------------------------
+// sends pending net move; returns STEPPER_MOVE_OK or STEPPER_MOVE_* of the
+// frame that failed, mt_position tells how far it got
+int stepper_motor_flush(struct stepper_motor_struc *motor)
+{
+  struct stepper_protocol_struc proto;
+  int result;
+
+  if (! motor->mt_known)
+  {
+    fprintf(stderr, "**Error**: stepper_motor_flush: Motor position is unknown\n");
+    return STEPPER_MOVE_RANGE;
+  }
+
+  while (stepper_motor_next_frame(motor, &proto))
+  {
+    stepper_protocol_run(&proto, motor->mt_fd);
+
+    result = stepper_motor_frame_done(motor, &proto, "stepper_motor_flush");
+    if (result < 0) return result;
+  }
+
+  return STEPPER_MOVE_OK;
+}
+
+// ---------------------------------------------------------------------------
+// moves to calibrated wavelength and waits until motion ended
+int stepper_goto_wavelength(struct stepper_motor_struc *motor, struct wl_cal_context_struc *wl_cal_context, double wavelength)
+{
+  int step;
+  int result;
+
+  result = wl_cal_wl2step(wl_cal_context, wavelength, &step);
+  if (result < 0) return result;
+
+  result = stepper_motor_goto(motor, step);
+  if (result < 0) return result;
+
+  return stepper_motor_flush(motor);
+}
+
+
+#ifdef __unix__
+// ---------------------------------------------------------------------------
+// Several controllers from one thread: every axis is a motor on its own port,
+// one epoll set waits on all of them and each axis runs its frame protocol
+// whenever its port has data or its deadline passed. Axes move concurrently,
+// a scan step takes as long as the slowest axis instead of the sum. Ports are
+// one shot and rearmed only while their axis works, so an idle or hung up
+// port cannot keep the loop spinning.
+#define STEPPER_MUX_AXES (16)
+
+struct stepper_mux_axis_struc
+{
+  struct stepper_motor_struc *ax_motor;
+  struct stepper_protocol_struc ax_proto;
+  int ax_active;   // frame in progress
+  int ax_ready;    // port has data
+  int ax_armed;    // port is in epoll set, one shot
+  int ax_result;   // STEPPER_MOVE_* of last stepper_mux_run
+  long long ax_deadline_us; // next timeout of active frame
+};
+
+struct stepper_mux_struc
+{
+  int x_epoll_fd;
+  int x_count;
+  struct stepper_mux_axis_struc x_axes[STEPPER_MUX_AXES];
+};
+
+// ---------------------------------------------------------------------------
+int stepper_mux_init(struct stepper_mux_struc *mux)
+{
+  memset(mux, 0, sizeof(struct stepper_mux_struc));
+
+  mux->x_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (mux->x_epoll_fd < 0)
+  {
+    fprintf(stderr, "**Error**: stepper_mux_init: epoll_create1 failed with error %d, \"%s\"\n", errno, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+void stepper_mux_free(struct stepper_mux_struc *mux)
+{
+  if (mux->x_epoll_fd >= 0) close(mux->x_epoll_fd);
+  mux->x_epoll_fd = -1;
+  mux->x_count = 0;
+}
+
+// ---------------------------------------------------------------------------
+// returns axis number or negative error; motor must outlive the mux
+int stepper_mux_add(struct stepper_mux_struc *mux, struct stepper_motor_struc *motor)
+{
+  struct epoll_event event;
+
+  if (mux->x_count == STEPPER_MUX_AXES)
+  {
+    fprintf(stderr, "**Error**: stepper_mux_add: Too many axes\n");
+    return -1;
+  }
+
+  // registered disarmed, stepper_mux_run arms it
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLONESHOT;
+  event.data.u32 = mux->x_count;
+  if (epoll_ctl(mux->x_epoll_fd, EPOLL_CTL_ADD, motor->mt_fd, &event) < 0)
+  {
+    fprintf(stderr, "**Error**: stepper_mux_add: epoll_ctl failed with error %d, \"%s\"\n", errno, strerror(errno));
+    return -2;
+  }
+
+  memset(&mux->x_axes[mux->x_count], 0, sizeof(struct stepper_mux_axis_struc));
+  mux->x_axes[mux->x_count].ax_motor = motor;
+
+  return mux->x_count ++;
+}
+
+// ---------------------------------------------------------------------------
+int stepper_mux_arm(struct stepper_mux_struc *mux, int index)
+{
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.u32 = index;
+  if (epoll_ctl(mux->x_epoll_fd, EPOLL_CTL_MOD, mux->x_axes[index].ax_motor->mt_fd, &event) < 0)
+  {
+    fprintf(stderr, "**Error**: stepper_mux_arm: epoll_ctl failed with error %d, \"%s\"\n", errno, strerror(errno));
+    return -1;
+  }
+
+  mux->x_axes[index].ax_armed = 1;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// lets axis handle its port without blocking, starts its next frame when one
+// finished; returns 1 while axis still has work
+int stepper_mux_service(struct stepper_mux_axis_struc *axis)
+{
+  struct stepper_motor_struc *motor = axis->ax_motor;
+  unsigned char buffer[64];
+
+  axis->ax_ready = 0;
+
+  for (;;)
+  {
+    if (! axis->ax_active)
+    {
+      if ((axis->ax_result < 0) || (! stepper_motor_next_frame(motor, &axis->ax_proto)))
+      {
+        // idle port must not keep epoll awake with stray bytes
+        while (rs232_read_deadline(motor->mt_fd, buffer, sizeof(buffer), 0) == sizeof(buffer)) {}
+        return 0;
+      }
+      axis->ax_active = 1;
+    }
+
+    if (! stepper_protocol_advance(&axis->ax_proto, motor->mt_fd, 0, 0))
+    {
+      axis->ax_deadline_us = axis->ax_proto.p_state_deadline_us;
+      if (axis->ax_proto.p_deadline_us < axis->ax_deadline_us) axis->ax_deadline_us = axis->ax_proto.p_deadline_us;
+      return 1;
+    }
+
+    axis->ax_active = 0;
+    axis->ax_result = stepper_motor_frame_done(motor, &axis->ax_proto, "stepper_mux_run");
+  }
+}
+
+// ---------------------------------------------------------------------------
+// sends pending moves of all axes at once and waits until every axis is done;
+// returns number of failed axes, ax_result tells which
+int stepper_mux_run(struct stepper_mux_struc *mux)
+{
+  struct epoll_event events[STEPPER_MUX_AXES];
+  struct stepper_mux_axis_struc *axis;
+  long long now_us;
+  long long deadline_us;
+  long long remaining_us;
+  int busy;
+  int failed = 0;
+  int result;
+  int i;
+
+  for (i = 0; i < mux->x_count; i++)
+  {
+    mux->x_axes[i].ax_result = STEPPER_MOVE_OK;
+    mux->x_axes[i].ax_ready = 1; // first turn starts every axis
+    if (! mux->x_axes[i].ax_motor->mt_known)
+    {
+      fprintf(stderr, "**Error**: stepper_mux_run: Position of axis %d is unknown\n", i);
+      mux->x_axes[i].ax_result = STEPPER_MOVE_RANGE;
+    }
+  }
+
+  for (;;)
+  {
+    // progress axes that got data or timed out, then sleep until next of both
+    busy = 0;
+    deadline_us = 0;
+    now_us = rs232_now_us();
+    for (i = 0; i < mux->x_count; i++)
+    {
+      axis = &mux->x_axes[i];
+      if (axis->ax_ready || (axis->ax_active && (now_us >= axis->ax_deadline_us)))
+      {
+        if (! stepper_mux_service(axis)) continue;
+      } else
+      {
+        if (! axis->ax_active) continue;
+      }
+
+      busy ++;
+      if ((! axis->ax_armed) && (stepper_mux_arm(mux, i) < 0)) return -1;
+      if ((deadline_us == 0) || (axis->ax_deadline_us < deadline_us)) deadline_us = axis->ax_deadline_us;
+    }
+    if (busy == 0) break;
+
+    remaining_us = deadline_us - rs232_now_us();
+    if (remaining_us < 0) remaining_us = 0;
+
+    result = epoll_wait(mux->x_epoll_fd, events, STEPPER_MUX_AXES, (int)((remaining_us + 999) / 1000));
+    if ((result < 0) && (errno != EINTR))
+    {
+      fprintf(stderr, "**Error**: stepper_mux_run: epoll_wait failed with error %d, \"%s\"\n", errno, strerror(errno));
+      return -1;
+    }
+
+    for (i = 0; i < result; i++)
+    {
+      mux->x_axes[events[i].data.u32].ax_ready = 1;
+      mux->x_axes[events[i].data.u32].ax_armed = 0;
+    }
+  }
+
+  for (i = 0; i < mux->x_count; i++)
+  {
+    if (mux->x_axes[i].ax_result < 0) failed ++;
+  }
+
+  return failed;
+}
+#endif // __unix__
+
+
+// ---------------------------------------------------------------------------
+// Motion queue: callers push many moves, stepper_queue_run keeps the line busy.
+// Next frame goes out the moment the previous frame's last ack (or, with
+// q_max_in_flight of 1, its completion byte) arrives, there are no sleeps.
+// Firmware that buffers commands can take q_max_in_flight > 1, completion bytes
+// then must be STEPPER_DONE_BYTE to be told apart from acks.
+// A lost ack is handled like stepper_protocol does: the line stays silent for
+// the resync gap plus backoff, replies arriving meanwhile are drained, and the
+// frame is sent again up to STEPPER_RETRY_LIMIT times. Frames whose last byte
+// (or whole frame mode) went out are never resent, they count as executing.
+#define STEPPER_QUEUE_SIZE            (256)
+#define STEPPER_QUEUE_DONE_TIMEOUT_US (STEPPER_DONE_TIMEOUT_US) // beyond computed move end
+
+struct stepper_completion_struc
+{
+  long id;
+  int status;           // STEPPER_MOVE_*
+  int steps;
+  long long submit_us;  // rs232_now_us timestamps
+  long long start_us;   // first byte written
+  long long acked_us;   // last ack received
+  long long done_us;    // completion byte received
+};
+
+typedef void (*stepper_callback_t)(struct stepper_completion_struc *completion, void *user);
+
+struct stepper_move_request_struc
+{
+  long id;
+  int steps;
+  int micro_step_flag;
+  int stepper_freq;
+  long long duration_us; // computed motion time
+  int retries;           // frame resent after lost ack
+  int unconfirmed;       // taken as executing without its last ack
+  stepper_callback_t callback;
+  void *user;
+  struct stepper_completion_struc completion;
+};
+
+struct stepper_queue_struc
+{
+  int q_fd;
+  int q_max_in_flight;
+  long long q_done_timeout_us;
+  long long q_last_done_us; // previous move finished, next one's motion starts
+  long q_next_id;
+
+  // requests [q_head, q_head + q_count), of which first q_in_flight are fully sent
+  struct stepper_move_request_struc q_requests[STEPPER_QUEUE_SIZE];
+  int q_head;
+  int q_count;
+  int q_in_flight;
+
+  // frame being sent, index into q_requests or -1
+  int q_tx_request;
+  unsigned char q_tx_frame[STEPPER_FRAME_SIZE];
+  int q_tx_byte;            // byte waiting for its ack
+  int q_tx_mode;            // STEPPER_TX_* of frame being sent
+  long long q_tx_sent_us;   // byte waiting for ack went out
+  long long q_tx_deadline_us;
+  long long q_resync_until_us; // no frame starts before, line settles after lost ack
+  int q_hold;                  // no frame starts at all, sent ones still finish
+
+  // finished moves, oldest dropped when consumer falls behind
+  struct stepper_completion_struc q_completions[STEPPER_QUEUE_SIZE];
+  int q_c_head;
+  int q_c_count;
+  long q_c_dropped;
+
+  long q_garbage_bytes;
+};
+
+// ---------------------------------------------------------------------------
+int stepper_queue_init(struct stepper_queue_struc *queue, int dev_fd, int max_in_flight)
+{
+  memset(queue, 0, sizeof(struct stepper_queue_struc));
+
+  queue->q_fd = dev_fd;
+  queue->q_max_in_flight = (max_in_flight < 1) ? 1 : max_in_flight;
+  queue->q_done_timeout_us = STEPPER_QUEUE_DONE_TIMEOUT_US;
+  queue->q_next_id = 1;
+  queue->q_tx_request = -1;
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// returns move id, or negative if queue is full; callback may be NULL
+long stepper_queue_push(struct stepper_queue_struc *queue, int steps, int micro_step_flag, int stepper_freq,
+  stepper_callback_t callback, void *user)
+{
+  struct stepper_move_request_struc *request;
+
+  if (queue->q_count == STEPPER_QUEUE_SIZE)
+  {
+    fprintf(stderr, "**Error**: stepper_queue_push: Motion queue is full\n");
+    return -1;
+  }
+
+  if (stepper_check_move("stepper_queue_push", steps, stepper_freq) < 0) return -2;
+
+  request = &queue->q_requests[(queue->q_head + queue->q_count) % STEPPER_QUEUE_SIZE];
+  memset(request, 0, sizeof(struct stepper_move_request_struc));
+  request->id = queue->q_next_id ++;
+  request->steps = steps;
+  request->micro_step_flag = micro_step_flag;
+  request->stepper_freq = stepper_freq;
+  request->duration_us = (long long)(stepper_move_duration_us(steps, micro_step_flag, stepper_freq) * (1.0 + STEPPER_DURATION_SLACK));
+  request->callback = callback;
+  request->user = user;
+  request->completion.id = request->id;
+  request->completion.steps = steps;
+  request->completion.submit_us = rs232_now_us();
+
+  queue->q_count ++;
+
+  return request->id;
+}
+
+// ---------------------------------------------------------------------------
+// takes oldest finished move, returns 1 if there was one
+int stepper_queue_pop_completion(struct stepper_queue_struc *queue, struct stepper_completion_struc *completion)
+{
+  if (queue->q_c_count == 0) return 0;
+
+  *completion = queue->q_completions[queue->q_c_head];
+  queue->q_c_head = (queue->q_c_head + 1) % STEPPER_QUEUE_SIZE;
+  queue->q_c_count --;
+
+  return 1;
+}
+
+// ---------------------------------------------------------------------------
+// retires oldest request with given status
+void stepper_queue_complete(struct stepper_queue_struc *queue, int status)
+{
+  struct stepper_move_request_struc *request = &queue->q_requests[queue->q_head];
+
+  request->completion.status = status;
+  request->completion.done_us = rs232_now_us();
+  queue->q_last_done_us = request->completion.done_us;
+
+  if ((status == STEPPER_MOVE_OK) && HINT_LOAD(&rs232_stats_enabled))
+    rs232_stats_record(queue->q_fd, RS232_STAT_MOVE, request->completion.done_us - request->completion.start_us);
+
+  if (queue->q_c_count == STEPPER_QUEUE_SIZE)
+  {
+    queue->q_c_head = (queue->q_c_head + 1) % STEPPER_QUEUE_SIZE;
+    queue->q_c_count --;
+    queue->q_c_dropped ++;
+  }
+  queue->q_completions[(queue->q_c_head + queue->q_c_count) % STEPPER_QUEUE_SIZE] = request->completion;
+  queue->q_c_count ++;
+
+  queue->q_head = (queue->q_head + 1) % STEPPER_QUEUE_SIZE;
+  queue->q_count --;
+  if (queue->q_in_flight > 0) queue->q_in_flight --;
+
+  if (request->callback != NULL) request->callback(&request->completion, request->user);
+}
+
+// ---------------------------------------------------------------------------
+// controller runs accepted moves back to back, oldest one began when it was
+// acked or when the one before it finished
+long long stepper_queue_motion_start_us(struct stepper_queue_struc *queue)
+{
+  struct stepper_move_request_struc *request = &queue->q_requests[queue->q_head];
+
+  return (request->completion.acked_us > queue->q_last_done_us) ? request->completion.acked_us : queue->q_last_done_us;
+}
+
+// ---------------------------------------------------------------------------
+// oldest move cannot be over before its computed motion time without slack
+long long stepper_queue_earliest_done_us(struct stepper_queue_struc *queue)
+{
+  struct stepper_move_request_struc *request = &queue->q_requests[queue->q_head];
+
+  return stepper_queue_motion_start_us(queue) +
+    (long long)(request->duration_us * (1.0 - STEPPER_DURATION_SLACK) / (1.0 + STEPPER_DURATION_SLACK));
+}
+
+// ---------------------------------------------------------------------------
+int stepper_queue_send_byte(struct stepper_queue_struc *queue)
+{
+  // whole frame mode sends everything on first call, later calls only rearm
+  if (queue->q_tx_mode == STEPPER_TX_FRAME)
+  {
+    if ((queue->q_tx_byte == 0) && (rs232_write_all(queue->q_fd, queue->q_tx_frame, STEPPER_FRAME_SIZE) < 0)) return -1;
+  } else
+  {
+    if (rs232_write_all(queue->q_fd, &queue->q_tx_frame[queue->q_tx_byte], 1) < 0) return -1;
+  }
+
+  queue->q_tx_sent_us = rs232_now_us();
+  queue->q_tx_deadline_us = queue->q_tx_sent_us + STEPPER_ACK_TIMEOUT_US;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// one turn of the queue: starts a frame if possible, waits for the device (or
+// wake_fd, if not negative, becoming readable) and handles what arrived.
+// Queue must not be empty. Returns number of moves failed in this turn or
+// negative on device error; failed moves are reported with their status
+int stepper_queue_step(struct stepper_queue_struc *queue, int wake_fd)
+{
+  struct stepper_move_request_struc *request;
+  struct pollfd pfd[2];
+  unsigned char buffer[64];
+  long long deadline_us;
+  long long done_deadline_us;
+  long long remaining_us;
+  long long backoff_us;
+  long long now_us;
+  int failed = 0;
+  int result;
+  int i;
+
+  // start next frame if line is idle, settled and window allows
+  if ((queue->q_tx_request < 0) && (queue->q_in_flight < queue->q_count) && (queue->q_in_flight < queue->q_max_in_flight) &&
+    (! queue->q_hold) && (rs232_now_us() >= queue->q_resync_until_us))
+  {
+    queue->q_tx_request = (queue->q_head + queue->q_in_flight) % STEPPER_QUEUE_SIZE;
+    request = &queue->q_requests[queue->q_tx_request];
+    stepper_encode_frame(queue->q_tx_frame, request->steps, request->micro_step_flag, request->stepper_freq);
+    queue->q_tx_byte = 0;
+    queue->q_tx_mode = HINT_LOAD(&stepper_tx_mode);
+    if (request->retries == 0) request->completion.start_us = rs232_now_us();
+    if (stepper_queue_send_byte(queue) < 0) return -1;
+  }
+
+  // oldest sent move has to finish within done timeout after its computed end
+  done_deadline_us = 0;
+  if (queue->q_in_flight > 0)
+  {
+    request = &queue->q_requests[queue->q_head];
+    done_deadline_us = stepper_queue_motion_start_us(queue) + request->duration_us + queue->q_done_timeout_us;
+  }
+  if (queue->q_tx_request >= 0) deadline_us = queue->q_tx_deadline_us; else
+  if (rs232_now_us() < queue->q_resync_until_us) deadline_us = queue->q_resync_until_us; else
+    deadline_us = done_deadline_us;
+  if ((queue->q_in_flight > 0) && (done_deadline_us < deadline_us)) deadline_us = done_deadline_us;
+
+  // replies a line read buffered already are invisible to poll
+  if (rs232_reader_pending(queue->q_fd) > 0)
+  {
+    result = 1;
+  } else
+  if (wake_fd < 0)
+  {
+    result = rs232_wait_readable(queue->q_fd, deadline_us);
+    if (result < 0) return -2;
+  } else
+  {
+    remaining_us = deadline_us - rs232_now_us();
+    if (remaining_us < 0) remaining_us = 0;
+
+    pfd[0].fd = queue->q_fd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = wake_fd;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    result = poll(pfd, 2, (int)((remaining_us + 999) / 1000));
+    if (result < 0)
+    {
+      if (errno == EINTR) return 0;
+      fprintf(stderr, "**Error**: stepper_queue_step: poll failed with error %d, \"%s\"\n", errno, strerror(errno));
+      return -2;
+    }
+
+    // somebody wants the loop, device has nothing yet
+    if ((result > 0) && (! (pfd[0].revents & (POLLIN | POLLERR | POLLHUP)))) return 0;
+  }
+
+  if (result == 0)
+  {
+    now_us = rs232_now_us();
+    if ((queue->q_tx_request >= 0) && (now_us >= queue->q_tx_deadline_us))
+    {
+      request = &queue->q_requests[queue->q_tx_request];
+      fprintf(stderr, "**Error**: stepper_queue_step: No ack for byte %d of move %ld\n", queue->q_tx_byte, request->id);
+      queue->q_tx_request = -1;
+
+      backoff_us = (long long)STEPPER_RETRY_BACKOFF_US << request->retries;
+      if (backoff_us > STEPPER_RETRY_BACKOFF_MAX_US) backoff_us = STEPPER_RETRY_BACKOFF_MAX_US;
+      queue->q_resync_until_us = now_us + STEPPER_RESYNC_GAP_US + backoff_us;
+
+      // after last byte the controller may be executing, never send twice
+      if ((queue->q_tx_byte == STEPPER_FRAME_SIZE - 1) || (queue->q_tx_mode == STEPPER_TX_FRAME))
+      {
+        request->unconfirmed = 1;
+        request->completion.acked_us = now_us;
+        queue->q_in_flight ++;
+        return 0;
+      }
+
+      if (request->retries < STEPPER_RETRY_LIMIT)
+      {
+        request->retries ++;
+        return 0;
+      }
+
+      // line is lost, frames before the broken one cannot be confirmed either
+      while (queue->q_in_flight > 0)
+      {
+        stepper_queue_complete(queue, STEPPER_MOVE_DONE_TIMEOUT);
+        failed ++;
+      }
+      stepper_queue_complete(queue, STEPPER_MOVE_ACK_TIMEOUT);
+      failed ++;
+    } else
+    if ((queue->q_in_flight > 0) && (now_us >= done_deadline_us))
+    {
+      fprintf(stderr, "**Error**: stepper_queue_step: Move %ld did not complete in time\n", queue->q_requests[queue->q_head].id);
+      stepper_queue_complete(queue, queue->q_requests[queue->q_head].unconfirmed ? STEPPER_MOVE_ACK_TIMEOUT : STEPPER_MOVE_DONE_TIMEOUT);
+      failed ++;
+    }
+
+    // otherwise resync gap is over, next turn sends the frame
+    return failed;
+  }
+
+  result = rs232_read_deadline(queue->q_fd, buffer, sizeof(buffer), 0);
+  if (result < 0) return -3;
+
+  for (i = 0; i < result; i++)
+  {
+    if ((queue->q_tx_request >= 0) && (buffer[i] == STEPPER_ACK_BYTE))
+    {
+      if (HINT_LOAD(&rs232_stats_enabled)) rs232_stats_record(queue->q_fd, RS232_STAT_ACK, rs232_now_us() - queue->q_tx_sent_us);
+
+      queue->q_tx_byte ++;
+      if (queue->q_tx_byte < STEPPER_FRAME_SIZE)
+      {
+        if (stepper_queue_send_byte(queue) < 0) return -1;
+      } else
+      {
+        // frame accepted, it is executing now
+        queue->q_requests[queue->q_tx_request].completion.acked_us = rs232_now_us();
+        queue->q_tx_request = -1;
+        queue->q_in_flight ++;
+      }
+    } else
+    if ((queue->q_in_flight > 0) && (buffer[i] == STEPPER_DONE_BYTE))
+    {
+      stepper_queue_complete(queue, STEPPER_MOVE_OK);
+    } else
+    if ((queue->q_in_flight > 0) && (buffer[i] != STEPPER_ACK_BYTE) && (queue->q_max_in_flight == 1) &&
+      (queue->q_tx_request < 0) && (rs232_now_us() >= stepper_queue_earliest_done_us(queue)))
+    {
+      // controllers ending moves with another byte, only believed once motion could be over
+      stepper_queue_complete(queue, STEPPER_MOVE_OK);
+    } else
+    {
+      queue->q_garbage_bytes ++;
+    }
+  }
+
+  // line went idle after completion, next turn sends next frame immediately
+  return failed;
+}
+
+// ---------------------------------------------------------------------------
+// sends queued moves until queue is empty, returns number of failed moves
+// or negative on device error
+int stepper_queue_run(struct stepper_queue_struc *queue)
+{
+  int failed = 0;
+  int result;
+
+  while (queue->q_count > 0)
+  {
+    result = stepper_queue_step(queue, -1);
+    if (result < 0) return result;
+    failed += result;
+  }
+
+  return failed;
+}
+
+// ---------------------------------------------------------------------------
+// queues all moves of a plan as one batch, zero length moves are skipped;
+// returns number of frames queued or negative if queue has no room for all
+int stepper_plan_push(struct stepper_queue_struc *queue, const struct stepper_plan_struc *plan,
+  stepper_callback_t callback, void *user)
+{
+  size_t frames = 0;
+  size_t i;
+
+  for (i = 0; i < plan->p_count; i++)
+  {
+    if (plan->p_moves[i].steps != 0) frames ++;
+  }
+
+  if (queue->q_count + frames > STEPPER_QUEUE_SIZE)
+  {
+    fprintf(stderr, "**Error**: stepper_plan_push: Plan of %lu frames does not fit motion queue\n", (unsigned long)frames);
+    return -1;
+  }
+
+  for (i = 0; i < plan->p_count; i++)
+  {
+    if (plan->p_moves[i].steps == 0) continue;
+    if (stepper_queue_push(queue, plan->p_moves[i].steps, plan->p_moves[i].micro_step_flag, plan->p_moves[i].stepper_freq,
+      callback, user) < 0) return -2;
+  }
+
+  return (int)frames;
+}
+
+#ifdef __unix__
+// ---------------------------------------------------------------------------
+// Bounded lock free ring (D. Vyukov's scheme): every cell carries a sequence
+// number telling producers and consumers whose turn it is, so any number of
+// threads may push and pop without locks. Used as MPSC command ring and SPSC
+// completion ring of the driver below. Capacity must be a power of two.
+struct stepper_ring_struc
+{
+  unsigned long *r_sequence;
+  unsigned char *r_data;
+  size_t r_item_size;
+  unsigned long r_mask;
+
+  // producers and consumer write these, keep them on separate cache lines
+  unsigned long r_enqueue_pos __attribute__((aligned(64)));
+  unsigned long r_dequeue_pos __attribute__((aligned(64)));
+};
+
+// ---------------------------------------------------------------------------
+int stepper_ring_init(struct stepper_ring_struc *ring, unsigned long capacity, size_t item_size)
+{
+  unsigned long i;
+
+  memset(ring, 0, sizeof(struct stepper_ring_struc));
+  if ((capacity < 2) || (capacity & (capacity - 1)))
+  {
+    fprintf(stderr, "**Error**: stepper_ring_init: Capacity %lu is not a power of two\n", capacity);
+    return -1;
+  }
+
+  ring->r_sequence = (unsigned long *)malloc(capacity * sizeof(unsigned long));
+  ring->r_data = (unsigned char *)malloc(capacity * item_size);
+  if ((ring->r_sequence == NULL) || (ring->r_data == NULL))
+  {
+    fprintf(stderr, "**Error**: stepper_ring_init: Memory allocation failed\n");
+    free(ring->r_sequence);
+    free(ring->r_data);
+    ring->r_sequence = NULL;
+    ring->r_data = NULL;
+    return -2;
+  }
+
+  for (i = 0; i < capacity; i++) ring->r_sequence[i] = i;
+  ring->r_item_size = item_size;
+  ring->r_mask = capacity - 1;
+
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+void stepper_ring_free(struct stepper_ring_struc *ring)
+{
+  free(ring->r_sequence);
+  free(ring->r_data);
+  ring->r_sequence = NULL;
+  ring->r_data = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// returns 1 if item was stored, 0 if ring is full; never blocks
+int stepper_ring_push(struct stepper_ring_struc *ring, const void *item)
+{
+  unsigned long pos = __atomic_load_n(&ring->r_enqueue_pos, __ATOMIC_RELAXED);
+  unsigned long seq;
+  long diff;
+
+  for (;;)
+  {
+    seq = __atomic_load_n(&ring->r_sequence[pos & ring->r_mask], __ATOMIC_ACQUIRE);
+    diff = (long)seq - (long)pos;
+    if (diff == 0)
+    {
+      // cell is free, claim it
+      if (__atomic_compare_exchange_n(&ring->r_enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else
+    if (diff < 0)
+    {
+      return 0;
+    } else
+    {
+      pos = __atomic_load_n(&ring->r_enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  memcpy(ring->r_data + (pos & ring->r_mask) * ring->r_item_size, item, ring->r_item_size);
+  __atomic_store_n(&ring->r_sequence[pos & ring->r_mask], pos + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+// ---------------------------------------------------------------------------
+// returns 1 if item was taken, 0 if ring is empty; never blocks
+int stepper_ring_pop(struct stepper_ring_struc *ring, void *item)
+{
+  unsigned long pos = __atomic_load_n(&ring->r_dequeue_pos, __ATOMIC_RELAXED);
+  unsigned long seq;
+  long diff;
+
+  for (;;)
+  {
+    seq = __atomic_load_n(&ring->r_sequence[pos & ring->r_mask], __ATOMIC_ACQUIRE);
+    diff = (long)seq - (long)(pos + 1);
+    if (diff == 0)
+    {
+      if (__atomic_compare_exchange_n(&ring->r_dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else
+    if (diff < 0)
+    {
+      return 0;
+    } else
+    {
+      pos = __atomic_load_n(&ring->r_dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  memcpy(item, ring->r_data + (pos & ring->r_mask) * ring->r_item_size, ring->r_item_size);
+  // hand the cell back to producers one lap later
+  __atomic_store_n(&ring->r_sequence[pos & ring->r_mask], pos + ring->r_mask + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+
+// ---------------------------------------------------------------------------
+// Asynchronous driver: one thread owns the port and a stepper_queue, any thread
+// submits moves without locks and without touching the device. Submitting never
+// blocks, a full command ring is reported to the caller. Driver sleeps in poll
+// on the port and a wake eventfd, producers only write the eventfd when the
+// driver announced it is about to sleep. Finished moves land in completion ring
+// with their timestamps, d_done_fd becomes readable whenever one is added.
+#define STEPPER_DRIVER_COMMANDS    (256)  // power of two
+#define STEPPER_DRIVER_COMPLETIONS (1024) // power of two
+
+struct stepper_driver_command_struc
+{
+  long id;
+  int steps;
+  int micro_step_flag;
+  int stepper_freq;
+  long long submit_us;
+};
+
+struct stepper_driver_struc
+{
+  pthread_t d_thread;
+  int d_started;
+  struct stepper_queue_struc d_queue; // driver thread only
+
+  struct stepper_ring_struc d_commands;    // any thread -> driver
+  struct stepper_ring_struc d_completions; // driver -> one consumer
+
+  int d_wake_fd;   // eventfd, wakes driver
+  int d_done_fd;   // eventfd, counts completions added
+  int d_sleeping;  // driver is (about to be) in poll
+  int d_stop;
+  long d_next_id;
+
+  // statistics, written by driver thread
+  long d_submitted;
+  long d_completed;
+  long d_c_dropped;  // consumer fell behind, completions lost
+  long d_io_errors;
+};
 
-  curr_serial_port_settings.c_oflag = 0;
+// ---------------------------------------------------------------------------
+// moves finished moves from queue to completion ring
+void stepper_driver_flush(struct stepper_driver_struc *driver)
+{
+  struct stepper_completion_struc completion;
+  UINT64 count = 0;
 
-  curr_serial_port_settings.c_iflag = 0;
+  while (stepper_queue_pop_completion(&driver->d_queue, &completion))
+  {
+    if (stepper_ring_push(&driver->d_completions, &completion)) count ++;
+    else __atomic_add_fetch(&driver->d_c_dropped, 1, __ATOMIC_RELAXED);
+  }
 
-  curr_serial_port_settings.c_cflag |= (CREAD | CLOCAL);
-  curr_serial_port_settings.c_cflag &= ~(CSTOPB);
-  curr_serial_port_settings.c_cflag &= ~(CSIZE);
-  curr_serial_port_settings.c_cflag |= (PARENB | PARODD | CS8 );  // 8 bit, odd parity
-  curr_serial_port_settings.c_cflag &= ~(CRTSCTS);
+  if (count > 0)
+  {
+    __atomic_add_fetch(&driver->d_completed, (long)count, __ATOMIC_RELAXED);
+    if (write(driver->d_done_fd, &count, sizeof(count)) < 0) {}
+  }
+}
 
-  curr_serial_port_settings.c_cc[VMIN]  = 0;
-  curr_serial_port_settings.c_cc[VTIME] = 0;
+// ---------------------------------------------------------------------------
+// takes commands from ring into queue while queue has room
+void stepper_driver_accept(struct stepper_driver_struc *driver)
+{
+  struct stepper_driver_command_struc command;
+  struct stepper_move_request_struc *request;
 
-  result = tcsetattr(*dev_fd, TCSANOW, &curr_serial_port_settings);
-  if (result == -1)
+  while (driver->d_queue.q_count < STEPPER_QUEUE_SIZE)
   {
-    fprintf(stderr, "**Error**: rs232_open: Unable to set terminal settings (%s)\n", strerror(errno));
-    return -5;
+    if (! stepper_ring_pop(&driver->d_commands, &command)) break;
+
+    if (stepper_queue_push(&driver->d_queue, command.steps, command.micro_step_flag, command.stepper_freq, NULL, NULL) < 0) break;
+
+    // callers know moves by the id submit gave them, and submit time is theirs
+    request = &driver->d_queue.q_requests[(driver->d_queue.q_head + driver->d_queue.q_count - 1) % STEPPER_QUEUE_SIZE];
+    request->id = command.id;
+    request->completion.id = command.id;
+    request->completion.submit_us = command.submit_us;
+    __atomic_add_fetch(&driver->d_submitted, 1, __ATOMIC_RELAXED);
   }
+}
 
-  // discard old data in rx and tx buffer
-  result = tcflush(*dev_fd, TCIOFLUSH);
-  if (result == -1)
+// ---------------------------------------------------------------------------
+void *stepper_driver_thread(void *arg)
+{
+  struct stepper_driver_struc *driver = (struct stepper_driver_struc *)arg;
+  struct stepper_queue_struc *queue = &driver->d_queue;
+  struct pollfd pfd;
+  UINT64 value;
+  int result;
+
+  while (! __atomic_load_n(&driver->d_stop, __ATOMIC_ACQUIRE))
   {
-    fprintf(stderr, "**Error**: rs232_open: Unable to flush terminal (%s)\n", strerror(errno));
-    return -6;
+    stepper_driver_accept(driver);
+
+    // announce sleep, then look once more so no submit is missed
+    __atomic_store_n(&driver->d_sleeping, 1, __ATOMIC_SEQ_CST);
+    if ((__atomic_load_n(&driver->d_commands.r_enqueue_pos, __ATOMIC_SEQ_CST) !=
+      __atomic_load_n(&driver->d_commands.r_dequeue_pos, __ATOMIC_SEQ_CST)) &&
+      (queue->q_count < STEPPER_QUEUE_SIZE))
+    {
+      __atomic_store_n(&driver->d_sleeping, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (__atomic_load_n(&driver->d_stop, __ATOMIC_ACQUIRE)) break;
+
+    if (queue->q_count == 0)
+    {
+      pfd.fd = driver->d_wake_fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      result = poll(&pfd, 1, -1);
+    } else
+    {
+      result = stepper_queue_step(queue, driver->d_wake_fd);
+      if (result < 0)
+      {
+        // port is broken, fail everything queued, later submits will retry
+        driver->d_io_errors ++;
+        while (queue->q_count > 0) stepper_queue_complete(queue, STEPPER_MOVE_IO_ERROR);
+        queue->q_in_flight = 0;
+        queue->q_tx_request = -1;
+      }
+    }
+
+    __atomic_store_n(&driver->d_sleeping, 0, __ATOMIC_RELAXED);
+    if (read(driver->d_wake_fd, &value, sizeof(value)) < 0) {} // nonblocking, resets wakeups
+
+    stepper_driver_flush(driver);
   }
 
-  return 0;
+  // frames the controller accepted are executing, their done bytes (or done
+  // timeouts) are waited for; frame being sent is finished, nothing new starts
+  queue->q_hold = 1;
+  while ((queue->q_in_flight > 0) || (queue->q_tx_request >= 0))
+  {
+    if (stepper_queue_step(queue, -1) < 0)
+    {
+      driver->d_io_errors ++;
+      while (queue->q_in_flight > 0) stepper_queue_complete(queue, STEPPER_MOVE_IO_ERROR);
+      queue->q_tx_request = -1;
+    }
+    stepper_driver_flush(driver);
+  }
+
+  // rest never reached the controller
+  do
+  {
+    while (queue->q_count > 0) stepper_queue_complete(queue, STEPPER_MOVE_CANCELLED);
+    stepper_driver_flush(driver);
+    stepper_driver_accept(driver);
+  } while (queue->q_count > 0);
+
+  return NULL;
 }
 
 // ---------------------------------------------------------------------------
-int rs232_close(int *dev_fd)
+int stepper_driver_start(struct stepper_driver_struc *driver, int dev_fd, int max_in_flight)
 {
-  int result;
+  memset(driver, 0, sizeof(struct stepper_driver_struc));
+  driver->d_wake_fd = -1;
+  driver->d_done_fd = -1;
+  driver->d_next_id = 1;
 
-  result = tcsetattr(*dev_fd, TCSANOW, &orig_serial_port_settings);
-  if (result == -1)
+  stepper_queue_init(&driver->d_queue, dev_fd, max_in_flight);
+
+  if ((stepper_ring_init(&driver->d_commands, STEPPER_DRIVER_COMMANDS, sizeof(struct stepper_driver_command_struc)) < 0) ||
+    (stepper_ring_init(&driver->d_completions, STEPPER_DRIVER_COMPLETIONS, sizeof(struct stepper_completion_struc)) < 0))
   {
-    fprintf(stderr, "**Error**: rs232_close: unable to set terminal settings (%s)\n", strerror(errno));
+    stepper_ring_free(&driver->d_commands);
     return -1;
   }
 
-  // discard old data in rx and tx buffer
-  result = tcflush(*dev_fd, TCIOFLUSH);
-  if (result == -1)
+  driver->d_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  driver->d_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((driver->d_wake_fd < 0) || (driver->d_done_fd < 0))
   {
-    fprintf(stderr, "**Error**: rs232_close: Unable to flush terminal (%s)\n", strerror(errno));
-    return -2;
+    fprintf(stderr, "**Error**: stepper_driver_start: eventfd failed with error %d, \"%s\"\n", errno, strerror(errno));
+    goto fail;
   }
 
-  close(*dev_fd);
-  *dev_fd = 0;
+  if (pthread_create(&driver->d_thread, NULL, stepper_driver_thread, driver) != 0)
+  {
+    fprintf(stderr, "**Error**: stepper_driver_start: Could not start driver thread\n");
+    goto fail;
+  }
+  driver->d_started = 1;
 
   return 0;
+
+fail:
+  if (driver->d_wake_fd >= 0) close(driver->d_wake_fd);
+  if (driver->d_done_fd >= 0) close(driver->d_done_fd);
+  driver->d_wake_fd = -1;
+  driver->d_done_fd = -1;
+  stepper_ring_free(&driver->d_commands);
+  stepper_ring_free(&driver->d_completions);
+  return -2;
 }
 
+// ---------------------------------------------------------------------------
+void stepper_driver_wake(struct stepper_driver_struc *driver)
+{
+  UINT64 one = 1;
 
-/*
-// -------------------------------------------------------------------------
-int stepper_init(char *dev_file_name, int *dev_fd)
+  if (write(driver->d_wake_fd, &one, sizeof(one)) < 0) {}
+}
+
+// ---------------------------------------------------------------------------
+// safe from any thread; returns move id, -1 if command ring is full or -2 if
+// move does not fit a frame
+long stepper_driver_submit(struct stepper_driver_struc *driver, int steps, int micro_step_flag, int stepper_freq)
 {
-  int error;
-#ifdef SETUID
-  int old_uid, old_gid;
-  int uid_changed = 0;
-#endif // SETUID
-  struct termios old_dev_tio, new_dev_tio;
+  struct stepper_driver_command_struc command;
 
-  fd_set dev_read_fds;
-  struct timeval dev_tv;
+  if (stepper_check_move("stepper_driver_submit", steps, stepper_freq) < 0) return -2;
 
-  char *dev_cmd_read_request = (channel_number == 1) ? ":acq1:lmem?\n" : ":acq2:lmem?\n";
+  command.id = __atomic_fetch_add(&driver->d_next_id, 1, __ATOMIC_RELAXED);
+  command.steps = steps;
+  command.micro_step_flag = micro_step_flag;
+  command.stepper_freq = stepper_freq;
+  command.submit_us = rs232_now_us();
 
-  int dev_data_index = 0;
-  int dev_read_len;
+  if (! stepper_ring_push(&driver->d_commands, &command)) return -1;
 
-#ifdef SETUID
-  if ((dev_fd = open(dev_file_name, O_RDWR | O_NOCTTY)) < 0) // check if we have permissions
+  // pairs with the sleep announcement in stepper_driver_thread
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&driver->d_sleeping, __ATOMIC_SEQ_CST)) stepper_driver_wake(driver);
+
+  return command.id;
+}
+
+// ---------------------------------------------------------------------------
+// one consumer thread only; returns 1 if a finished move was taken
+int stepper_driver_poll_completion(struct stepper_driver_struc *driver, struct stepper_completion_struc *completion)
+{
+  return stepper_ring_pop(&driver->d_completions, completion);
+}
+
+// ---------------------------------------------------------------------------
+// waits for next finished move, returns 1 if taken, 0 on timeout, negative on
+// error; negative timeout waits forever
+int stepper_driver_wait_completion(struct stepper_driver_struc *driver, struct stepper_completion_struc *completion,
+  long long timeout_us)
+{
+  long long deadline_us = rs232_now_us() + timeout_us;
+  UINT64 value;
+  int result;
+
+  for (;;)
   {
-    old_uid = getuid(); old_gid = getgid();
-    if (setuid(0) || setgid(0))
+    if (stepper_ring_pop(&driver->d_completions, completion)) return 1;
+
+    if (timeout_us < 0)
     {
-      fprintf(stderr, "**Error**: You have no permissions to access \"%s\"\n"
-                      "           Setting UID and GID to root failed\n", dev_file_name);
-      return ERR_DEVICE_OPEN;
-    }
+      struct pollfd pfd;
 
-    uid_changed = 1;
-    // already root:wheel
-    if ((dev_fd = open(dev_file_name, O_RDWR | O_NOCTTY)) < 0)
+      pfd.fd = driver->d_done_fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      result = poll(&pfd, 1, -1);
+      if ((result < 0) && (errno != EINTR)) return -1;
+    } else
     {
-      fprintf(stderr, "**Error**: Error opening device \"%s\"\n", dev_file_name);
-      setuid(old_uid); setgid(old_gid);
-      return ERR_DEVICE_OPEN;
+      result = rs232_wait_readable(driver->d_done_fd, deadline_us);
+      if (result < 0) return -1;
+      if (result == 0) return stepper_ring_pop(&driver->d_completions, completion);
     }
-  }
-#else // SETUID
-  if ((dev_fd = open(dev_file_name, O_RDWR | O_NOCTTY)) < 0)
-  {
-    fprintf(stderr, "**Error**: Error opening device \"%s\"\n", dev_file_name);
-    return ERR_DEVICE_OPEN;
-  }
-#endif // SETUID
 
-  tcgetattr(dev_fd, &old_dev_tio);
-  bzero(&new_dev_tio, sizeof(new_dev_tio));
-  new_dev_tio.c_cflag = B19200 | CS8 | CLOCAL | CREAD;
-  new_dev_tio.c_iflag = IGNBRK | IXON | IXOFF;
-  new_dev_tio.c_oflag = 0;
-  new_dev_tio.c_lflag = 0;
-  new_dev_tio.c_cc[VTIME] = 5;
-  new_dev_tio.c_cc[VMIN] = 1;
-  new_dev_tio.c_ispeed = 13;
-  new_dev_tio.c_ospeed = 13;
-  tcflush(dev_fd, TCIFLUSH);
-  tcsetattr(dev_fd, TCSANOW, &new_dev_tio);
+    // counter is reset before the ring is looked at again, nothing gets lost
+    if (read(driver->d_done_fd, &value, sizeof(value)) < 0) {}
+  }
+}
 
-  write(dev_fd, dev_cmd_read_request, strlen(dev_cmd_read_request));
+// ---------------------------------------------------------------------------
+// stops driver thread; moves the controller already took are completed first,
+// moves never sent are reported as cancelled, all can still be collected until
+// stepper_driver_free
+void stepper_driver_stop(struct stepper_driver_struc *driver)
+{
+  if (! driver->d_started) return;
 
-  FD_ZERO(&dev_read_fds);
-  FD_SET(dev_fd, &dev_read_fds);
+  __atomic_store_n(&driver->d_stop, 1, __ATOMIC_RELEASE);
+  stepper_driver_wake(driver);
+  pthread_join(driver->d_thread, NULL);
+  driver->d_started = 0;
+}
 
-  while (1)
-  {
-    dev_tv.tv_sec = 0;
-    dev_tv.tv_usec = 200000;
-    error = select(dev_fd + 1, &dev_read_fds, NULL, NULL, &dev_tv);
-    switch(error)
-    {
-       case -1:
-         fprintf(stderr, "**Error**: Error reading from device: select() failed with errorcode %d\n", error);
-         close(dev_fd);
-         return ERR_DEVICE_READ;
-       case 0:
-         close(dev_fd);
-         gds_buffer_length = dev_data_index;
-#ifdef SETUID
-         if (uid_changed)  // reset uid/gid to create files belonging to current user but not root
-         {
-           setuid(old_uid);
-           setgid(old_gid);
-         }
-#endif
-         return 0;
-       default:
-         dev_read_len = read(dev_fd, gds_buffer + dev_data_index, GDS_BUFFER_LENGTH - dev_data_index);
-         dev_data_index += dev_read_len;
-    }
-  }
-  
+// ---------------------------------------------------------------------------
+void stepper_driver_free(struct stepper_driver_struc *driver)
+{
+  stepper_driver_stop(driver);
+
+  if (driver->d_wake_fd >= 0) close(driver->d_wake_fd);
+  if (driver->d_done_fd >= 0) close(driver->d_done_fd);
+  driver->d_wake_fd = -1;
+  driver->d_done_fd = -1;
+  stepper_ring_free(&driver->d_commands);
+  stepper_ring_free(&driver->d_completions);
 }
-*/
+#endif // __unix__
 
 
+#ifdef __unix__
+// ---------------------------------------------------------------------------
+// PLM002 controller simulator on a pseudo terminal. Clients open s_slave_name
+// with rs232_open like a real port. Every received byte is acknowledged with
+// STEPPER_ACK_BYTE after ack delay, complete frames are decoded and executed
+// one after another, STEPPER_DONE_BYTE is sent when each move is over.
+#define PLM002_SIM_QUEUE_SIZE     (64)    // frames accepted while motor is busy
+#define PLM002_SIM_FRAME_GAP_US   (STEPPER_RESYNC_GAP_US) // pause that starts a new frame
+
+struct plm002_sim_config_struc
+{
+  int ack_delay_us;      // controller reaction time for each byte
+  int ack_jitter_us;     // uniform random addition to ack delay
+  int done_delay_us;     // extra time between end of move and completion byte
+  double corrupt_rate;   // probability that ack byte is garbled
+  double drop_rate;      // probability that ack byte is not sent at all
+  int model_motion;      // nonzero: move lasts steps / step rate, otherwise completes at once
+  unsigned int seed;
+};
+
+struct plm002_sim_struc
+{
+  struct plm002_sim_config_struc s_config;
+  int s_master_fd;
+  int s_stop_pipe[2];
+  char s_slave_name[128];
+  pthread_t s_thread;
+
+  // controller state, owned by simulator thread
+  unsigned char s_frame[STEPPER_FRAME_SIZE];
+  int s_frame_bytes;
+  long long s_last_byte_us;
+  long long s_busy_until_us;
+  long long s_done_at_us[PLM002_SIM_QUEUE_SIZE]; // completion times of accepted moves
+  int s_done_head;
+  int s_done_count;
+  unsigned int s_random;
+
+  // statistics, read after plm002_sim_stop
+  long s_position;
+  long s_frames;
+  long s_bytes;
+  long s_corrupted;
+  long s_dropped;
+  long s_resyncs;
+  long s_overflows;
+};
 
 // ---------------------------------------------------------------------------
-int stepper_rotate(int dev_fd, int steps, int micro_step_flag, int stepper_freq)
+// uniform in [0, 1), xorshift, reproducible per seed
+double plm002_sim_random(struct plm002_sim_struc *sim)
 {
-  unsigned char data_buffer[5];
-  unsigned char responce[1];
-  int freq_word;
-  int result;
-  int i;
+  sim->s_random ^= sim->s_random << 13;
+  sim->s_random ^= sim->s_random >> 17;
+  sim->s_random ^= sim->s_random << 5;
+  return (sim->s_random & 0xFFFFFF) / (double)0x1000000;
+}
 
-  int failure;
+// ---------------------------------------------------------------------------
+void plm002_sim_send(struct plm002_sim_struc *sim, unsigned char byte)
+{
+  if (write(sim->s_master_fd, &byte, 1) != 1)
+  {
+    fprintf(stderr, "**Error**: plm002_sim_send: write failed with error %d, \"%s\"\n", errno, strerror(errno));
+  }
+}
 
-  for (i = 0; i < 5; i++)
+// ---------------------------------------------------------------------------
+void plm002_sim_on_byte(struct plm002_sim_struc *sim, unsigned char byte)
+{
+  int steps;
+  int micro_step_flag;
+  int low_speed_flag;
+  double step_rate;
+  long long now_us = rs232_now_us();
+  long long start_us;
+  long long duration_us;
+  int delay_us;
+
+  sim->s_bytes ++;
+
+  // host gave up on previous frame, start over
+  if ((sim->s_frame_bytes > 0) && (now_us - sim->s_last_byte_us > PLM002_SIM_FRAME_GAP_US))
   {
-    data_buffer[i] = 0;
+    sim->s_frame_bytes = 0;
+    sim->s_resyncs ++;
   }
-//  memset(data_buffer, 0, sizeof(data_buffer));
+  sim->s_last_byte_us = now_us;
+  sim->s_frame[sim->s_frame_bytes ++] = byte;
 
-  data_buffer[4] = (1 << 3); // -reset bit must always be equal to 1
+  delay_us = sim->s_config.ack_delay_us;
+  if (sim->s_config.ack_jitter_us > 0) delay_us += (int)(plm002_sim_random(sim) * sim->s_config.ack_jitter_us);
+  if (delay_us > 0) usleep(delay_us);
 
-  if (stepper_freq < 120)
+  if (plm002_sim_random(sim) < sim->s_config.drop_rate)
   {
-    freq_word = (0xFFFF - (STEPPER_SRC_FREQ) / (stepper_freq * 64));
-    data_buffer[4] |= (1 << 4); // set low speed bit
+    sim->s_dropped ++;
   } else
+  if (plm002_sim_random(sim) < sim->s_config.corrupt_rate)
   {
-    freq_word = (0xFFFF - (STEPPER_SRC_FREQ) / (stepper_freq * 1));
-    data_buffer[4] &= ~(1 << 4); // drop low speed bit
-  }
-
-  if (steps < 0)
-  {
-    data_buffer[4] |= (1 << 2); // negation sign
-    steps = -steps;
+    sim->s_corrupted ++;
+    plm002_sim_send(sim, (unsigned char)(STEPPER_ACK_BYTE ^ (1 + (int)(plm002_sim_random(sim) * 255))));
   } else
   {
-    data_buffer[4] &= ~(1 << 2); // positive
+    plm002_sim_send(sim, STEPPER_ACK_BYTE);
   }
 
-  if (micro_step_flag)
-  {
-    data_buffer[4] |= (1 << 0); // microstep enable
-  } else
+  if (sim->s_frame_bytes < STEPPER_FRAME_SIZE) return;
+
+  sim->s_frame_bytes = 0;
+  sim->s_frames ++;
+
+  if (sim->s_done_count == PLM002_SIM_QUEUE_SIZE)
   {
-    data_buffer[4] &= ~(1 << 0); // microstep disable
+    sim->s_overflows ++;
+    return;
   }
 
-  data_buffer[0] = (freq_word >> 8) & 0xFF;  // first high
-  data_buffer[1] = (freq_word >> 0) & 0xFF;  // then low
+  stepper_decode_frame(sim->s_frame, &steps, &micro_step_flag, &low_speed_flag, &step_rate);
 
-  data_buffer[2] = (steps >> 8) & 0xFF;  // first high
-  data_buffer[3] = (steps >> 0) & 0xFF;  // then low
+  // controller held in reset does not move
+  if (! (sim->s_frame[4] & STEPPER_CTRL_NRESET)) steps = 0;
 
+  sim->s_position += steps;
 
-  data_buffer[4] = 0xF;
-  // run until ready accepted message is received
+  duration_us = sim->s_config.model_motion ? (long long)(abs(steps) * 1e6 / step_rate) : 0;
+  start_us = (sim->s_busy_until_us > now_us) ? sim->s_busy_until_us : now_us;
+  sim->s_busy_until_us = start_us + duration_us;
 
-  // send char by char
+  sim->s_done_at_us[(sim->s_done_head + sim->s_done_count) % PLM002_SIM_QUEUE_SIZE] = sim->s_busy_until_us + sim->s_config.done_delay_us;
+  sim->s_done_count ++;
+}
 
-//  tcflush(dev_fd, TCIFLUSH);
+// ---------------------------------------------------------------------------
+void *plm002_sim_thread(void *arg)
+{
+  struct plm002_sim_struc *sim = (struct plm002_sim_struc *)arg;
+  struct pollfd pfd[2];
+  unsigned char buffer[64];
+  long long now_us;
+  int timeout_ms;
+  int result;
+  int i;
 
-  print_dump(data_buffer, 5);
+  pfd[0].fd = sim->s_master_fd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = sim->s_stop_pipe[0];
+  pfd[1].events = POLLIN;
 
-  do
+  for (;;)
   {
-    failure = 1;
+    // completions that are due
+    now_us = rs232_now_us();
+    while ((sim->s_done_count > 0) && (sim->s_done_at_us[sim->s_done_head] <= now_us))
+    {
+      plm002_sim_send(sim, STEPPER_DONE_BYTE);
+      sim->s_done_head = (sim->s_done_head + 1) % PLM002_SIM_QUEUE_SIZE;
+      sim->s_done_count --;
+    }
 
-    for (i = 0; i < 5; i++)
+    timeout_ms = -1;
+    if (sim->s_done_count > 0)
     {
-      result = write(dev_fd, &data_buffer[i], 1);
-      if (result < 0)
-      {
-        fprintf(stderr, "**Error**: stepper_rotate: write to device failed with error %d, \"%s\"\n", errno, strerror(errno));
-        return errno;
-      }
+      timeout_ms = (int)((sim->s_done_at_us[sim->s_done_head] - now_us + 999) / 1000);
+    }
 
-      usleep(10000);
+    pfd[0].revents = 0;
+    pfd[1].revents = 0;
+    result = poll(pfd, 2, timeout_ms);
+    if ((result < 0) && (errno != EINTR)) break;
+    if (pfd[1].revents) break;
 
-      responce[0] = 0;
-      result = read(dev_fd, responce, 1);
-      if (result < 0)
+    if (pfd[0].revents & POLLIN)
+    {
+      result = read(sim->s_master_fd, buffer, sizeof(buffer));
+      for (i = 0; i < result; i++)
       {
-        fprintf(stderr, "**Error**: stepper_rotate: read from device failed with error %d, \"%s\"\n", errno, strerror(errno));
-        return errno;
+        plm002_sim_on_byte(sim, buffer[i]);
       }
+    } else
+    if (pfd[0].revents & (POLLHUP | POLLERR))
+    {
+      // slave side closed, wait for reopen or stop
+      poll(&pfd[1], 1, 10);
+      if (pfd[1].revents) break;
+    }
+  }
 
-//      printf("Result [%d] is %x\n", i, (int)(responce & 0xFF));
-      printf("Result [%d] is %02x\n", i, responce[0]);
-
-/*
-      if (((int)(responce & 0xFF) != 0xFA)) // 
-      {
+  return NULL;
+}
 
-        usleep(10000);
+// ---------------------------------------------------------------------------
+int plm002_sim_start(struct plm002_sim_struc *sim, struct plm002_sim_config_struc *config)
+{
+  struct termios settings;
 
-        result = read(dev_fd, responce, 1);
-        if (result < 0)
-        {
-          fprintf(stderr, "**Error**: stepper_rotate: read from device failed with error %d, \"%s\"\n", errno, strerror(errno));
-          return errno;
-        }
+  memset(sim, 0, sizeof(struct plm002_sim_struc));
+  if (config != NULL) sim->s_config = *config;
+  sim->s_random = sim->s_config.seed ? sim->s_config.seed : 0x2545F491;
 
-        printf("Result 2 [%d] is %x\n", i, (int)(responce & 0xFF));
-      }
+  if ((sim->s_master_fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0)
+  {
+    fprintf(stderr, "**Error**: plm002_sim_start: posix_openpt failed with error %d, \"%s\"\n", errno, strerror(errno));
+    return -1;
+  }
 
-*/
+  if ((grantpt(sim->s_master_fd) != 0) || (unlockpt(sim->s_master_fd) != 0) ||
+    (ptsname_r(sim->s_master_fd, sim->s_slave_name, sizeof(sim->s_slave_name)) != 0))
+  {
+    fprintf(stderr, "**Error**: plm002_sim_start: Unable to set up pseudo terminal (%s)\n", strerror(errno));
+    close(sim->s_master_fd);
+    return -2;
+  }
 
-//      if (((int)(responce & 0xFF) != 0xFA)) // 
-/*
-      if (responce[0] != 0xFA) // 
-      {
-        failure ++;
-        break;
-      }
-*/
-    }
-  } while (failure);
+  // raw bytes on controller side too
+  if (tcgetattr(sim->s_master_fd, &settings) == 0)
+  {
+    cfmakeraw(&settings);
+    tcsetattr(sim->s_master_fd, TCSANOW, &settings);
+  }
 
-  usleep(100000);
+  if (pipe(sim->s_stop_pipe) != 0)
+  {
+    fprintf(stderr, "**Error**: plm002_sim_start: pipe failed with error %d, \"%s\"\n", errno, strerror(errno));
+    close(sim->s_master_fd);
+    return -3;
+  }
 
-  responce[0] = 0;
-  result = read(dev_fd, responce, 1);
-  if (result < 0)
+  if (pthread_create(&sim->s_thread, NULL, plm002_sim_thread, sim) != 0)
   {
-    fprintf(stderr, "**Error**: stepper_rotate: read from device failed with error %d, \"%s\"\n", errno, strerror(errno));
-    return errno;
+    fprintf(stderr, "**Error**: plm002_sim_start: Failed to start simulator thread\n");
+    close(sim->s_stop_pipe[0]);
+    close(sim->s_stop_pipe[1]);
+    close(sim->s_master_fd);
+    return -4;
   }
 
-  printf("Result end is %x\n", responce[0]);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+int plm002_sim_stop(struct plm002_sim_struc *sim)
+{
+  char byte = 0;
+
+  if (write(sim->s_stop_pipe[1], &byte, 1) != 1)
+  {
+    fprintf(stderr, "**Error**: plm002_sim_stop: Unable to signal simulator thread\n");
+  }
+  pthread_join(sim->s_thread, NULL);
 
+  close(sim->s_stop_pipe[0]);
+  close(sim->s_stop_pipe[1]);
+  close(sim->s_master_fd);
 
   return 0;
 }
+#endif // __unix__
 
 
+#ifndef STEPPER_NO_MAIN
 // ---------------------------------------------------------------------------
 int main(void)
 {
@@ -820,7 +6110,7 @@ int main(void)
   int step;
   struct wl_cal_context_struc *wl_cal_context;
 
-  int dev_fd;
+  struct rs232_port_struc port;
 
   printf("Stepper v. 0.1 (C) S.Ambrozevich, LPI\n");
 /*
@@ -838,23 +6128,25 @@ int main(void)
   if (result < 0) return result;
 */
 
-  result = rs232_open(&dev_fd, "/dev/ttyS2");
+  result = rs232_open(&port, "/dev/ttyS2");
   if (result < 0) return result;
 
+  rs232_trace_start(stdout, RS232_TRACE_DUMP);
+
   // int stepper_rotate(int dev_fd, int steps, int micro_step_flag, int stepper_freq);
-  result = stepper_rotate(dev_fd, 6400, 0, 3200);
+  result = stepper_rotate(port.pt_fd, 6400, 0, 3200);
+  rs232_trace_stop();
   if (result < 0) return result;
 
   //usleep(1000000);
 //
- // result = stepper_rotate(dev_fd, 5000, 0, 100);
+ // result = stepper_rotate(port.pt_fd, 5000, 0, 100);
  // if (result < 0) return result;
- // rs232_close(&dev_fd);
+ // rs232_close(&port);
 
 
 
   return 0;
 }
 
-
-
+#endif // STEPPER_NO_MAIN
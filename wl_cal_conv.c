@@ -0,0 +1,43 @@
+// Converts tab separated calibration table into binary table for instant loading
+//   wl_cal_conv <table.txt> <table.wlcb>
+
+#define STEPPER_NO_MAIN
+#include "try.c"
+
+// ---------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  int result;
+  struct wl_cal_context_struc *wl_cal_context;
+
+  if (argc != 3)
+  {
+    fprintf(stderr, "Usage: %s <table.txt> <table.wlcb>\n", argv[0]);
+    return 1;
+  }
+
+  result = wl_cal_allocate_context(&wl_cal_context);
+  if (result < 0) return result;
+
+  result = wl_cal_read_table_file(wl_cal_context, argv[1]);
+  if (result < 0)
+  {
+    wl_cal_free_context(&wl_cal_context);
+    return result;
+  }
+
+  result = wl_cal_write_table_binary(wl_cal_context, argv[2]);
+  wl_cal_free_context(&wl_cal_context);
+  if (result < 0) return result;
+
+  // read back to make sure the file is usable
+  result = wl_cal_allocate_context(&wl_cal_context);
+  if (result < 0) return result;
+
+  result = wl_cal_map_table_binary(wl_cal_context, argv[2]);
+  if (result == 0) result = wl_cal_verify_table_binary(wl_cal_context);
+  if (result == 0) printf("%s: %d points written to \"%s\"\n", argv[0], wl_cal_context->cal_data_size, argv[2]);
+
+  wl_cal_free_context(&wl_cal_context);
+  return result;
+}